@@ -3,7 +3,7 @@
 
 #include "plugin_api.h"
 
-void handle_directory_files(char *directory_path, struct plugin_list *plugins);
+void handle_directory_files(char **directory_paths, struct plugin_list *plugins);
 int evaluate_flags(int flag1, int flag2);
 
 #endif /* FILE_HANDLER_H */
@@ -3,12 +3,44 @@
 
 #include <getopt.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
 // Define option flags
 extern int option_A;
 extern int option_N;
 extern int option_O;
+// Sort found files before printing them
+extern int option_S;
+// Read files through io_uring when the kernel supports it
+extern int option_U;
+// Number of scan threads, 0 means one per CPU
+extern long option_j;
+// Verdict cache file (--cache), NULL when disabled
+extern char *option_cache_path;
+// Order the files of a directory by physical extent (--fiemap)
+extern int option_fiemap;
+// Output format of found files (--format), an enum result_format value
+extern int option_format;
+// Keep watching the tree for changes after the initial scan (--watch)
+extern int option_watch;
+// Share verdicts between files with identical contents (--dedup-content)
+extern int option_dedup_content;
+// Metadata prefilters (--min-size, --newer, --ext, ...), see scan_filter.h
+struct scan_filter;
+extern struct scan_filter option_filter;
+// File list to check besides the search paths (--files-from), "-" for stdin
+extern char *option_files_from;
+// Plugin statistics file (--plugin-stats), NULL when disabled
+extern char *option_plugin_stats_path;
+// Keep the plugin order of the command line (--fixed-order)
+extern int option_fixed_order;
+// Expression over plugin verdicts (--where) used instead of -A/-O, see scan_query.h
+extern char *option_where;
+// Most match offsets reported per plugin and file (--matches), 0 when off
+extern long option_matches;
+
+struct plugin_manifest_entry;
 
 struct plugin_option {
   /* Option in the format supported by getopt_long (man 3 getopt_long). */
@@ -26,14 +58,190 @@ struct plugin_info {
   size_t sup_opts_len;
   /* List of options supported by the plugin */
   struct plugin_option *sup_opts;
+  /*
+   * Capabilities. The host clears the structure before plugin_get_info, so
+   * plugins that leave them alone get every file, whole.
+   */
+  /* Files smaller than this never match and are not given to the plugin */
+  size_t min_size;
+  /* Only the first header_len bytes are looked at, 0 when there is no such limit */
+  size_t header_len;
+  /* The file is needed in one buffer: it is never fed in windows and never narrowed */
+  int whole_file;
+  /* The process functions may run in several threads at once, ABI 2 and later */
+  int thread_safe;
+};
+
+/* Byte range [offset, offset + len) of a file */
+struct plugin_range {
+  size_t offset;
+  size_t len;
+};
+
+/* Version of the plugin interface described below */
+#define PLUGIN_ABI_VERSION 2
+
+/* Most ranges plugin_get_ranges may ask for */
+#define PLUGIN_RANGES_MAX 8
+
+/* Contents of one file of a batch, see plugin_process_batch */
+struct plugin_buffer {
+  const void *data;
+  size_t len;
+};
+
+/* Bytes [offset, offset + len) of a file that a plugin matched */
+struct plugin_match {
+  size_t offset;
+  size_t len;
+  /* What was found there, NULL when the plugin does not say. The string must
+     stay valid until plugin_fini. */
+  const char *label;
+};
+
+/* Matches of the current file, see plugin_set_matches */
+struct plugin_matches {
+  /* Every match found, also those that did not fit in list */
+  size_t count;
+  /* The first len matches, at most capacity */
+  size_t len;
+  size_t capacity;
+  struct plugin_match *list;
+};
+
+/*
+ * Symbols exported by a plugin:
+ *   int plugin_get_info(struct plugin_info *ppi);
+ *   int plugin_process_file(const char *fname, struct option in_opts[], size_t in_opts_len);
+ *   int plugin_process_buffer(const void *data, size_t len, struct option in_opts[],
+ *                             size_t in_opts_len);
+ * At least one of the process functions is required. plugin_process_buffer is
+ * preferred: the host reads every file once and hands the same buffer to all
+ * plugins, it is only valid during the call. Both return 0 when the file
+ * matches, 1 when it does not and -1 on error.
+ *
+ * Optionally the arguments are parsed once, before the scan starts:
+ *   int plugin_init(struct option in_opts[], size_t in_opts_len, void **ctx);
+ *   int plugin_process_buffer_ctx(void *ctx, const void *data, size_t len);
+ *   void plugin_fini(void *ctx);
+ * plugin_init returns -1 for invalid arguments, which stops the program. A
+ * version 1 plugin has one context for all scan threads and must not modify
+ * it. A plugin exporting plugin_init must export the other two.
+ *
+ * A plugin with plugin_init may also take large files in windows, so that all
+ * plugins go over a window while it is in cache:
+ *   int plugin_stream_begin(void *ctx, size_t len, void **state);
+ *   int plugin_stream_feed(void *state, const void *chunk, size_t len, size_t offset);
+ *   int plugin_stream_finish(void *state);
+ * plugin_stream_begin gets the file size and returns -1 on error. Windows are
+ * fed in order; plugin_stream_feed returns PLUGIN_STREAM_CONTINUE to see more,
+ * or the verdict (0, 1, -1) once it is decided, then the file is not fed any
+ * further. plugin_stream_finish is called once for every begun file, returns
+ * the verdict of a file that was fed to the end and releases the state.
+ *
+ * A streaming plugin that only looks at parts of a file, depending on its
+ * arguments, may tell which:
+ *   int plugin_get_ranges(void *ctx, size_t len, struct plugin_range *ranges,
+ *                         size_t *ranges_len);
+ * It gets the file size and room for *ranges_len (PLUGIN_RANGES_MAX) ranges,
+ * and returns 0 with the ranges in increasing order, 1 when it needs the whole
+ * file or -1 on error. Only those ranges are then read (with pread when the
+ * file is not mapped anyway) and fed, so offsets skip the gaps.
+ *
+ * A plugin with plugin_init may also take many small files in one call:
+ *   int plugin_process_batch(void *ctx, const struct plugin_buffer *files, size_t count,
+ *                            int *verdicts);
+ * The host reads the small files of a directory together and hands them over
+ * at once, verdicts[i] gets the verdict of files[i] (0, 1, -1) as from
+ * plugin_process_buffer_ctx. It returns 0, or -1 when the whole batch failed.
+ * The same rules as for plugin_process_buffer_ctx apply to the context, the
+ * plugin may spread the files over threads of its own during the call.
+ *
+ * A version 2 plugin with plugin_init may tell where a file matched:
+ *   void plugin_set_matches(void *ctx, struct plugin_matches *matches);
+ * With --matches it is called once for every context, before the scan. The
+ * host clears count and len before each file; the plugin counts every match
+ * it finds and lists the first capacity of them with their file offsets, so
+ * it keeps looking after the first match. Files are then not given to
+ * plugin_process_batch, the list holds the matches of one file only. The
+ * plugin sets the label of every match it lists, NULL when it has none.
+ *
+ * Plugins built for version 2 of this interface say so with
+ *   const int plugin_abi_version = PLUGIN_ABI_VERSION;
+ * Plugins without it are version 1, those for a newer version are not loaded.
+ * For version 2 plugins:
+ *   - plugin_init is called once for every scan thread. A context is only
+ *     used by the thread it was made for, so it may hold scratch space.
+ *   - Setting plugin_info.thread_safe lets several threads call the process
+ *     and stream functions at once. Other plugins, and all version 1 plugins,
+ *     are called by one thread at a time.
+ *   - in_opts and the arguments in its .flag fields are shared by all threads,
+ *     they are never modified and stay valid until plugin_fini.
+ */
+#define PLUGIN_STREAM_CONTINUE 2
+
+/* Entry points of one plugin, from dlsym or from the built-in registry (plugin_registry.h) */
+struct plugin_entry_points {
+  int (*get_info)(struct plugin_info *);
+  int (*process_file)(const char *, struct option *, size_t);
+  int (*process_buffer)(const void *, size_t, struct option *, size_t);
+  int (*init)(struct option *, size_t, void **);
+  int (*process_ctx)(void *, const void *, size_t);
+  void (*fini)(void *);
+  int (*stream_begin)(void *, size_t, void **);
+  int (*stream_feed)(void *, const void *, size_t, size_t);
+  int (*stream_finish)(void *);
+  int (*get_ranges)(void *, size_t, struct plugin_range *, size_t *);
+  int (*process_batch)(void *, const struct plugin_buffer *, size_t, int *);
+  void (*set_matches)(void *, struct plugin_matches *);
+  /* plugin_abi_version, NULL for version 1 */
+  const int *abi_version;
 };
 
 struct loaded_plugin {
+  /* File name of the shared object */
+  char *name;
+  int (*get_info)(struct plugin_info *);
   int (*func)(const char *, struct option*, size_t);
+  /* Optional plugin_process_buffer, given the file contents mapped once by the host */
+  int (*process_buffer)(const void *, size_t, struct option*, size_t);
+  /* Optional plugin_init, plugin_process_buffer_ctx and plugin_fini */
+  int (*init)(struct option*, size_t, void**);
+  int (*process_ctx)(void *, const void *, size_t);
+  void (*fini)(void *);
+  /* Optional plugin_stream_begin, plugin_stream_feed and plugin_stream_finish */
+  int (*stream_begin)(void *, size_t, void **);
+  int (*stream_feed)(void *, const void *, size_t, size_t);
+  int (*stream_finish)(void *);
+  /* Optional plugin_get_ranges, only with the stream functions */
+  int (*get_ranges)(void *, size_t, struct plugin_range *, size_t *);
+  /* Optional plugin_process_batch, only with plugin_init */
+  int (*process_batch)(void *, const struct plugin_buffer *, size_t, int *);
+  /* Optional plugin_set_matches, only for version 2 plugins with plugin_init */
+  void (*set_matches)(void *, struct plugin_matches *);
+  /* Capabilities from plugin_info */
+  size_t min_size;
+  size_t header_len;
+  /* Interface version, and whether calls from several threads at once are allowed */
+  int abi_version;
+  int thread_safe;
+  /* Context returned by plugin_init, valid once 'ready' is set. Scan threads
+     of version 2 plugins have their own. */
+  void *ctx;
+  char ready;
   size_t opts_len;
   struct option *opts;
   char flag;
+  /* dlopen handle, NULL for plugins compiled into the program */
   void *handle;
+  /* Size and modification time of the shared object, or of the program for
+     plugins compiled into it, so that cached verdicts of a rebuilt plugin are
+     not used */
+  uint64_t file_size;
+  long long file_mtime_ns;
+  /* Manifest entry (plugin_manifest.h) of a plugin known from an earlier run
+     and not loaded yet: only the name and the options are set until then */
+  const struct plugin_manifest_entry *manifest;
 };
 
 struct plugin_list {
@@ -48,9 +256,19 @@ struct plugin_list_node {
 void add_plugin(struct plugin_list *list, struct loaded_plugin plugin);
 void clear_plugin_list(struct plugin_list *list);
 void filter_active_plugins(struct plugin_list *list);
+// Load the active plugins known from the manifest only, exits if one cannot be used
+void load_active_plugins(struct plugin_list *list);
+// Run plugin_init of the active plugins, exits if one rejects its arguments
+void init_active_plugins(struct plugin_list *list);
 void create_option_array(size_t count, struct option **options, struct plugin_list *list);
-void load_plugins_from_directory(const char *path, struct plugin_list *list, struct option **options);
+// Find the plugins of a directory. Plugins unchanged since they were recorded
+// in the manifest (NULL for none) are not loaded, see load_active_plugins.
+void load_plugins_from_directory(const char *path, const char *manifest_path,
+                                 struct plugin_list *list, struct option **options);
 char *get_plugin_directory_path(int argc, char *argv[]);
-char *parse_command_line_arguments(int argc, char *argv[], struct option *options, struct plugin_list *list);
+// Argument of --plugin-manifest, needed before the options can be parsed, or NULL
+const char *get_plugin_manifest_path(int argc, char *argv[]);
+// Parse the options and return the search paths as a NULL terminated array
+char **parse_command_line_arguments(int argc, char *argv[], struct option *options, struct plugin_list *list);
 
 #endif // PLUGIN_API_H
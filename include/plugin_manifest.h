@@ -0,0 +1,54 @@
+#ifndef PLUGIN_MANIFEST_H
+#define PLUGIN_MANIFEST_H
+
+#include "plugin_api.h"
+#include <stdint.h>
+
+/*
+ * Manifest of the plugins of earlier runs (--plugin-manifest): path, size,
+ * modification time, purpose and options of every plugin. A plugin whose
+ * file did not change since is not opened to learn its options, so the
+ * command line can be parsed without loading anything, and only the plugins
+ * it uses are loaded. The manifest is a text file with one record per line,
+ * fields separated by tabs:
+ *
+ *     plugin  SIZE  MTIME_NS  PATH
+ *     purpose TEXT
+ *     option  HAS_ARG  NAME  DESCRIPTION
+ *
+ * purpose and option lines belong to the plugin line before them.
+ */
+
+struct plugin_manifest_entry {
+    char *path;
+    uint64_t size;
+    long long mtime_ns;
+    char *purpose;
+    /* Options as plugin_get_info gives them, names and descriptions owned by the entry */
+    size_t opts_len;
+    struct plugin_option *opts;
+};
+
+struct plugin_manifest {
+    /* Entries keep their address while the manifest grows */
+    struct plugin_manifest_entry **entries;
+    size_t len;
+    size_t capacity;
+    /* Whether entries were added or replaced since the file was read */
+    int dirty;
+};
+
+// Read a manifest, -1 if there is none yet or it cannot be read
+int plugin_manifest_load(const char *path, struct plugin_manifest *manifest);
+// Entry of a plugin file, NULL when it is unknown or changed since
+const struct plugin_manifest_entry *plugin_manifest_find(const struct plugin_manifest *manifest,
+                                                         const char *path, uint64_t size,
+                                                         long long mtime_ns);
+// Record what plugin_get_info told about a plugin file, replacing an older entry
+int plugin_manifest_put(struct plugin_manifest *manifest, const char *path, uint64_t size,
+                        long long mtime_ns, const struct plugin_info *info);
+// Write the manifest if anything changed, through a temporary file
+int plugin_manifest_save(const char *path, struct plugin_manifest *manifest);
+void plugin_manifest_free(struct plugin_manifest *manifest);
+
+#endif /* PLUGIN_MANIFEST_H */
@@ -0,0 +1,56 @@
+#ifndef PLUGIN_REGISTRY_H
+#define PLUGIN_REGISTRY_H
+
+#include "plugin_api.h"
+
+/*
+ * Plugins compiled into the program by 'make static'. Every plugin/X.c is
+ * built with its entry points renamed to X_plugin_*, and the generated
+ * build/static/plugin_registry.c lists them with the macros below. Entry
+ * points a plugin does not define (plugin_abi_version included) are weak
+ * references and end up NULL.
+ */
+
+struct builtin_plugin {
+  /* Name the plugin has as a shared object, e.g. "libavg.so" */
+  const char *name;
+  struct plugin_entry_points entry;
+};
+
+extern const struct builtin_plugin builtin_plugins[];
+extern const size_t builtin_plugins_len;
+
+#define BUILTIN_PLUGIN_DECLARE(prefix)                                                            \
+  extern int prefix##_plugin_get_info(struct plugin_info *) __attribute__((weak));               \
+  extern int prefix##_plugin_process_file(const char *, struct option *, size_t)                 \
+      __attribute__((weak));                                                                     \
+  extern int prefix##_plugin_process_buffer(const void *, size_t, struct option *, size_t)       \
+      __attribute__((weak));                                                                     \
+  extern int prefix##_plugin_init(struct option *, size_t, void **) __attribute__((weak));       \
+  extern int prefix##_plugin_process_buffer_ctx(void *, const void *, size_t)                    \
+      __attribute__((weak));                                                                     \
+  extern void prefix##_plugin_fini(void *) __attribute__((weak));                                \
+  extern int prefix##_plugin_stream_begin(void *, size_t, void **) __attribute__((weak));        \
+  extern int prefix##_plugin_stream_feed(void *, const void *, size_t, size_t)                   \
+      __attribute__((weak));                                                                     \
+  extern int prefix##_plugin_stream_finish(void *) __attribute__((weak));                        \
+  extern int prefix##_plugin_get_ranges(void *, size_t, struct plugin_range *, size_t *)         \
+      __attribute__((weak));                                                                     \
+  extern int prefix##_plugin_process_batch(void *, const struct plugin_buffer *, size_t, int *)  \
+      __attribute__((weak));                                                                     \
+  extern void prefix##_plugin_set_matches(void *, struct plugin_matches *) __attribute__((weak)); \
+  extern const int prefix##_plugin_abi_version __attribute__((weak));
+
+#define BUILTIN_PLUGIN_ENTRY(prefix)                                                              \
+  {                                                                                              \
+    #prefix ".so",                                                                               \
+    {                                                                                            \
+      prefix##_plugin_get_info, prefix##_plugin_process_file, prefix##_plugin_process_buffer,    \
+      prefix##_plugin_init, prefix##_plugin_process_buffer_ctx, prefix##_plugin_fini,            \
+      prefix##_plugin_stream_begin, prefix##_plugin_stream_feed, prefix##_plugin_stream_finish,  \
+      prefix##_plugin_get_ranges, prefix##_plugin_process_batch, prefix##_plugin_set_matches,    \
+      &prefix##_plugin_abi_version                                                               \
+    }                                                                                            \
+  }
+
+#endif /* PLUGIN_REGISTRY_H */
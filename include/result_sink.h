@@ -0,0 +1,65 @@
+#ifndef RESULT_SINK_H
+#define RESULT_SINK_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct plugin_matches;
+
+enum result_format {
+    /* One path per line */
+    RESULT_FORMAT_PLAIN,
+    /* NUL terminated paths, for xargs -0 */
+    RESULT_FORMAT_NULL,
+    /* One JSON object per line with the plugin verdicts */
+    RESULT_FORMAT_JSONL,
+};
+
+enum plugin_verdict_state {
+    PLUGIN_VERDICT_SKIPPED,
+    PLUGIN_VERDICT_MATCH,
+    PLUGIN_VERDICT_NO_MATCH,
+};
+
+// Where the verdict of a found file came from
+enum result_origin {
+    RESULT_EVALUATED,
+    /* Copied from a hard link (or another path to the same inode) */
+    RESULT_SAME_INODE,
+    /* Copied from a file with identical contents */
+    RESULT_SAME_CONTENT,
+};
+
+struct plugin_verdict {
+    const char *plugin;
+    enum plugin_verdict_state state;
+    /* Taken from the verdict cache */
+    int cached;
+    /* Where the plugin matched (--matches), NULL when it did not say */
+    const struct plugin_matches *matches;
+};
+
+struct result_record {
+    const char *path;
+    off_t size;
+    /* Time spent evaluating the plugins */
+    long long elapsed_ns;
+    enum result_origin origin;
+    const struct plugin_verdict *verdicts;
+    size_t verdicts_len;
+};
+
+struct result_sink;
+
+// Parse a --format value, -1 if unknown
+int result_format_parse(const char *name, enum result_format *format);
+// Create a sink writing to 'fd' with one buffer per worker. A sorted sink keeps
+// the records until result_sink_close and writes them ordered by path.
+struct result_sink *result_sink_open(int fd, enum result_format format, size_t workers, int sorted);
+void result_sink_write(struct result_sink *sink, size_t worker, const struct result_record *record);
+// Write out everything still buffered, a sorted sink writes the records
+// collected so far in path order
+void result_sink_flush(struct result_sink *sink);
+void result_sink_close(struct result_sink *sink);
+
+#endif /* RESULT_SINK_H */
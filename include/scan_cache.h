@@ -0,0 +1,36 @@
+#ifndef SCAN_CACHE_H
+#define SCAN_CACHE_H
+
+#include <getopt.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct scan_cache;
+struct scan_entry;
+
+/*
+ * Persistent verdict cache.
+ *
+ * The cache file is an open addressing hash table mapped into memory. A slot
+ * is keyed by (dev, ino, plugin key), where the plugin key hashes the plugin
+ * name, size and mtime with its option arguments, and is only trusted while
+ * size, mtime and ctime of the file are unchanged. Arguments naming a regular
+ * file (a list of addresses, a signature file) add its dev, ino, size and
+ * mtime to the key, so editing such a file does not leave old verdicts.
+ * Slots that were not used by the last few scans are dropped whenever the
+ * table is rebuilt.
+ */
+
+// Open or create the cache, NULL if it cannot be used (the scan runs without it)
+struct scan_cache *scan_cache_open(const char *path);
+// Write back and unmap the cache
+void scan_cache_close(struct scan_cache *cache);
+// Key identifying a plugin build together with its option arguments
+uint64_t scan_cache_plugin_key(const char *name, uint64_t file_size, long long file_mtime_ns,
+                               const struct option *opts, size_t opts_len);
+// Cached plugin result (0 or 1) for the file, -1 if there is none
+int scan_cache_lookup(struct scan_cache *cache, const struct scan_entry *entry, uint64_t plugin_key);
+void scan_cache_store(struct scan_cache *cache, const struct scan_entry *entry, uint64_t plugin_key,
+                      int verdict);
+
+#endif /* SCAN_CACHE_H */
@@ -0,0 +1,61 @@
+#ifndef SCAN_DEDUP_H
+#define SCAN_DEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct plugin_matches;
+struct scan_dedup;
+struct scan_dir;
+struct scan_entry;
+struct scan_path;
+
+/*
+ * Verdict sharing between copies of the same file.
+ *
+ * Files that can be reached under several paths (hard links, and in content
+ * mode every file, which also covers bind mounts) are tracked by (dev, ino)
+ * and evaluated once. In content mode files of a size that was already seen
+ * are hashed (128 bit MurmurHash3) and reuse the verdict of an identical
+ * file. The first file of every size is only hashed once a second file of
+ * that size turns up, so files with a unique size are never read twice.
+ */
+
+enum scan_dedup_kind {
+    SCAN_DEDUP_NONE,
+    /* Same (dev, ino) as a file evaluated before */
+    SCAN_DEDUP_INODE,
+    /* Same size and content hash as a file evaluated before */
+    SCAN_DEDUP_CONTENT,
+};
+
+// Identity of a file between scan_dedup_find and scan_dedup_store
+struct scan_dedup_key {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    /* Whether the file is tracked by inode */
+    int by_inode;
+    /* Whether 'hash' holds the content hash */
+    int hashed;
+    uint64_t hash[2];
+};
+
+// Track copies of files evaluated by 'plugins_len' plugins, by inode and optionally by content
+struct scan_dedup *scan_dedup_open(size_t plugins_len, int by_content);
+void scan_dedup_close(struct scan_dedup *dedup);
+// Result of an earlier copy of the file (0 or 1) with its plugin states copied to
+// 'states', or -1 when the file has to be evaluated and then passed to scan_dedup_store.
+// 'data' may hold the file contents, otherwise the file is read relative to its directory
+// if needed. The full path is built in 'path' only for the first file of a size.
+// With --matches, 'matches' (one per plugin, NULL otherwise) receives the matches of the copy.
+int scan_dedup_find(struct scan_dedup *dedup, const struct scan_dir *dir,
+                    const struct scan_entry *entry, struct scan_path *path,
+                    const unsigned char *data, struct scan_dedup_key *key, unsigned char *states,
+                    struct plugin_matches *matches, enum scan_dedup_kind *kind);
+void scan_dedup_store(struct scan_dedup *dedup, const struct scan_dedup_key *key, int result,
+                      const unsigned char *states, const struct plugin_matches *matches);
+
+#endif /* SCAN_DEDUP_H */
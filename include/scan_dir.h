@@ -0,0 +1,105 @@
+#ifndef SCAN_DIR_H
+#define SCAN_DIR_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// A directory entry that survived the type and size checks. Entries live in
+// the arena of their directory and stay valid while the directory is retained.
+struct scan_entry {
+    /* Stat data, only filled in for regular files */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    nlink_t nlink;
+    uid_t uid;
+    gid_t gid;
+    mode_t mode;
+    long long mtime_ns;
+    long long ctime_ns;
+    /* DT_REG or DT_DIR */
+    unsigned char type;
+    size_t name_len;
+    char name[];
+};
+
+// Regular files of one directory handed out as a single task
+struct scan_batch {
+    size_t len;
+    struct scan_entry *entries[];
+};
+
+struct scan_arena_block;
+
+struct scan_arena {
+    struct scan_arena_block *head;
+};
+
+struct scan_dir {
+    /* NULL for a root directory */
+    struct scan_dir *parent;
+    /* Name inside the parent (entry of the parent arena), the root path, or
+       NULL for the holder of listed files */
+    const char *name;
+    size_t name_len;
+    /* Level below the scanned root, 0 for the root */
+    long depth;
+    /* Open descriptor used for *at() calls, also by the file tasks of the
+       directory, until the last reference goes. AT_FDCWD for the holder of
+       listed files. */
+    int fd;
+    atomic_size_t refs;
+    struct scan_arena arena;
+};
+
+// Reusable path buffer, one per worker
+struct scan_path {
+    char *data;
+    size_t capacity;
+};
+
+// Size of one getdents64 batch
+#define SCAN_DIRENTS_SIZE (256 * 1024)
+
+// Reusable directory reading buffer, one per worker
+struct scan_dirents {
+    unsigned char *data;
+    /* Records of the current batch, sorted by inode */
+    void **records;
+    size_t records_capacity;
+};
+
+typedef void (*scan_entry_handler)(struct scan_dir *dir, struct scan_entry *entry, void *arg);
+
+// Open a root directory, the returned directory holds one reference
+struct scan_dir *scan_dir_open_root(const char *path);
+// Holder for files named by path (--files-from) rather than found in a
+// directory, the result holds one reference
+struct scan_dir *scan_dir_open_list(void);
+// Open a subdirectory relative to its parent, the result holds one reference
+struct scan_dir *scan_dir_open_child(struct scan_dir *parent, const struct scan_entry *entry);
+// Read all entries in large batches and pass regular files and directories to
+// 'handler', in inode order within a batch. Return the number of subdirectories
+// or -1 on error.
+int scan_dir_read(struct scan_dir *dir, struct scan_dirents *buf, scan_entry_handler handler,
+                  void *arg);
+void scan_dirents_free(struct scan_dirents *buf);
+// Check a listed path like a directory entry and pass it to 'handler' with the
+// path as its name. Return 1 for a directory, 0 otherwise.
+int scan_dir_add_path(struct scan_dir *list, const char *path, scan_entry_handler handler,
+                      void *arg);
+// Physical position of the first extent of a file (FIEMAP), -1 if unknown
+int scan_entry_physical_offset(const struct scan_dir *dir, const struct scan_entry *entry,
+                               uint64_t *physical);
+// Allocate memory that lives as long as the directory, only while it is listed
+void *scan_dir_alloc(struct scan_dir *dir, size_t size);
+void scan_dir_retain(struct scan_dir *dir);
+void scan_dir_release(struct scan_dir *dir);
+// Build "<dir path>/<entry name>" into 'buf', entry may be NULL for the directory itself
+const char *scan_path_build(struct scan_path *buf, const struct scan_dir *dir,
+                            const struct scan_entry *entry);
+void scan_path_free(struct scan_path *buf);
+
+#endif /* SCAN_DIR_H */
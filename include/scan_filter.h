@@ -0,0 +1,68 @@
+#ifndef SCAN_FILTER_H
+#define SCAN_FILTER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct scan_entry;
+
+enum scan_filter_perm {
+    SCAN_FILTER_PERM_NONE,
+    /* Permission bits equal to the mode */
+    SCAN_FILTER_PERM_EXACT,
+    /* All bits of the mode set ("-MODE") */
+    SCAN_FILTER_PERM_ALL,
+    /* Any bit of the mode set ("/MODE") */
+    SCAN_FILTER_PERM_ANY,
+};
+
+// Predicates on the stat data of a file, checked before any plugin sees it
+struct scan_filter {
+    /* Set once any predicate is in effect */
+    int active;
+    off_t min_size;
+    /* -1 when unlimited */
+    off_t max_size;
+    /* mtime bounds in nanoseconds, 0 when unset */
+    long long newer_ns;
+    long long older_ns;
+    /* Deepest level of entries to look at (1: files in the root only), -1 when unlimited */
+    long max_depth;
+    /* -1 when unset */
+    long long uid;
+    long long gid;
+    enum scan_filter_perm perm_kind;
+    mode_t perm;
+    /* Lowercase extensions without the dot */
+    char **extensions;
+    size_t extensions_len;
+};
+
+#define SCAN_FILTER_INIT                                                                         \
+    {                                                                                            \
+        .active = 0, .min_size = 0, .max_size = -1, .newer_ns = 0, .older_ns = 0,                \
+        .max_depth = -1, .uid = -1, .gid = -1, .perm_kind = SCAN_FILTER_PERM_NONE, .perm = 0,  \
+        .extensions = NULL, .extensions_len = 0                                                  \
+    }
+
+// Option parsers, each returns -1 if the argument is invalid
+// Size in bytes with an optional k, M, G or T suffix (powers of 1024)
+int scan_filter_parse_size(const char *arg, off_t *size);
+// "@EPOCH", "YYYY-MM-DD[THH:MM[:SS]]" (local time) or an age such as "90m", "12h", "7d"
+int scan_filter_parse_time(const char *arg, long long *time_ns);
+// Owner given as a number or a user/group name
+int scan_filter_parse_owner(const char *arg, int group, long long *id);
+// "MODE", "-MODE" or "/MODE" with an octal mode, like find -perm
+int scan_filter_parse_perm(struct scan_filter *filter, const char *arg);
+// Comma separated list of extensions, added to those given before
+int scan_filter_add_extensions(struct scan_filter *filter, const char *arg);
+void scan_filter_free(struct scan_filter *filter);
+
+// Whether a regular file passes the filter. 'name' is its base name and
+// 'depth' its level below the root (1 for files in the root itself).
+int scan_filter_match(const struct scan_filter *filter, const struct scan_entry *entry,
+                      const char *name, long depth);
+// Whether entries of a directory at 'depth' (0 for the root) can still pass the depth limit
+int scan_filter_descend(const struct scan_filter *filter, long depth);
+
+#endif /* SCAN_FILTER_H */
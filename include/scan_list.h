@@ -0,0 +1,18 @@
+#ifndef SCAN_LIST_H
+#define SCAN_LIST_H
+
+/*
+ * Reader for explicit file lists (--files-from). Entries are separated by
+ * newlines or, when the list contains a NUL byte (find -print0, xargs -0
+ * style), by NUL bytes. Empty entries are skipped.
+ */
+
+struct scan_list;
+
+// Open a list file, "-" reads standard input
+struct scan_list *scan_list_open(const char *path);
+// Next path of the list or NULL at the end. The path stays valid until the next call.
+const char *scan_list_next(struct scan_list *list);
+void scan_list_close(struct scan_list *list);
+
+#endif /* SCAN_LIST_H */
@@ -0,0 +1,38 @@
+#ifndef SCAN_ORDER_H
+#define SCAN_ORDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Adaptive order of the plugin chain.
+ *
+ * Plugin verdicts are combined with AND (-A) or OR (-O) and the chain stops as
+ * soon as the result is settled: at the first mismatch for -A, at the first
+ * match for -O. The expected cost of a file is lowest when plugins run in
+ * increasing order of average cost divided by the chance of settling the
+ * result, so workers count for every plugin how often it ran, how long it
+ * took and how often it matched, and sort the chain by that from time to time.
+ * The counts can be kept in a text file between runs.
+ */
+
+struct scan_order_stats {
+    uint64_t calls;
+    uint64_t matches;
+    uint64_t total_ns;
+};
+
+// Expected cost of one call in nanoseconds and the chance that it matches
+void scan_order_estimate(const struct scan_order_stats *stats, double *cost, double *chance);
+// Sort 'order' (plugin indices) by expected cost per settled file. Ties keep
+// the list order. 'settle_on_match' is set when a match settles the result (-O).
+void scan_order_sort(const struct scan_order_stats *stats, size_t len, int settle_on_match,
+                     size_t *order);
+// Add the counts saved for the plugins with these keys, -1 if the file cannot be read
+int scan_order_load(const char *path, const uint64_t *keys, size_t len,
+                    struct scan_order_stats *stats);
+// Save the counts of these plugins, keeping those of other plugins in the file
+int scan_order_save(const char *path, const uint64_t *keys, const char *const *names, size_t len,
+                    const struct scan_order_stats *stats);
+
+#endif /* SCAN_ORDER_H */
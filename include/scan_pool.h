@@ -0,0 +1,47 @@
+#ifndef SCAN_POOL_H
+#define SCAN_POOL_H
+
+#include <stddef.h>
+
+enum scan_task_kind {
+    SCAN_TASK_DIR,
+    SCAN_TASK_FILE,
+    SCAN_TASK_FILES,
+    /* Read the next part of the file list, 'dir' is NULL */
+    SCAN_TASK_LIST,
+};
+
+struct scan_batch;
+struct scan_dir;
+struct scan_entry;
+
+struct scan_task {
+    enum scan_task_kind kind;
+    /* Directory holding the entry, the task owns one reference */
+    struct scan_dir *dir;
+    /* NULL when 'dir' itself has to be listed */
+    struct scan_entry *entry;
+    /* Files of 'dir' for SCAN_TASK_FILES */
+    struct scan_batch *batch;
+};
+
+struct scan_pool;
+
+/* Called by a worker for every task it takes; the handler owns the task */
+typedef void (*scan_task_handler)(struct scan_pool *pool, size_t worker,
+                                  struct scan_task task, void *arg);
+/* Called for every task dropped by an aborted scan */
+typedef void (*scan_task_discard)(struct scan_task task, void *arg);
+
+// Run the tasks reachable from 'roots' on 'workers' threads, return 0 on success
+// or -1 if the scan was aborted
+int scan_pool_run(size_t workers, const struct scan_task *roots, size_t roots_len,
+                  scan_task_handler handler, scan_task_discard discard, void *arg);
+// Queue a new task on the deque of the calling worker
+void scan_pool_push(struct scan_pool *pool, size_t worker, struct scan_task task);
+// Stop all workers, queued tasks are discarded
+void scan_pool_abort(struct scan_pool *pool);
+// Number of online CPUs, at least 1
+size_t scan_pool_default_workers(void);
+
+#endif /* SCAN_POOL_H */
@@ -0,0 +1,48 @@
+#ifndef SCAN_QUERY_H
+#define SCAN_QUERY_H
+
+#include "scan_order.h"
+#include <stddef.h>
+
+/*
+ * Boolean expressions over plugin verdicts (--where), for example
+ *
+ *     (entropy AND NOT ipv4-addr-bin) OR seq-num
+ *
+ * A name stands for the verdict of one plugin: one of the options given to it
+ * or the name of its library. AND, OR and NOT (also &&, || and !) are case
+ * insensitive, NOT binds tighter than AND, AND tighter than OR.
+ *
+ * The expression is compiled once into a plan of nodes. Nested ANDs and ORs
+ * are flattened and double negations removed. The plan short-circuits, and
+ * the operands of every AND and OR can be put in order of expected cost per
+ * decided result (scan_query_order), so cheap and decisive parts run first.
+ * The operand order lives in a separate array so that every worker can keep
+ * its own.
+ */
+
+struct scan_query;
+
+// Plugin index for a name of the expression, -1 if no plugin has it
+typedef long (*scan_query_resolve)(const char *name, void *arg);
+// Verdict of a plugin: 1 when it matches, 0 when not, -1 on error
+typedef int (*scan_query_leaf)(size_t plugin, void *arg);
+
+// Compile an expression, NULL (with the reason logged) when it is invalid
+struct scan_query *scan_query_compile(const char *text, scan_query_resolve resolve, void *arg);
+void scan_query_free(struct scan_query *query);
+// Whether the expression refers to this plugin
+int scan_query_uses(const struct scan_query *query, size_t plugin);
+
+// Operand order as compiled, to be copied into a buffer of scan_query_order_len entries
+size_t scan_query_order_len(const struct scan_query *query);
+const size_t *scan_query_initial_order(const struct scan_query *query);
+// Sort the operands of every AND and OR in 'order' by the statistics of the plugins
+void scan_query_order(const struct scan_query *query, const struct scan_order_stats *stats,
+                      size_t *order);
+
+// Evaluate the expression with the operands in 'order': 1 true, 0 false, -1 on error
+int scan_query_eval(const struct scan_query *query, const size_t *order, scan_query_leaf leaf,
+                    void *arg);
+
+#endif /* SCAN_QUERY_H */
@@ -0,0 +1,31 @@
+#ifndef SCAN_WATCH_H
+#define SCAN_WATCH_H
+
+/*
+ * Change notification for a directory tree.
+ *
+ * fanotify is used when the process may mark whole filesystems (it needs
+ * CAP_SYS_ADMIN): one mark per filesystem under the root covers the tree
+ * without per-directory watches. Otherwise every directory of the tree gets
+ * an inotify watch, new and moved-in directories are added as they appear.
+ */
+
+enum scan_watch_kind {
+    /* A file was written and closed, or moved into the tree */
+    SCAN_WATCH_FILE,
+    /* A directory appeared (or events were lost), its whole tree has to be scanned */
+    SCAN_WATCH_TREE,
+};
+
+struct scan_watch;
+
+typedef void (*scan_watch_handler)(enum scan_watch_kind kind, const char *path, void *arg);
+
+// Start watching the tree under 'root', NULL if neither backend can be used
+struct scan_watch *scan_watch_open(const char *root);
+// Block until changes arrive and pass each of them to 'handler'. Return 0 after
+// one batch of events, -1 on error or when interrupted by a signal (errno EINTR).
+int scan_watch_wait(struct scan_watch *watch, scan_watch_handler handler, void *arg);
+void scan_watch_close(struct scan_watch *watch);
+
+#endif /* SCAN_WATCH_H */
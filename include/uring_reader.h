@@ -0,0 +1,34 @@
+#ifndef URING_READER_H
+#define URING_READER_H
+
+#include <stddef.h>
+
+struct scan_entry;
+struct uring_ring;
+
+// Number of files kept in flight per worker
+#define URING_READER_DEPTH 64
+// Larger files are left to the synchronous path
+#define URING_READER_MAX_FILE_SIZE (16 * 1024 * 1024)
+
+struct uring_reader {
+    struct uring_ring *ring;
+};
+
+/*
+ * Called once per entry as soon as its content is in memory. 'data' is NULL
+ * when the file could not be read asynchronously (too big, open or read
+ * error), the caller then falls back to the synchronous path.
+ * Return -1 to stop the batch.
+ */
+typedef int (*uring_read_handler)(size_t index, const unsigned char *data, size_t len, void *arg);
+
+// Set up a ring, return 0 on success or -1 if io_uring is not available
+int uring_reader_init(struct uring_reader *reader);
+void uring_reader_exit(struct uring_reader *reader);
+// Open and read 'entries' relative to 'dirfd' with up to URING_READER_DEPTH
+// requests in flight, return 0 or -1 if the handler stopped the batch
+int uring_reader_run(struct uring_reader *reader, int dirfd, struct scan_entry *const *entries,
+                     size_t len, uring_read_handler handler, void *arg);
+
+#endif /* URING_READER_H */
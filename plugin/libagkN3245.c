@@ -19,19 +19,31 @@ struct plugin_info {
     const char *plugin_author;
     size_t sup_opts_len;
     struct plugin_option *sup_opts;
+    size_t min_size;
+    size_t header_len;
+    int whole_file;
+    int thread_safe;
 };
 
+// Version of the plugin interface this plugin is built for
+const int plugin_abi_version = 2;
+
 static char *g_lib_name = "libipv4.so";
 static struct plugin_option g_pi[] = {
-    {{"ipv4-addr-bin", required_argument, NULL, 0}, "Поиск файлов, содержащих заданный IPv4-адрес в бинарной форме"},
+    {{"ipv4-addr-bin", required_argument, NULL, 0}, "Поиск файлов, содержащих заданный IPv4-адрес в бинарной форме (несколько адресов и сетей A.B.C.D/N через запятую)"},
+    {{"ipv4-addr-list", required_argument, NULL, 0}, "Файл с IPv4-адресами и сетями A.B.C.D/N для поиска, по одному в строке"},
     {{NULL, 0, NULL, 0}, NULL} // Terminate the array
 };
 
 int plugin_get_info(struct plugin_info *ppi) {
-    ppi->plugin_purpose = "Поиск файлов, содержащих заданный IPv4-адрес в бинарной форме";
+    ppi->plugin_purpose = "Поиск файлов, содержащих заданные IPv4-адреса или сети в бинарной форме";
     ppi->plugin_author = "Ваше Имя, NXXXX";
-    ppi->sup_opts_len = 1;
+    ppi->sup_opts_len = 2;
     ppi->sup_opts = g_pi;
+    // A file shorter than an address cannot contain it
+    ppi->min_size = 4;
+    // Nothing is shared between calls but the parsed addresses
+    ppi->thread_safe = 1;
     return 0;
 }
 
@@ -44,27 +56,671 @@ int parse_ipv4_address(const char *str, uint32_t *addr) {
     return 1;
 }
 
-int plugin_process_file(const char *fname, struct option in_opts[], size_t in_opts_len) {
-    char *DEBUG = getenv("LAB1DEBUG");
+// Whether the four bytes at 'p' are the address in either byte order
+static inline int is_address(const char *p, uint32_t target_ip, uint32_t swapped_ip) {
+    uint32_t addr;
+    memcpy(&addr, p, sizeof(addr));
+    return addr == target_ip || addr == swapped_ip;
+}
+
+// Offset of the first address in 'data', 'len' when there is none
+static size_t find_address_scalar(const char *data, size_t len, uint32_t target_ip) {
+    uint32_t swapped_ip = __builtin_bswap32(target_ip);
+    for (size_t i = 0; i + 4 <= len; i++) {
+        if (is_address(data + i, target_ip, swapped_ip)) {
+            return i;
+        }
+    }
+    return len;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/*
+ * Vector kernels: positions whose first and last byte match the address in
+ * one of its byte orders are candidates, and only those are compared in full.
+ * Both byte orders are filtered in the same pass, the tail that does not fill
+ * a vector is left to the scalar loop.
+ */
+
+// Verify the candidates of one block, 'mask' has a bit per position from 'base'.
+// Offset of the first address, 'len' when none of them is one.
+static inline size_t check_candidates(const char *data, size_t len, size_t base, uint64_t mask,
+                                      uint32_t target_ip, uint32_t swapped_ip) {
+    while (mask) {
+        size_t offset = base + (size_t)__builtin_ctzll(mask);
+        if (is_address(data + offset, target_ip, swapped_ip)) {
+            return offset;
+        }
+        mask &= mask - 1;
+    }
+    return len;
+}
+
+__attribute__((target("sse2"))) static size_t find_address_sse2(const char *data, size_t len,
+                                                                 uint32_t target_ip) {
+    uint32_t swapped_ip = __builtin_bswap32(target_ip);
+    const __m128i first = _mm_set1_epi8((char)(target_ip & 0xff));
+    const __m128i last = _mm_set1_epi8((char)(target_ip >> 24));
+    const __m128i swapped_first = _mm_set1_epi8((char)(swapped_ip & 0xff));
+    const __m128i swapped_last = _mm_set1_epi8((char)(swapped_ip >> 24));
+    size_t i = 0;
+    for (; i + 3 + 16 <= len; i += 16) {
+        __m128i head = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i tail = _mm_loadu_si128((const __m128i *)(data + i + 3));
+        __m128i hits = _mm_or_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)),
+            _mm_and_si128(_mm_cmpeq_epi8(head, swapped_first), _mm_cmpeq_epi8(tail, swapped_last)));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(hits);
+        size_t found = mask ? check_candidates(data, len, i, mask, target_ip, swapped_ip) : len;
+        if (found != len) {
+            return found;
+        }
+    }
+    return i + find_address_scalar(data + i, len - i, target_ip);
+}
+
+__attribute__((target("avx2"))) static size_t find_address_avx2(const char *data, size_t len,
+                                                                 uint32_t target_ip) {
+    uint32_t swapped_ip = __builtin_bswap32(target_ip);
+    const __m256i first = _mm256_set1_epi8((char)(target_ip & 0xff));
+    const __m256i last = _mm256_set1_epi8((char)(target_ip >> 24));
+    const __m256i swapped_first = _mm256_set1_epi8((char)(swapped_ip & 0xff));
+    const __m256i swapped_last = _mm256_set1_epi8((char)(swapped_ip >> 24));
+    size_t i = 0;
+    for (; i + 3 + 32 <= len; i += 32) {
+        __m256i head = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i tail = _mm256_loadu_si256((const __m256i *)(data + i + 3));
+        __m256i hits = _mm256_or_si256(
+            _mm256_and_si256(_mm256_cmpeq_epi8(head, first), _mm256_cmpeq_epi8(tail, last)),
+            _mm256_and_si256(_mm256_cmpeq_epi8(head, swapped_first),
+                             _mm256_cmpeq_epi8(tail, swapped_last)));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(hits);
+        size_t found = mask ? check_candidates(data, len, i, mask, target_ip, swapped_ip) : len;
+        if (found != len) {
+            return found;
+        }
+    }
+    return i + find_address_scalar(data + i, len - i, target_ip);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static size_t find_address_avx512(const char *data,
+                                                                               size_t len,
+                                                                               uint32_t target_ip) {
+    uint32_t swapped_ip = __builtin_bswap32(target_ip);
+    const __m512i first = _mm512_set1_epi8((char)(target_ip & 0xff));
+    const __m512i last = _mm512_set1_epi8((char)(target_ip >> 24));
+    const __m512i swapped_first = _mm512_set1_epi8((char)(swapped_ip & 0xff));
+    const __m512i swapped_last = _mm512_set1_epi8((char)(swapped_ip >> 24));
+    size_t i = 0;
+    for (; i + 3 + 64 <= len; i += 64) {
+        __m512i head = _mm512_loadu_si512((const void *)(data + i));
+        __m512i tail = _mm512_loadu_si512((const void *)(data + i + 3));
+        uint64_t mask =
+            (_mm512_cmpeq_epi8_mask(head, first) & _mm512_cmpeq_epi8_mask(tail, last)) |
+            (_mm512_cmpeq_epi8_mask(head, swapped_first) & _mm512_cmpeq_epi8_mask(tail, swapped_last));
+        size_t found = mask ? check_candidates(data, len, i, mask, target_ip, swapped_ip) : len;
+        if (found != len) {
+            return found;
+        }
+    }
+    return i + find_address_scalar(data + i, len - i, target_ip);
+}
+#endif
+
+// Kernel for this CPU, picked once when the plugin is loaded. LAB1_IPV4_SCALAR in the
+// environment keeps the plain loop, to compare results and speed against it
+static size_t (*g_find_address)(const char *, size_t, uint32_t) = find_address_scalar;
+
+__attribute__((constructor)) static void select_find_address(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (getenv("LAB1_IPV4_SCALAR")) {
+        return;
+    }
+    if (__builtin_cpu_supports("avx512bw")) {
+        g_find_address = find_address_avx512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        g_find_address = find_address_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        g_find_address = find_address_sse2;
+    }
+#endif
+}
+
+static size_t find_address(const char *data, size_t len, uint32_t target_ip) {
+    return g_find_address(data, len, target_ip);
+}
+
+// An address (prefix 32) or a network to look for, in host byte order
+struct ipv4_indicator {
+    uint32_t addr;
+    int prefix;
+};
+
+/*
+ * Addresses and networks searched for in one pass. The first 16 bits of an
+ * address are the first two bytes of a window in network order and the last
+ * two in reversed order, so every window is checked against two bitmaps of
+ * those bytes as they are loaded. Windows that pass are read as addresses in
+ * both byte orders and looked up in a hash set of addresses (networks
+ * narrower than /24 are expanded into it) and in a bitmap of the /24 blocks
+ * that the wider networks cover. Which of those networks holds an address is
+ * found by binary search in groups of one prefix length. A single address
+ * skips all that and goes to the vector kernels.
+ */
+// Network of /24 or wider and the indicator it comes from
+struct ipv4_network {
+    uint32_t addr;
+    int prefix;
+    uint32_t indicator;
+};
+
+// Networks of one prefix length, a sorted slice of ipv4_set.networks
+struct ipv4_group {
+    int prefix;
+    size_t start;
+    size_t len;
+};
+
+struct ipv4_set {
+    struct ipv4_indicator *indicators;
+    size_t len;
+    size_t capacity;
+    /* 2^16 bits each, indexed by the first and by the last two bytes of a window */
+    uint64_t *head16;
+    uint64_t *tail16;
+    /* 2^24 bits, one per /24 block, NULL without networks of /24 or wider */
+    uint64_t *blocks;
+    /* Those networks by prefix length, longest first, then by address and indicator */
+    struct ipv4_network *networks;
+    size_t networks_len;
+    struct ipv4_group groups[25];
+    size_t groups_len;
+    /* Open addressing, values are indicator indexes plus one, 0 for a free slot */
+    uint32_t *keys;
+    uint32_t *values;
+    size_t hash_mask;
+};
+
+struct ipv4_match {
+    size_t offset;
+    size_t indicator;
+    /* The address is stored least significant byte first */
+    int reversed;
+};
+
+static uint32_t prefix_mask(int prefix) {
+    return prefix ? 0xffffffffu << (32 - prefix) : 0;
+}
+
+static int test_bit(const uint64_t *bits, uint32_t index) {
+    return (bits[index >> 6] >> (index & 63)) & 1;
+}
+
+static void set_bits(uint64_t *bits, uint32_t first, uint32_t last) {
+    for (uint64_t index = first; index <= last; index++) {
+        bits[index >> 6] |= 1ull << (index & 63);
+    }
+}
+
+static size_t hash_slot(uint32_t addr, size_t mask) {
+    addr ^= addr >> 16;
+    addr *= 0x45d9f3bu;
+    addr ^= addr >> 16;
+    return addr & mask;
+}
+
+// Parse "A.B.C.D" or "A.B.C.D/N", 0 if it is neither
+static int parse_indicator(const char *str, struct ipv4_indicator *indicator) {
+    char text[INET_ADDRSTRLEN + 4];
+    size_t len = strlen(str);
+    if (len >= sizeof(text)) {
+        return 0;
+    }
+    memcpy(text, str, len + 1);
+    indicator->prefix = 32;
+    char *slash = strchr(text, '/');
+    if (slash) {
+        char *endptr = NULL;
+        long prefix = strtol(slash + 1, &endptr, 10);
+        if (slash[1] == '\0' || *endptr != '\0' || prefix < 0 || prefix > 32) {
+            return 0;
+        }
+        indicator->prefix = (int)prefix;
+        *slash = '\0';
+    }
+    uint32_t addr;
+    if (!parse_ipv4_address(text, &addr)) {
+        return 0;
+    }
+    indicator->addr = ntohl(addr) & prefix_mask(indicator->prefix);
+    return 1;
+}
+
+static int add_indicator(struct ipv4_set *set, const struct ipv4_indicator *indicator) {
+    if (set->len == set->capacity) {
+        size_t capacity = set->capacity ? set->capacity * 2 : 16;
+        struct ipv4_indicator *indicators =
+            realloc(set->indicators, capacity * sizeof(struct ipv4_indicator));
+        if (!indicators) {
+            return -1;
+        }
+        set->indicators = indicators;
+        set->capacity = capacity;
+    }
+    set->indicators[set->len++] = *indicator;
+    return 0;
+}
+
+// Add the indicators of a comma separated list, 0 if one of them is invalid
+static int add_indicator_list(struct ipv4_set *set, const char *list) {
+    char *copy = strdup(list);
+    if (!copy) {
+        return 0;
+    }
+    int valid = 1;
+    char *saveptr = NULL;
+    for (char *item = strtok_r(copy, ",", &saveptr); item && valid;
+         item = strtok_r(NULL, ",", &saveptr)) {
+        struct ipv4_indicator indicator;
+        valid = parse_indicator(item, &indicator) && add_indicator(set, &indicator) == 0;
+    }
+    free(copy);
+    return valid && set->len > 0;
+}
+
+// Add the indicators of a file, one per line, '#' starts a comment.
+// -1 if it cannot be read, the number of the invalid line if there is one.
+static long add_indicator_file(struct ipv4_set *set, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    char line[256];
+    long line_no = 0;
+    long status = 0;
+    while (status == 0 && fgets(line, sizeof(line), file)) {
+        line_no++;
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        char *start = line;
+        while (*start == ' ' || *start == '\t') {
+            start++;
+        }
+        char *end = start + strlen(start);
+        while (end > start && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' ||
+                               end[-1] == '\r')) {
+            *--end = '\0';
+        }
+        struct ipv4_indicator indicator;
+        if (*start != '\0' &&
+            (!parse_indicator(start, &indicator) || add_indicator(set, &indicator) == -1)) {
+            status = line_no;
+        }
+    }
+    fclose(file);
+    return status;
+}
+
+// Whether the set is one address, searched with the vector kernels
+static int single_address(const struct ipv4_set *set) {
+    return set->len == 1 && set->indicators[0].prefix == 32;
+}
+
+static int compare_networks(const void *a, const void *b) {
+    const struct ipv4_network *x = a;
+    const struct ipv4_network *y = b;
+    if (x->prefix != y->prefix) {
+        return y->prefix - x->prefix;
+    }
+    if (x->addr != y->addr) {
+        return x->addr < y->addr ? -1 : 1;
+    }
+    return x->indicator < y->indicator ? -1 : x->indicator > y->indicator;
+}
+
+// Sort the networks of /24 and wider and cut them into groups of one prefix length
+static int build_networks(struct ipv4_set *set) {
+    set->networks = malloc(set->len * sizeof(struct ipv4_network));
+    if (!set->networks) {
+        return -1;
+    }
+    for (size_t i = 0; i < set->len; i++) {
+        if (set->indicators[i].prefix <= 24) {
+            struct ipv4_network *network = &set->networks[set->networks_len++];
+            network->addr = set->indicators[i].addr;
+            network->prefix = set->indicators[i].prefix;
+            network->indicator = (uint32_t)i;
+        }
+    }
+    qsort(set->networks, set->networks_len, sizeof(struct ipv4_network), compare_networks);
+    for (size_t i = 0; i < set->networks_len; i++) {
+        if (i == 0 || set->networks[i].prefix != set->networks[i - 1].prefix) {
+            struct ipv4_group *group = &set->groups[set->groups_len++];
+            group->prefix = set->networks[i].prefix;
+            group->start = i;
+            group->len = 0;
+        }
+        set->groups[set->groups_len - 1].len++;
+    }
+    return 0;
+}
+
+// Fill the bitmaps and the hash set once every indicator is added
+static int build_set(struct ipv4_set *set) {
+    if (single_address(set)) {
+        return 0;
+    }
+    size_t expanded = 0;
+    for (size_t i = 0; i < set->len; i++) {
+        if (set->indicators[i].prefix > 24) {
+            expanded += (size_t)1 << (32 - set->indicators[i].prefix);
+        } else if (!set->blocks) {
+            set->blocks = calloc((1u << 24) / 64, sizeof(uint64_t));
+            if (!set->blocks || build_networks(set) == -1) {
+                return -1;
+            }
+        }
+    }
+    size_t slots = 16;
+    while (slots < expanded * 2) {
+        slots *= 2;
+    }
+    set->hash_mask = slots - 1;
+    set->head16 = calloc((1u << 16) / 64, sizeof(uint64_t));
+    set->tail16 = calloc((1u << 16) / 64, sizeof(uint64_t));
+    set->keys = calloc(slots, sizeof(uint32_t));
+    set->values = calloc(slots, sizeof(uint32_t));
+    if (!set->head16 || !set->tail16 || !set->keys || !set->values) {
+        return -1;
+    }
+    for (size_t i = 0; i < set->len; i++) {
+        const struct ipv4_indicator *indicator = &set->indicators[i];
+        uint32_t last = indicator->addr | ~prefix_mask(indicator->prefix);
+        for (uint32_t top = indicator->addr >> 16; top <= last >> 16; top++) {
+            // Bytes of the address in network order, then as the end of a reversed window
+            unsigned char bytes[2] = {(unsigned char)(top >> 8), (unsigned char)top};
+            uint16_t head;
+            memcpy(&head, bytes, sizeof(head));
+            set_bits(set->head16, head, head);
+            set_bits(set->tail16, __builtin_bswap16(head), __builtin_bswap16(head));
+        }
+        if (indicator->prefix <= 24) {
+            set_bits(set->blocks, indicator->addr >> 8, last >> 8);
+            continue;
+        }
+        for (uint64_t addr = indicator->addr; addr <= last; addr++) {
+            size_t slot = hash_slot((uint32_t)addr, set->hash_mask);
+            while (set->values[slot] && set->keys[slot] != addr) {
+                slot = (slot + 1) & set->hash_mask;
+            }
+            // An address listed twice is reported as its first indicator
+            if (!set->values[slot]) {
+                set->keys[slot] = (uint32_t)addr;
+                set->values[slot] = (uint32_t)i + 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void free_set(struct ipv4_set *set) {
+    free(set->indicators);
+    free(set->head16);
+    free(set->tail16);
+    free(set->blocks);
+    free(set->networks);
+    free(set->keys);
+    free(set->values);
+}
+
+// Whether an address in host byte order is in the set, and which indicator has it
+static int lookup_address(const struct ipv4_set *set, uint32_t addr, size_t *indicator) {
+    for (size_t slot = hash_slot(addr, set->hash_mask); set->values[slot];
+         slot = (slot + 1) & set->hash_mask) {
+        if (set->keys[slot] == addr) {
+            *indicator = set->values[slot] - 1;
+            return 1;
+        }
+    }
+    if (!set->blocks || !test_bit(set->blocks, addr >> 8)) {
+        return 0;
+    }
+    // The first indicator listed among the networks holding the address
+    int found = 0;
+    for (size_t g = 0; g < set->groups_len; g++) {
+        const struct ipv4_group *group = &set->groups[g];
+        uint32_t key = addr & prefix_mask(group->prefix);
+        size_t low = group->start;
+        size_t high = group->start + group->len;
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            if (set->networks[mid].addr < key) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        if (low < group->start + group->len && set->networks[low].addr == key &&
+            (!found || set->networks[low].indicator < *indicator)) {
+            *indicator = set->networks[low].indicator;
+            found = 1;
+        }
+    }
+    return found;
+}
+
+// Find the first window holding an indicator in either byte order
+static int find_match(const struct ipv4_set *set, const unsigned char *data, size_t len,
+                      struct ipv4_match *match) {
+    if (single_address(set)) {
+        uint32_t target_ip = htonl(set->indicators[0].addr);
+        size_t offset = find_address((const char *)data, len, target_ip);
+        if (offset == len) {
+            return 0;
+        }
+        match->offset = offset;
+        match->indicator = 0;
+        match->reversed = memcmp(data + offset, &target_ip, sizeof(target_ip)) != 0;
+        return 1;
+    }
+    for (size_t i = 0; i + 4 <= len; i++) {
+        const unsigned char *p = data + i;
+        uint16_t head;
+        uint16_t tail;
+        memcpy(&head, p, sizeof(head));
+        memcpy(&tail, p + 2, sizeof(tail));
+        if (!test_bit(set->head16, head) && !test_bit(set->tail16, tail)) {
+            continue;
+        }
+        uint32_t forward = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+        uint32_t reversed = __builtin_bswap32(forward);
+        if (lookup_address(set, forward, &match->indicator)) {
+            match->reversed = 0;
+        } else if (lookup_address(set, reversed, &match->indicator)) {
+            match->reversed = 1;
+        } else {
+            continue;
+        }
+        match->offset = i;
+        return 1;
+    }
+    return 0;
+}
+
+// Match offsets of one file (--matches), as in plugin_api.h
+struct plugin_match {
+    size_t offset;
+    size_t len;
+    const char *label;
+};
+struct plugin_matches {
+    size_t count;
+    size_t len;
+    size_t capacity;
+    struct plugin_match *list;
+};
+
+// Arguments parsed once by plugin_init
+// Room for "255.255.255.255/32 reversed"
+#define LABEL_SIZE 28
+
+struct ipv4_ctx {
+    struct ipv4_set set;
+    int debug;
+    /* Set by plugin_set_matches, NULL without --matches */
+    struct plugin_matches *matches;
+    /* Labels of the matches, "A.B.C.D/N" and "A.B.C.D/N reversed" for every indicator,
+       NULL without --matches */
+    char *labels;
+};
+
+static void free_ctx(struct ipv4_ctx *ipv4) {
+    free_set(&ipv4->set);
+    free(ipv4->labels);
+}
+
+// Write the labels of both byte orders of every indicator, -1 when out of memory
+static int build_labels(struct ipv4_ctx *ipv4) {
+    ipv4->labels = malloc(ipv4->set.len * 2 * LABEL_SIZE);
+    if (!ipv4->labels) {
+        return -1;
+    }
+    for (size_t i = 0; i < ipv4->set.len; i++) {
+        const struct ipv4_indicator *indicator = &ipv4->set.indicators[i];
+        uint32_t addr = htonl(indicator->addr);
+        char text[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr, text, sizeof(text));
+        char *label = ipv4->labels + i * 2 * LABEL_SIZE;
+        if (indicator->prefix == 32) {
+            snprintf(label, LABEL_SIZE, "%s", text);
+            snprintf(label + LABEL_SIZE, LABEL_SIZE, "%s reversed", text);
+        } else {
+            snprintf(label, LABEL_SIZE, "%s/%d", text, indicator->prefix);
+            snprintf(label + LABEL_SIZE, LABEL_SIZE, "%s/%d reversed", text, indicator->prefix);
+        }
+    }
+    return 0;
+}
+
+// Check the options and build the set of addresses, -1 if they are invalid
+static int parse_options(const char *DEBUG, struct option in_opts[], size_t in_opts_len,
+                         struct ipv4_ctx *ipv4) {
+    memset(&ipv4->set, 0, sizeof(ipv4->set));
+    ipv4->debug = DEBUG != NULL;
+    ipv4->matches = NULL;
+    ipv4->labels = NULL;
     if (DEBUG) {
-        fprintf(stderr, "DEBUG: %s: Checking file '%s'\n", g_lib_name, fname);
         for (size_t i = 0; i < in_opts_len; i++) {
             fprintf(stderr, "DEBUG: %s: Got option '%s' with arg '%s'\n", g_lib_name, in_opts[i].name, (char *)in_opts[i].flag);
         }
     }
 
-    if (in_opts_len != 1 || strcmp(in_opts[0].name, "ipv4-addr-bin") != 0) {
+    for (size_t i = 0; i < in_opts_len; i++) {
+        const char *arg = (const char *)in_opts[i].flag;
+        if (strcmp(in_opts[i].name, "ipv4-addr-bin") == 0) {
+            if (!add_indicator_list(&ipv4->set, arg)) {
+                fprintf(stdout, "Неверный аргумент опции ipv4-addr-bin\n");
+                if (DEBUG) {
+                    fprintf(stderr, "DEBUG: %s: Invalid IPv4 address argument for 'ipv4-addr-bin'\n", g_lib_name);
+                }
+                free_ctx(ipv4);
+                return -1;
+            }
+        } else if (strcmp(in_opts[i].name, "ipv4-addr-list") == 0) {
+            long status = add_indicator_file(&ipv4->set, arg);
+            if (status != 0) {
+                if (status == -1) {
+                    fprintf(stdout, "Не удалось прочитать файл %s опции ipv4-addr-list\n", arg);
+                } else {
+                    fprintf(stdout, "Неверный адрес в строке %ld файла %s\n", status, arg);
+                }
+                free_ctx(ipv4);
+                return -1;
+            }
+        }
+    }
+
+    if (ipv4->set.len == 0) {
         fprintf(stdout, "Опция ipv4-addr-bin требует аргумент\n");
         fprintf(stderr, "DEBUG: %s: Invalid or missing argument for 'ipv4-addr-bin'\n", g_lib_name);
+        free_ctx(ipv4);
+        return -1;
+    }
+    if (build_set(&ipv4->set) == -1) {
+        fprintf(stderr, "DEBUG: %s: Out of memory for the address set\n", g_lib_name);
+        free_ctx(ipv4);
         return -1;
     }
+    return 0;
+}
+
+// Search a whole buffer starting at file offset 'base', 0 if something is found. With
+// --matches the search goes on from the byte after each match and every one of them is
+// recorded with the indicator it holds.
+static int search(const struct ipv4_ctx *ipv4, const void *data, size_t len, size_t base) {
+    const unsigned char *bytes = data;
+    struct ipv4_match match;
+    if (!find_match(&ipv4->set, bytes, len, &match)) {
+        return 1;
+    }
+    struct plugin_matches *matches = ipv4->matches;
+    if (!matches) {
+        return 0;
+    }
+    size_t from = 0;
+    do {
+        from += match.offset;
+        matches->count++;
+        if (matches->len < matches->capacity) {
+            matches->list[matches->len].offset = base + from;
+            matches->list[matches->len].len = 4;
+            matches->list[matches->len].label =
+                ipv4->labels ? ipv4->labels + (match.indicator * 2 + match.reversed) * LABEL_SIZE
+                             : NULL;
+            matches->len++;
+        }
+        from++;
+    } while (from < len && find_match(&ipv4->set, bytes + from, len - from, &match));
+    return 0;
+}
 
-    uint32_t target_ip;
-    if (!parse_ipv4_address((char *)in_opts[0].flag, &target_ip)) {
-        fprintf(stdout, "Неверный аргумент опции ipv4-addr-bin\n");
+int plugin_process_buffer(const void *data, size_t len, struct option in_opts[], size_t in_opts_len) {
+    char *DEBUG = getenv("LAB1DEBUG");
+    if (DEBUG) {
+        fprintf(stderr, "DEBUG: %s: Checking buffer of %zu bytes\n", g_lib_name, len);
+    }
+
+    struct ipv4_ctx ipv4;
+    if (parse_options(DEBUG, in_opts, in_opts_len, &ipv4) == -1) {
+        return -1;
+    }
+
+    if (len < 4) {
         if (DEBUG) {
-            fprintf(stderr, "DEBUG: %s: Invalid IPv4 address argument for 'ipv4-addr-bin'\n", g_lib_name);
+            fprintf(stderr, "DEBUG: %s: Buffer is too small to contain an IPv4 address\n", g_lib_name);
         }
+        free_ctx(&ipv4);
+        return 1;
+    }
+
+    int result = search(&ipv4, data, len, 0);
+    free_ctx(&ipv4);
+    return result;
+}
+
+int plugin_process_file(const char *fname, struct option in_opts[], size_t in_opts_len) {
+    char *DEBUG = getenv("LAB1DEBUG");
+    if (DEBUG) {
+        fprintf(stderr, "DEBUG: %s: Checking file '%s'\n", g_lib_name, fname);
+    }
+
+    struct ipv4_ctx ipv4;
+    if (parse_options(DEBUG, in_opts, in_opts_len, &ipv4) == -1) {
         return -1;
     }
 
@@ -73,6 +729,7 @@ int plugin_process_file(const char *fname, struct option in_opts[], size_t in_op
         if (DEBUG) {
             fprintf(stderr, "DEBUG: %s: Failed to open file '%s'\n", g_lib_name, fname);
         }
+        free_ctx(&ipv4);
         return 1;
     }
 
@@ -82,6 +739,7 @@ int plugin_process_file(const char *fname, struct option in_opts[], size_t in_op
             fprintf(stderr, "DEBUG: %s: Failed to get file stats for '%s'\n", g_lib_name, fname);
         }
         close(fd);
+        free_ctx(&ipv4);
         return 1;
     }
 
@@ -90,6 +748,7 @@ int plugin_process_file(const char *fname, struct option in_opts[], size_t in_op
             fprintf(stderr, "DEBUG: %s: File '%s' is too small to contain an IPv4 address\n", g_lib_name, fname);
         }
         close(fd);
+        free_ctx(&ipv4);
         return 1;
     }
 
@@ -99,20 +758,115 @@ int plugin_process_file(const char *fname, struct option in_opts[], size_t in_op
             fprintf(stderr, "DEBUG: %s: mmap failed for file '%s'\n", g_lib_name, fname);
         }
         close(fd);
+        free_ctx(&ipv4);
         return 1;
     }
 
-    int found = 0;
-    for (off_t i = 0; i <= file_stat.st_size - 4; i++) {
-        uint32_t *addr = (uint32_t *)(data + i);
-        if (*addr == target_ip || *addr == __builtin_bswap32(target_ip)) {
-            found = 1;
-            break;
-        }
-    }
+    int result = search(&ipv4, data, file_stat.st_size, 0);
 
     munmap(data, file_stat.st_size);
     close(fd);
+    free_ctx(&ipv4);
+
+    return result;
+}
+
+int plugin_init(struct option in_opts[], size_t in_opts_len, void **ctx) {
+    char *DEBUG = getenv("LAB1DEBUG");
+    struct ipv4_ctx *ipv4 = malloc(sizeof(struct ipv4_ctx));
+    if (!ipv4) {
+        return -1;
+    }
+    if (parse_options(DEBUG, in_opts, in_opts_len, ipv4) == -1) {
+        free(ipv4);
+        return -1;
+    }
+    *ctx = ipv4;
+    return 0;
+}
+
+int plugin_process_buffer_ctx(void *ctx, const void *data, size_t len) {
+    const struct ipv4_ctx *ipv4 = ctx;
+    if (len < 4) {
+        if (ipv4->debug) {
+            fprintf(stderr, "DEBUG: %s: Buffer is too small to contain an IPv4 address\n", g_lib_name);
+        }
+        return 1;
+    }
+    return search(ipv4, data, len, 0);
+}
+
+void plugin_fini(void *ctx) {
+    free_ctx(ctx);
+    free(ctx);
+}
+
+void plugin_set_matches(void *ctx, struct plugin_matches *matches) {
+    struct ipv4_ctx *ipv4 = ctx;
+    ipv4->matches = matches;
+    if (build_labels(ipv4) == -1 && ipv4->debug) {
+        fprintf(stderr, "DEBUG: %s: Out of memory for the match labels\n", g_lib_name);
+    }
+}
+
+#define STREAM_CONTINUE 2
+
+// Per-file state of a streamed search
+struct ipv4_stream {
+    const struct ipv4_ctx *ipv4;
+    /* Last bytes of the previous window, an address may span two windows */
+    unsigned char tail[3];
+    size_t tail_len;
+    /* Whether an earlier window had a match, the stream goes on to the end with --matches */
+    int found;
+};
+
+int plugin_stream_begin(void *ctx, size_t len, void **state) {
+    (void)len;
+    struct ipv4_stream *stream = malloc(sizeof(struct ipv4_stream));
+    if (!stream) {
+        return -1;
+    }
+    stream->ipv4 = ctx;
+    stream->tail_len = 0;
+    stream->found = 0;
+    *state = stream;
+    return 0;
+}
+
+int plugin_stream_feed(void *state, const void *chunk, size_t len, size_t offset) {
+    struct ipv4_stream *stream = state;
+    const unsigned char *data = chunk;
+    unsigned char joined[6];
+
+    // Addresses starting in the tail of the previous window
+    size_t head = len < 3 ? len : 3;
+    memcpy(joined, stream->tail, stream->tail_len);
+    memcpy(joined + stream->tail_len, data, head);
+    // A match in the joined bytes starts in the tail, since fewer than four bytes come
+    // from this window
+    if (search(stream->ipv4, joined, stream->tail_len + head, offset - stream->tail_len) == 0) {
+        stream->found = 1;
+    }
+    if ((!stream->found || stream->ipv4->matches) &&
+        search(stream->ipv4, data, len, offset) == 0) {
+        stream->found = 1;
+    }
+    if (stream->found && !stream->ipv4->matches) {
+        return 0;
+    }
+
+    // Keep the last three bytes seen, some of them from the old tail if the window is short
+    size_t kept = stream->tail_len + head;
+    memcpy(joined + stream->tail_len, data + len - head, head);
+    stream->tail_len = kept < 3 ? kept : 3;
+    memcpy(stream->tail, joined + kept - stream->tail_len, stream->tail_len);
+    return STREAM_CONTINUE;
+}
 
-    return found ? 0 : 1;
+int plugin_stream_finish(void *state) {
+    struct ipv4_stream *stream = state;
+    int result = stream->found ? 0 : 1;
+    free(stream);
+    return result;
 }
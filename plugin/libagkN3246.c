@@ -18,7 +18,15 @@ struct plugin_info {
   const char *plugin_author;
   size_t sup_opts_len;
   struct plugin_option *sup_opts;
+  size_t min_size;
+  size_t header_len;
+  int whole_file;
+  int thread_safe;
 };
+
+// Version of the plugin interface this plugin is built for
+const int plugin_abi_version = 2;
+
 static char *g_lib_name = "libagkN3246.so";
 static struct plugin_option g_pi[] = {
     {{"seq-num", required_argument, NULL, 0}, "Количество последовательностей"},
@@ -32,6 +40,8 @@ int plugin_get_info(struct plugin_info *ppi) {
   ppi->plugin_author = "Кузнецов Александр, N3246";
   ppi->sup_opts_len = 2;
   ppi->sup_opts = g_pi;
+  // Counts live on the stack or in the per-file stream state
+  ppi->thread_safe = 1;
   return 0;
 }
 int isNumber(char *str) {
@@ -47,16 +57,64 @@ int isNumber(char *str) {
   return 1;
 }
 
-int plugin_process_file(const char *fname, struct option in_opts[],
-                        size_t in_opts_len) {
-  char *DEBUG = getenv("LAB1DEBUG");
+// Match offsets of one file (--matches), as in plugin_api.h
+struct plugin_match {
+  size_t offset;
+  size_t len;
+  const char *label;
+};
+struct plugin_matches {
+  size_t count;
+  size_t len;
+  size_t capacity;
+  struct plugin_match *list;
+};
+
+// Count a run, and list it while there is room; NULL when it is not listed
+static struct plugin_match *add_run(struct plugin_matches *matches,
+                                    size_t offset, size_t len) {
+  matches->count++;
+  if (matches->len == matches->capacity) {
+    return NULL;
+  }
+  struct plugin_match *match = &matches->list[matches->len++];
+  match->offset = offset;
+  match->len = len;
+  match->label = NULL;
+  return match;
+}
+
+// Runs of equal bytes, the byte before the data is taken as 0. With
+// 'matches' every run is also recorded with its offset and length.
+static int count_sequences(const char *data, size_t len,
+                           struct plugin_matches *matches) {
+  char prev = 0;
+  int count = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (data[i] == prev) {
+      count++;
+      size_t start = i ? i - 1 : 0;
+      while (data[i]==prev && i < len-1) i++;
+      if (matches) {
+        add_run(matches, start, (data[i] == prev ? i + 1 : i) - start);
+      }
+    }
+    prev = data[i];
+  }
+  return count;
+}
+
+static void debug_options(const char *DEBUG, struct option in_opts[],
+                          size_t in_opts_len) {
   if (DEBUG) {
-    fprintf(stderr, "DEBUG: %s: Checking file '%s'\n", g_lib_name, fname);
     for (size_t i = 0; i < in_opts_len; i++) {
       fprintf(stderr, "DEBUG: %s: Got option '%s' with arg '%s'\n", g_lib_name,
               in_opts[i].name, (char *)in_opts[i].flag);
     }
   }
+}
+
+static int check_seq_comp(struct option in_opts[], size_t in_opts_len) {
   if (in_opts_len == 1 &&
       strcmp((char *)in_opts[0].flag, "seq-num-comp") == 0) {
     fprintf(stdout, "Опция seq-num-comp не работает без seq-num\n");
@@ -64,37 +122,11 @@ int plugin_process_file(const char *fname, struct option in_opts[],
             g_lib_name);
     return -1;
   }
-  int fd = open(fname, O_RDONLY);
-  if (fd == -1) {
-    if (DEBUG) {
-      fprintf(stderr, "DEBUG: %s: Failed to open file '%s'\n", g_lib_name,
-              fname);
-    }
-    return 1;
-  }
-  struct stat file_stat;
-  stat(fname, &file_stat);
-  char *data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-  if (data == MAP_FAILED) {
-    if (DEBUG) {
-      if (file_stat.st_size != 0)
-        fprintf(stderr, "DEBUG: %s: mmap failed\n", g_lib_name);
-      else
-        fprintf(stderr, "DEBUG: %s: empty file\n", g_lib_name);
-    }
-    return 1;
-  }
-  char prev = 0;
-  int count = 0;
-  for (off_t i = 0; i < file_stat.st_size; i++) {
-    if (data[i] == prev) {
-      count++;
-      while (data[i]==prev && i < file_stat.st_size-1) i++;
-    }
-    prev = data[i];
-  }
-  close(fd);
-  munmap(data, file_stat.st_size);
+  return 0;
+}
+
+static int compare_count(const char *DEBUG, int count, struct option in_opts[],
+                         size_t in_opts_len) {
   if (!isNumber((char *)in_opts[0].flag)) {
     fprintf(stdout, "Неверный аргумент опции seq-num\n");
     if (DEBUG) {
@@ -130,3 +162,274 @@ int plugin_process_file(const char *fname, struct option in_opts[],
     }
   }
 }
+
+int plugin_process_buffer(const void *data, size_t len, struct option in_opts[],
+                          size_t in_opts_len) {
+  char *DEBUG = getenv("LAB1DEBUG");
+  if (DEBUG) {
+    fprintf(stderr, "DEBUG: %s: Checking buffer of %zu bytes\n", g_lib_name,
+            len);
+  }
+  debug_options(DEBUG, in_opts, in_opts_len);
+  if (check_seq_comp(in_opts, in_opts_len) == -1) {
+    return -1;
+  }
+  if (len == 0) {
+    if (DEBUG) {
+      fprintf(stderr, "DEBUG: %s: empty file\n", g_lib_name);
+    }
+    return 1;
+  }
+  int count = count_sequences((const char *)data, len, NULL);
+  return compare_count(DEBUG, count, in_opts, in_opts_len);
+}
+
+int plugin_process_file(const char *fname, struct option in_opts[],
+                        size_t in_opts_len) {
+  char *DEBUG = getenv("LAB1DEBUG");
+  if (DEBUG) {
+    fprintf(stderr, "DEBUG: %s: Checking file '%s'\n", g_lib_name, fname);
+  }
+  debug_options(DEBUG, in_opts, in_opts_len);
+  if (check_seq_comp(in_opts, in_opts_len) == -1) {
+    return -1;
+  }
+  int fd = open(fname, O_RDONLY);
+  if (fd == -1) {
+    if (DEBUG) {
+      fprintf(stderr, "DEBUG: %s: Failed to open file '%s'\n", g_lib_name,
+              fname);
+    }
+    return 1;
+  }
+  struct stat file_stat;
+  stat(fname, &file_stat);
+  char *data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    if (DEBUG) {
+      if (file_stat.st_size != 0)
+        fprintf(stderr, "DEBUG: %s: mmap failed\n", g_lib_name);
+      else
+        fprintf(stderr, "DEBUG: %s: empty file\n", g_lib_name);
+    }
+    close(fd);
+    return 1;
+  }
+  int count = count_sequences(data, file_stat.st_size, NULL);
+  close(fd);
+  munmap(data, file_stat.st_size);
+  return compare_count(DEBUG, count, in_opts, in_opts_len);
+}
+
+// Comparison operators of seq-num-comp, in the order of g_comp_names
+enum seq_comp { SEQ_EQ, SEQ_NE, SEQ_GT, SEQ_LT, SEQ_GE, SEQ_LE };
+static const char *g_comp_names[] = {"eq", "ne", "gt", "lt", "ge", "le"};
+
+// Arguments parsed once by plugin_init
+struct seq_ctx {
+  int need_count;
+  enum seq_comp comp;
+  int debug;
+  // Set by plugin_set_matches, NULL without --matches
+  struct plugin_matches *matches;
+};
+
+static int compare_seq(const struct seq_ctx *seq, int count) {
+  switch (seq->comp) {
+  case SEQ_EQ:
+    return (count == seq->need_count) ? 0 : 1;
+  case SEQ_NE:
+    return (count != seq->need_count) ? 0 : 1;
+  case SEQ_GT:
+    return (count > seq->need_count) ? 0 : 1;
+  case SEQ_LT:
+    return (count < seq->need_count) ? 0 : 1;
+  case SEQ_GE:
+    return (count >= seq->need_count) ? 0 : 1;
+  default:
+    return (count <= seq->need_count) ? 0 : 1;
+  }
+}
+
+int plugin_init(struct option in_opts[], size_t in_opts_len, void **ctx) {
+  char *DEBUG = getenv("LAB1DEBUG");
+  debug_options(DEBUG, in_opts, in_opts_len);
+  const char *seq_num = NULL;
+  const char *seq_comp = "eq";
+  for (size_t i = 0; i < in_opts_len; i++) {
+    if (strcmp(in_opts[i].name, "seq-num") == 0) {
+      seq_num = (const char *)in_opts[i].flag;
+    } else if (strcmp(in_opts[i].name, "seq-num-comp") == 0) {
+      seq_comp = (const char *)in_opts[i].flag;
+    }
+  }
+  if (!seq_num) {
+    fprintf(stdout, "Опция seq-num-comp не работает без seq-num\n");
+    fprintf(stderr, "DEBUG: %s: Option 'seq-num-comp' without 'seq-num'\n",
+            g_lib_name);
+    return -1;
+  }
+  if (!isNumber((char *)seq_num)) {
+    fprintf(stdout, "Неверный аргумент опции seq-num\n");
+    if (DEBUG) {
+    fprintf(stderr, "DEBUG: %s: Invalid argument for 'seq-num'\n", g_lib_name);
+    }
+    return -1;
+  }
+  size_t comp = 0;
+  while (comp < sizeof(g_comp_names) / sizeof(g_comp_names[0]) &&
+         strcmp(seq_comp, g_comp_names[comp]) != 0) {
+    comp++;
+  }
+  if (comp == sizeof(g_comp_names) / sizeof(g_comp_names[0])) {
+    fprintf(stdout, "Неверный аргумент опции seq-num-comp\n");
+    fprintf(stderr, "DEBUG: %s: Invalid argument for 'seq-num-comp'\n",
+            g_lib_name);
+    return -1;
+  }
+  struct seq_ctx *seq = malloc(sizeof(struct seq_ctx));
+  if (!seq) {
+    return -1;
+  }
+  seq->need_count = atoi(seq_num);
+  seq->comp = (enum seq_comp)comp;
+  seq->debug = DEBUG != NULL;
+  seq->matches = NULL;
+  *ctx = seq;
+  return 0;
+}
+
+int plugin_process_buffer_ctx(void *ctx, const void *data, size_t len) {
+  const struct seq_ctx *seq = ctx;
+  if (len == 0) {
+    if (seq->debug) {
+      fprintf(stderr, "DEBUG: %s: empty file\n", g_lib_name);
+    }
+    return 1;
+  }
+  int count = count_sequences((const char *)data, len, seq->matches);
+  if (seq->debug) {
+    fprintf(stderr, "DEBUG: %s: Calculated sequence number = %d\n", g_lib_name,
+            count);
+  }
+  return compare_seq(seq, count);
+}
+
+void plugin_fini(void *ctx) {
+  free(ctx);
+}
+
+void plugin_set_matches(void *ctx, struct plugin_matches *matches) {
+  struct seq_ctx *seq = ctx;
+  seq->matches = matches;
+}
+
+// Contents of one file of a batch, as in plugin_api.h
+struct plugin_buffer {
+  const void *data;
+  size_t len;
+};
+
+// Count the files of a batch in one go, without a call and a debug check per file
+int plugin_process_batch(void *ctx, const struct plugin_buffer *files,
+                         size_t count, int *verdicts) {
+  const struct seq_ctx *seq = ctx;
+  for (size_t i = 0; i < count; i++) {
+    if (files[i].len == 0) {
+      verdicts[i] = 1;
+      continue;
+    }
+    int found = count_sequences((const char *)files[i].data, files[i].len,
+                                NULL);
+    verdicts[i] = compare_seq(seq, found);
+  }
+  if (seq->debug) {
+    fprintf(stderr, "DEBUG: %s: Checked a batch of %zu files\n", g_lib_name,
+            count);
+  }
+  return 0;
+}
+
+#define STREAM_CONTINUE 2
+
+// Per-file state of a streamed count, a run may span two windows
+struct seq_stream {
+  const struct seq_ctx *seq;
+  char prev;
+  int in_run;
+  int count;
+  int empty;
+  // Listed run that is still growing, with --matches
+  struct plugin_match *open;
+};
+
+int plugin_stream_begin(void *ctx, size_t len, void **state) {
+  struct seq_stream *stream = malloc(sizeof(struct seq_stream));
+  if (!stream) {
+    return -1;
+  }
+  stream->seq = ctx;
+  stream->prev = 0;
+  stream->in_run = 0;
+  stream->count = 0;
+  stream->empty = len == 0;
+  stream->open = NULL;
+  *state = stream;
+  return 0;
+}
+
+// Counts only grow, so some comparisons are settled before the end of the file
+static int decided_early(const struct seq_ctx *seq, int count) {
+  switch (seq->comp) {
+  case SEQ_EQ:
+  case SEQ_LE:
+    return count > seq->need_count ? 1 : STREAM_CONTINUE;
+  case SEQ_NE:
+  case SEQ_GT:
+    return count > seq->need_count ? 0 : STREAM_CONTINUE;
+  case SEQ_GE:
+    return count >= seq->need_count ? 0 : STREAM_CONTINUE;
+  default:
+    return count >= seq->need_count ? 1 : STREAM_CONTINUE;
+  }
+}
+
+int plugin_stream_feed(void *state, const void *chunk, size_t len,
+                       size_t offset) {
+  struct seq_stream *stream = state;
+  struct plugin_matches *matches = stream->seq->matches;
+  const char *data = chunk;
+  // Same counting as count_sequences: every run of two or more equal bytes
+  // counts once, the byte before the file is taken as 0
+  for (size_t i = 0; i < len; i++) {
+    if (data[i] == stream->prev) {
+      if (!stream->in_run) {
+        stream->count++;
+        stream->in_run = 1;
+        if (matches) {
+          size_t at = offset + i;
+          stream->open = at ? add_run(matches, at - 1, 2)
+                            : add_run(matches, 0, 1);
+        }
+      } else if (stream->open) {
+        stream->open->len++;
+      }
+    } else {
+      stream->prev = data[i];
+      stream->in_run = 0;
+    }
+  }
+  // Every run is wanted with --matches, so the whole file is read
+  return matches ? STREAM_CONTINUE : decided_early(stream->seq, stream->count);
+}
+
+int plugin_stream_finish(void *state) {
+  struct seq_stream *stream = state;
+  int result = stream->empty ? 1 : compare_seq(stream->seq, stream->count);
+  if (stream->seq->debug && !stream->empty) {
+    fprintf(stderr, "DEBUG: %s: Calculated sequence number = %d\n", g_lib_name,
+            stream->count);
+  }
+  free(stream);
+  return result;
+}
@@ -25,6 +25,8 @@
 
 static char *g_lib_name = "libavg.so";
 
+const int plugin_abi_version = PLUGIN_ABI_VERSION;
+
 static char *g_plugin_purpose = "Check if entropy of a file or its part is less than the given value";
 
 static char *g_plugin_author = "Alexei Guirik";
@@ -74,10 +76,22 @@ static struct plugin_option g_po_arr[] = {
 
 static int g_po_arr_len = sizeof(g_po_arr)/sizeof(g_po_arr[0]);
 
+// Parsed plugin options
+struct avg_params {
+    double entropy;
+    size_t offset_from;
+    size_t offset_to;
+    int debug;
+};
+
 //
 //  Private functions
 //
 static double calculate_entropy(unsigned char*, size_t, size_t);
+static int parse_options(struct option[], size_t, struct avg_params*);
+static int check_entropy(unsigned char*, size_t, struct avg_params*);
+static int fit_offsets(size_t, struct avg_params*);
+static double table_entropy(size_t*, size_t);
 
 //
 //  API functions
@@ -92,10 +106,70 @@ int plugin_get_info(struct plugin_info* ppi) {
     ppi->plugin_author = g_plugin_author;
     ppi->sup_opts_len = g_po_arr_len;
     ppi->sup_opts = g_po_arr;
+    // errno is per thread and the parsed options are only read
+    ppi->thread_safe = 1;
+    
+    return 0;
+}
+
+int plugin_process_buffer(const void *data,
+        size_t len,
+        struct option in_opts[],
+        size_t in_opts_len) {
+
+    struct avg_params params;
+    
+    if (!data || !in_opts || !in_opts_len) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    if (parse_options(in_opts, in_opts_len, &params) < 0) {
+        return -1;
+    }
+    
+    return check_entropy((unsigned char*)data, len, &params);
+}
+
+int plugin_init(struct option in_opts[],
+        size_t in_opts_len,
+        void **ctx) {
+
+    if (!in_opts || !in_opts_len || !ctx) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    struct avg_params *params = malloc(sizeof(struct avg_params));
+    if (!params) {
+        return -1;
+    }
+    
+    if (parse_options(in_opts, in_opts_len, params) < 0) {
+        free(params);
+        return -1;
+    }
     
+    *ctx = params;
     return 0;
 }
 
+int plugin_process_buffer_ctx(void *ctx,
+        const void *data,
+        size_t len) {
+
+    if (!ctx || !data) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    return check_entropy((unsigned char*)data, len, (struct avg_params*)ctx);
+}
+
+void plugin_fini(void *ctx) {
+    free(ctx);
+}
+
 int plugin_process_file(const char *fname,
         struct option in_opts[],
         size_t in_opts_len) {
@@ -106,13 +180,60 @@ int plugin_process_file(const char *fname,
     // Pointer to file mapping
     unsigned char *ptr = NULL;
     
-    char *DEBUG = getenv("LAB1DEBUG");
+    struct avg_params params;
     
     if (!fname || !in_opts || !in_opts_len) {
         errno = EINVAL;
         return -1;
     }
     
+    if (parse_options(in_opts, in_opts_len, &params) < 0) {
+        return -1;
+    }
+    
+    int saved_errno = 0;
+    
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0) {
+        // errno is set by open()
+        return -1;
+    }
+    
+    struct stat st = {0};
+    int res = fstat(fd, &st);
+    if (res < 0) {
+        saved_errno = errno;
+        goto END;
+    }
+    
+    // An empty file cannot be mapped, check_entropy rejects it
+    if (st.st_size > 0) {
+        ptr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr == MAP_FAILED) {
+            saved_errno = errno;
+            goto END;
+        }
+    }
+    
+    ret = check_entropy(ptr, st.st_size, &params);
+    saved_errno = errno;
+    
+    END:
+    close(fd);
+    if (ptr != MAP_FAILED && ptr != NULL) munmap(ptr, st.st_size);
+    
+    // Restore errno value
+    errno = saved_errno;
+    
+    return ret;
+}        
+
+int parse_options(struct option in_opts[],
+        size_t in_opts_len,
+        struct avg_params *params) {
+
+    char *DEBUG = getenv("LAB1DEBUG");
+    
     if (DEBUG) {
         for (size_t i = 0; i < in_opts_len; i++) {
             fprintf(stderr, "DEBUG: %s: Got option '%s' with arg '%s'\n",
@@ -189,83 +310,76 @@ int plugin_process_file(const char *fname,
             g_lib_name, entropy, offset_from, offset_to);
     }
     
-    int saved_errno = 0;
-    
-    int fd = open(fname, O_RDONLY);
-    if (fd < 0) {
-        // errno is set by open()
-        return -1;
-    }
+    params->entropy = entropy;
+    params->offset_from = offset_from;
+    params->offset_to = offset_to;
+    params->debug = DEBUG != NULL;
     
-    struct stat st = {0};
-    int res = fstat(fd, &st);
-    if (res < 0) {
-        saved_errno = errno;
-        goto END;
-    }
+    return 0;
+}
+
+// Fit the offsets to a file of 'size' bytes, -1 with errno set if they do not fit
+int fit_offsets(size_t size, struct avg_params *params) {
+    int DEBUG = params->debug;
     
     // Check that size of file is > 0
-    if (st.st_size == 0) {
+    if (size == 0) {
         if (DEBUG) {
             fprintf(stderr, "DEBUG: %s: File size should be > 0\n",
                 g_lib_name);
         }
-        saved_errno = ERANGE;
-        goto END;
+        errno = ERANGE;
+        return -1;
     }
     
     // Check starting offset
-    if (offset_from >= (size_t)st.st_size) {
-        saved_errno = ERANGE;
-        goto END;
+    if (params->offset_from >= size) {
+        errno = ERANGE;
+        return -1;
     }
     
     // Check ending offset
-    if (offset_to == 0 || offset_to >= (size_t)st.st_size) {
-        offset_to = st.st_size - 1;
+    if (params->offset_to == 0 || params->offset_to >= size) {
+        params->offset_to = size - 1;
         if (DEBUG) {
             fprintf(stderr, "DEBUG: %s: Corrected offset_to to %ld\n",
-                g_lib_name, offset_to);
+                g_lib_name, params->offset_to);
         }
     }
     
     // Check for incorrect offset values
-    if (offset_from >= offset_to) {
+    if (params->offset_from >= params->offset_to) {
         if (DEBUG) {
             fprintf(stderr, "DEBUG: %s: offset_from (%ld) >= offset_to to (%ld)\n",
-                g_lib_name, offset_from, offset_to);
+                g_lib_name, params->offset_from, params->offset_to);
         }        
-        saved_errno = ERANGE;
-        goto END;
+        errno = ERANGE;
+        return -1;
     }
     
+    return 0;
+}
+
+// 0 or 1 for the data in 'ptr', -1 with errno set if the offsets do not fit
+int check_entropy(unsigned char *ptr, size_t size, struct avg_params *params) {
+    // Work on a copy, the context is shared
+    struct avg_params fitted = *params;
     
-    ptr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (ptr == MAP_FAILED) {
-        saved_errno = errno;
-        goto END;
+    if (fit_offsets(size, &fitted) < 0) {
+        return -1;
     }
-        
+    
     double calc_entropy = 0.0;
-    calc_entropy = calculate_entropy(ptr, offset_from, offset_to);
+    calc_entropy = calculate_entropy(ptr, fitted.offset_from, fitted.offset_to);
     
-    if (DEBUG) {
+    if (fitted.debug) {
         fprintf(stderr, "DEBUG: %s: Calculated entropy = %lf\n", 
             g_lib_name, calc_entropy);
     }
     
     // 0 or 1
-    ret = calc_entropy >= entropy;
-    
-    END:
-    close(fd);
-    if (ptr != MAP_FAILED && ptr != NULL) munmap(ptr, st.st_size);
-    
-    // Restore errno value
-    errno = saved_errno;
-    
-    return ret;
-}        
+    return calc_entropy >= fitted.entropy;
+}
 
 double calculate_entropy(unsigned char *p, size_t offset_from, size_t offset_to) { 
     size_t freq_table[256] = {0};
@@ -275,7 +389,10 @@ double calculate_entropy(unsigned char *p, size_t offset_from, size_t offset_to)
         freq_table[ *ptr++ ] += 1;
     }
 
-    size_t total_size = offset_to - offset_from + 1;
+    return table_entropy(freq_table, offset_to - offset_from + 1);
+}
+
+double table_entropy(size_t *freq_table, size_t total_size) {
     double total_entropy = 0.0;
     
     for (int i = 0; i < 256; i++) {
@@ -286,4 +403,90 @@ double calculate_entropy(unsigned char *p, size_t offset_from, size_t offset_to)
     }
     
     return total_entropy/8;
-}
\ No newline at end of file
+}
+
+//
+//  Streaming functions, the byte counts of the range are gathered window by window
+//
+struct avg_stream {
+    struct avg_params params;
+    size_t freq_table[256];
+    int done;
+    int result;
+};
+
+int plugin_stream_begin(void *ctx, size_t len, void **state) {
+    struct avg_stream *stream = calloc(1, sizeof(struct avg_stream));
+    if (!stream) {
+        return -1;
+    }
+    
+    stream->params = *(struct avg_params*)ctx;
+    if (fit_offsets(len, &stream->params) < 0) {
+        free(stream);
+        return -1;
+    }
+    
+    *state = stream;
+    return 0;
+}
+
+int plugin_stream_feed(void *state, const void *chunk, size_t len, size_t offset) {
+    struct avg_stream *stream = state;
+    size_t from = stream->params.offset_from, to = stream->params.offset_to;
+    
+    // Part of the window inside [offset_from, offset_to]
+    size_t start = from > offset ? from - offset : 0;
+    size_t end = to - offset + 1 < len ? to - offset + 1 : len;
+    if (to < offset) {
+        end = 0;
+    }
+    const unsigned char *p = chunk;
+    for (size_t i = start; i < end; i++) {
+        stream->freq_table[p[i]] += 1;
+    }
+    
+    // The verdict is known once the end of the range went by
+    if (offset + len <= to) {
+        return PLUGIN_STREAM_CONTINUE;
+    }
+    
+    double calc_entropy = table_entropy(stream->freq_table, to - from + 1);
+    if (stream->params.debug) {
+        fprintf(stderr, "DEBUG: %s: Calculated entropy = %lf\n", 
+            g_lib_name, calc_entropy);
+    }
+    stream->done = 1;
+    stream->result = calc_entropy >= stream->params.entropy;
+    return stream->result;
+}
+
+int plugin_stream_finish(void *state) {
+    struct avg_stream *stream = state;
+    // A file shorter than announced never reaches the end of the range
+    int result = stream->done ? stream->result : -1;
+    free(stream);
+    return result;
+}
+
+// Only the bytes between the offsets are needed, the whole file without them
+int plugin_get_ranges(void *ctx, size_t len, struct plugin_range *ranges, size_t *ranges_len) {
+    if (!ctx || !ranges || !ranges_len || *ranges_len < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    
+    struct avg_params fitted = *(struct avg_params*)ctx;
+    if (fit_offsets(len, &fitted) < 0) {
+        return -1;
+    }
+    
+    if (fitted.offset_from == 0 && fitted.offset_to == len - 1) {
+        return 1;
+    }
+    
+    ranges[0].offset = fitted.offset_from;
+    ranges[0].len = fitted.offset_to - fitted.offset_from + 1;
+    *ranges_len = 1;
+    return 0;
+}
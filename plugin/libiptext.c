@@ -0,0 +1,784 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct plugin_option {
+    struct option opt;
+    const char *opt_descr;
+};
+
+struct plugin_info {
+    const char *plugin_purpose;
+    const char *plugin_author;
+    size_t sup_opts_len;
+    struct plugin_option *sup_opts;
+    size_t min_size;
+    size_t header_len;
+    int whole_file;
+    int thread_safe;
+};
+
+// Contents of one file of a batch, as in plugin_api.h
+struct plugin_buffer {
+    const void *data;
+    size_t len;
+};
+
+// Match offsets of one file (--matches), as in plugin_api.h
+struct plugin_match {
+    size_t offset;
+    size_t len;
+    const char *label;
+};
+struct plugin_matches {
+    size_t count;
+    size_t len;
+    size_t capacity;
+    struct plugin_match *list;
+};
+
+// Version of the plugin interface this plugin is built for
+const int plugin_abi_version = 2;
+
+static char *g_lib_name = "libiptext.so";
+static struct plugin_option g_pi[] = {
+    {{"ip-text", required_argument, NULL, 0},
+     "Адреса в тексте через запятую: any, ipv4, ipv6, адрес или сеть, например 10.0.0.0/8,2001:db8::/32"},
+    {{"ip-text-list", required_argument, NULL, 0}, "Файл адресов и сетей, по одному в строке, # для комментариев"},
+    {{NULL, 0, NULL, 0}, NULL} // Terminate the array
+};
+
+int plugin_get_info(struct plugin_info *ppi) {
+    ppi->plugin_purpose = "Поиск адресов IPv4 и IPv6, записанных текстом";
+    ppi->plugin_author = "Беляков Никита, N3245";
+    ppi->sup_opts_len = 2;
+    ppi->sup_opts = g_pi;
+    // The shortest address is "::1"
+    ppi->min_size = 3;
+    // The set is only read, the stream state is per file
+    ppi->thread_safe = 1;
+    return 0;
+}
+
+/*
+ * An address is a run of hex digits, dots and colons ("1.2.3.4",
+ * "fe80::1", "::ffff:10.0.0.1", also "1.2.3.4:80" and "1.2.3.4." at the end
+ * of a sentence) with no letter, digit or underscore right before or after
+ * it. Every such run holds a dot followed by a digit or a colon followed by
+ * a hex digit or a colon, a candidate; the search skips to candidates with
+ * vectors and looks at the run around each of them once, from its first
+ * candidate. Runs longer than IPT_RUN_MAX are not addresses.
+ */
+#define IPT_RUN_MAX 48
+// Bytes around a candidate the search may look at
+#define IPT_CONTEXT (IPT_RUN_MAX + 1)
+
+// Network of the set, IPv4 ones as IPv4-mapped IPv6 with the prefix 96 longer
+struct ip_network {
+    unsigned char addr[16];
+    int prefix;
+};
+
+// Networks of one prefix length, a sorted slice of the set
+struct ip_group {
+    int prefix;
+    size_t start;
+    size_t len;
+};
+
+struct ip_set {
+    /* any or ipv4 / ipv6 in the list: every address of the family matches */
+    int any_ipv4;
+    int any_ipv6;
+    struct ip_network *networks;
+    size_t len;
+    size_t capacity;
+    /* Most specific prefix first */
+    struct ip_group groups[129];
+    size_t groups_len;
+};
+
+static const unsigned char g_ipv4_mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+
+static int is_digit(unsigned char c) {
+    return c >= '0' && c <= '9';
+}
+
+static int is_hex(unsigned char c) {
+    return is_digit(c) || ((c | 0x20) >= 'a' && (c | 0x20) <= 'f');
+}
+
+static int is_addr_char(unsigned char c) {
+    return is_hex(c) || c == '.' || c == ':';
+}
+
+static int is_word(unsigned char c) {
+    return is_digit(c) || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') || c == '_';
+}
+
+// Whether 'k' may be in an address: a dot before a digit, a colon before a hex digit or a colon
+static int is_candidate(const unsigned char *buf, size_t len, size_t k) {
+    if (k + 1 >= len) {
+        return 0;
+    }
+    unsigned char next = buf[k + 1];
+    if (buf[k] == '.') {
+        return is_digit(next);
+    }
+    return buf[k] == ':' && (is_hex(next) || next == ':');
+}
+
+// Parse "ADDR" or "ADDR/PREFIX" of either family, 0 if it is not one
+static int parse_network(const char *text, struct ip_network *network) {
+    char addr[INET6_ADDRSTRLEN];
+    const char *slash = strchr(text, '/');
+    size_t addr_len = slash ? (size_t)(slash - text) : strlen(text);
+    if (addr_len == 0 || addr_len >= sizeof(addr)) {
+        return 0;
+    }
+    memcpy(addr, text, addr_len);
+    addr[addr_len] = '\0';
+
+    int max_prefix;
+    if (inet_pton(AF_INET6, addr, network->addr) == 1) {
+        max_prefix = 128;
+    } else if (inet_pton(AF_INET, addr, network->addr + 12) == 1) {
+        memcpy(network->addr, g_ipv4_mapped, sizeof(g_ipv4_mapped));
+        max_prefix = 32;
+    } else {
+        return 0;
+    }
+    int prefix = max_prefix;
+    if (slash) {
+        char *end;
+        long value = strtol(slash + 1, &end, 10);
+        if (end == slash + 1 || *end != '\0' || value < 0 || value > max_prefix) {
+            return 0;
+        }
+        prefix = (int)value;
+    }
+    network->prefix = prefix + 128 - max_prefix;
+    return 1;
+}
+
+// Clear the bits of 'addr' past the first 'prefix'
+static void mask_address(unsigned char *addr, int prefix) {
+    for (int i = 0; i < 16; i++) {
+        int bits = prefix - i * 8;
+        if (bits <= 0) {
+            addr[i] = 0;
+        } else if (bits < 8) {
+            addr[i] &= (unsigned char)(0xff << (8 - bits));
+        }
+    }
+}
+
+static int add_network(struct ip_set *set, const char *text) {
+    if (strcmp(text, "any") == 0 || strcmp(text, "ipv4") == 0 || strcmp(text, "ipv6") == 0) {
+        set->any_ipv4 |= text[3] != '6';
+        set->any_ipv6 |= text[3] != '4';
+        return 1;
+    }
+    struct ip_network network;
+    if (!parse_network(text, &network)) {
+        return 0;
+    }
+    mask_address(network.addr, network.prefix);
+    if (set->len == set->capacity) {
+        size_t capacity = set->capacity ? set->capacity * 2 : 16;
+        struct ip_network *networks = realloc(set->networks, capacity * sizeof(struct ip_network));
+        if (!networks) {
+            return 0;
+        }
+        set->networks = networks;
+        set->capacity = capacity;
+    }
+    set->networks[set->len++] = network;
+    return 1;
+}
+
+// Add the addresses and networks of a comma separated list, 0 if one of them is invalid
+static int add_network_list(struct ip_set *set, const char *list) {
+    char *copy = strdup(list);
+    if (!copy) {
+        return 0;
+    }
+    int valid = 1;
+    char *saveptr = NULL;
+    for (char *item = strtok_r(copy, ",", &saveptr); item && valid;
+         item = strtok_r(NULL, ",", &saveptr)) {
+        valid = add_network(set, item);
+    }
+    free(copy);
+    return valid;
+}
+
+// Add the addresses and networks of a file, -1 if it cannot be read, the
+// number of the invalid line if there is one
+static long add_network_file(struct ip_set *set, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    char *line = NULL;
+    size_t line_capacity = 0;
+    long line_no = 0;
+    long status = 0;
+    while (status == 0 && getline(&line, &line_capacity, file) != -1) {
+        line_no++;
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        char *start = line;
+        while (*start == ' ' || *start == '\t') {
+            start++;
+        }
+        char *end = start + strlen(start);
+        while (end > start && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' ||
+                               end[-1] == '\r')) {
+            *--end = '\0';
+        }
+        if (*start != '\0' && !add_network(set, start)) {
+            status = line_no;
+        }
+    }
+    free(line);
+    fclose(file);
+    return status;
+}
+
+static int compare_networks(const void *a, const void *b) {
+    const struct ip_network *x = a;
+    const struct ip_network *y = b;
+    if (x->prefix != y->prefix) {
+        return y->prefix - x->prefix;
+    }
+    return memcmp(x->addr, y->addr, sizeof(x->addr));
+}
+
+// Sort the networks and cut them into groups of one prefix length
+static void build_set(struct ip_set *set) {
+    if (set->len) {
+        qsort(set->networks, set->len, sizeof(struct ip_network), compare_networks);
+    }
+    set->groups_len = 0;
+    for (size_t i = 0; i < set->len; i++) {
+        if (i == 0 || set->networks[i].prefix != set->networks[i - 1].prefix) {
+            struct ip_group *group = &set->groups[set->groups_len++];
+            group->prefix = set->networks[i].prefix;
+            group->start = i;
+            group->len = 0;
+        }
+        set->groups[set->groups_len - 1].len++;
+    }
+}
+
+static void free_set(struct ip_set *set) {
+    free(set->networks);
+}
+
+// Whether an address, IPv4 ones mapped, is one the set looks for
+static int lookup_address(const struct ip_set *set, const unsigned char *addr, int ipv4) {
+    if (ipv4 ? set->any_ipv4 : set->any_ipv6) {
+        return 1;
+    }
+    for (size_t g = 0; g < set->groups_len; g++) {
+        const struct ip_group *group = &set->groups[g];
+        unsigned char key[16];
+        memcpy(key, addr, sizeof(key));
+        mask_address(key, group->prefix);
+        size_t low = group->start;
+        size_t high = group->start + group->len;
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            int order = memcmp(set->networks[mid].addr, key, sizeof(key));
+            if (order == 0) {
+                return 1;
+            }
+            if (order < 0) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+    }
+    return 0;
+}
+
+// Candidates among the 64 bytes at 'p', bit i for p[i]; p[64] is read as well
+static uint64_t candidates_scalar(const unsigned char *p) {
+    uint64_t mask = 0;
+    for (size_t i = 0; i < 64; i++) {
+        mask |= (uint64_t)is_candidate(p, 65, i) << i;
+    }
+    return mask;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/*
+ * Most vectors of text hold no dot or colon at all and are passed over
+ * after two compares; in the others the byte after every dot and colon is
+ * classified with range checks on the vector loaded one byte further.
+ */
+__attribute__((target("sse2"))) static uint32_t candidates16(const unsigned char *p) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *)p);
+    __m128i is_dot = _mm_cmpeq_epi8(bytes, _mm_set1_epi8('.'));
+    __m128i is_colon = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(':'));
+    if (!_mm_movemask_epi8(_mm_or_si128(is_dot, is_colon))) {
+        return 0;
+    }
+    __m128i next = _mm_loadu_si128((const __m128i *)(p + 1));
+    __m128i digit = _mm_sub_epi8(next, _mm_set1_epi8('0'));
+    __m128i next_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+    __m128i letter = _mm_sub_epi8(_mm_or_si128(next, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i next_hex =
+        _mm_or_si128(next_digit, _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(5)), letter));
+    __m128i next_colon = _mm_cmpeq_epi8(next, _mm_set1_epi8(':'));
+    __m128i hit = _mm_or_si128(_mm_and_si128(is_dot, next_digit),
+                               _mm_and_si128(is_colon, _mm_or_si128(next_hex, next_colon)));
+    return (uint32_t)_mm_movemask_epi8(hit);
+}
+
+__attribute__((target("sse2"))) static uint64_t candidates_sse2(const unsigned char *p) {
+    return (uint64_t)candidates16(p) | (uint64_t)candidates16(p + 16) << 16 |
+           (uint64_t)candidates16(p + 32) << 32 | (uint64_t)candidates16(p + 48) << 48;
+}
+
+__attribute__((target("avx2"))) static uint32_t candidates32(const unsigned char *p) {
+    __m256i bytes = _mm256_loadu_si256((const __m256i *)p);
+    __m256i is_dot = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8('.'));
+    __m256i is_colon = _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(':'));
+    __m256i separator = _mm256_or_si256(is_dot, is_colon);
+    if (_mm256_testz_si256(separator, separator)) {
+        return 0;
+    }
+    __m256i next = _mm256_loadu_si256((const __m256i *)(p + 1));
+    __m256i digit = _mm256_sub_epi8(next, _mm256_set1_epi8('0'));
+    __m256i next_digit = _mm256_cmpeq_epi8(_mm256_min_epu8(digit, _mm256_set1_epi8(9)), digit);
+    __m256i letter =
+        _mm256_sub_epi8(_mm256_or_si256(next, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+    __m256i next_hex = _mm256_or_si256(
+        next_digit, _mm256_cmpeq_epi8(_mm256_min_epu8(letter, _mm256_set1_epi8(5)), letter));
+    __m256i next_colon = _mm256_cmpeq_epi8(next, _mm256_set1_epi8(':'));
+    __m256i hit =
+        _mm256_or_si256(_mm256_and_si256(is_dot, next_digit),
+                        _mm256_and_si256(is_colon, _mm256_or_si256(next_hex, next_colon)));
+    return (uint32_t)_mm256_movemask_epi8(hit);
+}
+
+__attribute__((target("avx2"))) static uint64_t candidates_avx2(const unsigned char *p) {
+    return (uint64_t)candidates32(p) | (uint64_t)candidates32(p + 32) << 32;
+}
+#endif
+
+// Candidate kernel for this CPU, picked once when the plugin is loaded
+static uint64_t (*g_candidates)(const unsigned char *) = candidates_scalar;
+
+__attribute__((constructor)) static void select_candidates(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        g_candidates = candidates_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        g_candidates = candidates_sse2;
+    }
+#endif
+}
+
+// Address written as 'text', "1.2.3.4:80" included. Its length, 0 if it is not one.
+static size_t parse_address(const char *text, size_t len, unsigned char *addr, int *ipv4) {
+    char copy[IPT_RUN_MAX + 1];
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+    char *colon = strchr(copy, ':');
+    if (!colon) {
+        *ipv4 = 1;
+        memcpy(addr, g_ipv4_mapped, sizeof(g_ipv4_mapped));
+        return inet_pton(AF_INET, copy, addr + 12) == 1 ? len : 0;
+    }
+    if (inet_pton(AF_INET6, copy, addr) == 1) {
+        *ipv4 = 0;
+        return len;
+    }
+    // An IPv4 address and a port
+    size_t port = len - (size_t)(colon - copy) - 1;
+    if (port == 0 || port > 5 || strspn(colon + 1, "0123456789") != port) {
+        return 0;
+    }
+    *colon = '\0';
+    *ipv4 = 1;
+    memcpy(addr, g_ipv4_mapped, sizeof(g_ipv4_mapped));
+    return inet_pton(AF_INET, copy, addr + 12) == 1 ? (size_t)(colon - copy) : 0;
+}
+
+// Address found in a run, relative to the buffer searched
+struct ipt_match {
+    size_t offset;
+    size_t len;
+};
+
+/*
+ * Look at the run holding candidate 'j'. 1 if it is an address the set looks
+ * for, 0 otherwise; '*end' is where the search goes on. A run whose first
+ * candidate is before 'j' was looked at already, when that one was found.
+ */
+static int check_run(const struct ip_set *set, const unsigned char *buf, size_t len, size_t j,
+                     size_t *end, struct ipt_match *match) {
+    *end = j + 1;
+    size_t start = j;
+    while (start > 0 && is_addr_char(buf[start - 1])) {
+        if (j - start == IPT_RUN_MAX || is_candidate(buf, len, start - 1)) {
+            return 0;
+        }
+        start--;
+    }
+
+    // Most runs are times and version numbers, told apart without parsing them: an IPv4
+    // address has three dots, an IPv6 one has "::" or at least six colons. Runs of dots
+    // and colons only, like the "::" of source code, are left out as well.
+    size_t dots = 0;
+    size_t colons = 0;
+    int compressed = 0;
+    int digits = 0;
+    size_t stop = start;
+    for (; stop < len && is_addr_char(buf[stop]); stop++) {
+        if (stop - start == IPT_RUN_MAX) {
+            *end = stop;
+            return 0;
+        }
+        dots += buf[stop] == '.';
+        digits |= is_hex(buf[stop]);
+        if (buf[stop] == ':') {
+            colons++;
+            compressed |= stop > start && buf[stop - 1] == ':';
+        }
+    }
+    *end = stop;
+    if ((start > 0 && is_word(buf[start - 1])) || (stop < len && is_word(buf[stop])) ||
+        !digits || (dots < 3 && colons < 6 && !compressed)) {
+        return 0;
+    }
+
+    // As it is, then without the dots and colons ending a sentence
+    const char *text = (const char *)buf + start;
+    size_t text_len = stop - start;
+    unsigned char addr[16];
+    int ipv4;
+    size_t found = parse_address(text, text_len, addr, &ipv4);
+    if (!found) {
+        while (text_len > 0 && (text[text_len - 1] == '.' || text[text_len - 1] == ':')) {
+            text_len--;
+        }
+        if (text_len == stop - start || text_len == 0) {
+            return 0;
+        }
+        found = parse_address(text, text_len, addr, &ipv4);
+    }
+    if (!found || !lookup_address(set, addr, ipv4)) {
+        return 0;
+    }
+    match->offset = start;
+    match->len = found;
+    return 1;
+}
+
+// Arguments parsed once by plugin_init
+struct ipt_ctx {
+    struct ip_set set;
+    int debug;
+    /* Set by plugin_set_matches, NULL without --matches */
+    struct plugin_matches *matches;
+};
+
+/*
+ * Search the runs whose first candidate is in [from, to) of 'buf', which
+ * starts at file offset 'base' and holds IPT_CONTEXT bytes around them
+ * unless the file begins or ends there. 0 if an address is found; with
+ * --matches the search goes on and records every address.
+ */
+static int scan(const struct ipt_ctx *ipt, const unsigned char *buf, size_t len, size_t from,
+                size_t to, size_t base) {
+    int result = 1;
+    struct ipt_match match;
+    size_t i = from;
+    while (i < to) {
+        // Candidates of the next 64 bytes, the last ones of the buffer one at a time
+        size_t width = to - i < 64 ? to - i : 64;
+        uint64_t mask = 0;
+        if (width == 64 && i + 64 < len) {
+            mask = g_candidates(buf + i);
+        } else {
+            for (size_t k = 0; k < width; k++) {
+                mask |= (uint64_t)is_candidate(buf, len, i + k) << k;
+            }
+        }
+        size_t next = i + width;
+        while (mask) {
+            size_t j = i + (size_t)__builtin_ctzll(mask);
+            size_t end;
+            int found = check_run(&ipt->set, buf, len, j, &end, &match);
+            // Candidates in the same run were looked at with it
+            mask = end - i >= 64 ? 0 : mask & (~(uint64_t)0 << (end - i));
+            if (end > next) {
+                next = end;
+            }
+            if (!found) {
+                continue;
+            }
+            if (ipt->debug && result) {
+                fprintf(stderr, "DEBUG: %s: Found '%.*s' at offset %zu\n", g_lib_name,
+                        (int)match.len, (const char *)buf + match.offset, base + match.offset);
+            }
+            result = 0;
+            struct plugin_matches *matches = ipt->matches;
+            if (!matches) {
+                return result;
+            }
+            matches->count++;
+            if (matches->len < matches->capacity) {
+                matches->list[matches->len].offset = base + match.offset;
+                matches->list[matches->len].len = match.len;
+                matches->list[matches->len].label = NULL;
+                matches->len++;
+            }
+        }
+        i = next;
+    }
+    return result;
+}
+
+// Check the options and sort the networks, -1 if they are invalid
+static int parse_options(const char *DEBUG, struct option in_opts[], size_t in_opts_len,
+                         struct ipt_ctx *ipt) {
+    memset(ipt, 0, sizeof(*ipt));
+    ipt->debug = DEBUG != NULL;
+    int given = 0;
+    for (size_t i = 0; i < in_opts_len; i++) {
+        const char *arg = (const char *)in_opts[i].flag;
+        if (DEBUG) {
+            fprintf(stderr, "DEBUG: %s: Got option '%s' with arg '%s'\n", g_lib_name, in_opts[i].name, arg);
+        }
+        if (strcmp(in_opts[i].name, "ip-text") == 0) {
+            if (!add_network_list(&ipt->set, arg)) {
+                fprintf(stdout, "Неверный аргумент опции ip-text\n");
+                free_set(&ipt->set);
+                return -1;
+            }
+            given = 1;
+        } else if (strcmp(in_opts[i].name, "ip-text-list") == 0) {
+            long status = add_network_file(&ipt->set, arg);
+            if (status != 0) {
+                if (status == -1) {
+                    fprintf(stdout, "Не удалось прочитать файл %s опции ip-text-list\n", arg);
+                } else {
+                    fprintf(stdout, "Неверный адрес в строке %ld файла %s\n", status, arg);
+                }
+                free_set(&ipt->set);
+                return -1;
+            }
+            given = 1;
+        }
+    }
+    if (!given || (ipt->set.len == 0 && !ipt->set.any_ipv4 && !ipt->set.any_ipv6)) {
+        fprintf(stdout, "Не заданы адреса для поиска\n");
+        fprintf(stderr, "DEBUG: %s: No addresses in 'ip-text' or 'ip-text-list'\n", g_lib_name);
+        free_set(&ipt->set);
+        return -1;
+    }
+    build_set(&ipt->set);
+    if (DEBUG) {
+        fprintf(stderr, "DEBUG: %s: %zu networks of %zu prefix lengths\n", g_lib_name, ipt->set.len,
+                ipt->set.groups_len);
+    }
+    return 0;
+}
+
+static int search(const struct ipt_ctx *ipt, const void *data, size_t len) {
+    return scan(ipt, data, len, 0, len, 0);
+}
+
+int plugin_process_buffer(const void *data, size_t len, struct option in_opts[], size_t in_opts_len) {
+    char *DEBUG = getenv("LAB1DEBUG");
+    struct ipt_ctx ipt;
+    if (parse_options(DEBUG, in_opts, in_opts_len, &ipt) == -1) {
+        return -1;
+    }
+    int result = search(&ipt, data, len);
+    free_set(&ipt.set);
+    return result;
+}
+
+int plugin_process_file(const char *fname, struct option in_opts[], size_t in_opts_len) {
+    char *DEBUG = getenv("LAB1DEBUG");
+    struct ipt_ctx ipt;
+    if (parse_options(DEBUG, in_opts, in_opts_len, &ipt) == -1) {
+        return -1;
+    }
+
+    int fd = open(fname, O_RDONLY);
+    struct stat file_stat;
+    if (fd == -1 || fstat(fd, &file_stat) == -1 || file_stat.st_size == 0) {
+        if (DEBUG) {
+            fprintf(stderr, "DEBUG: %s: Cannot read file '%s' or it is empty\n", g_lib_name, fname);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+        free_set(&ipt.set);
+        return 1;
+    }
+    char *data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        if (DEBUG) {
+            fprintf(stderr, "DEBUG: %s: mmap failed for file '%s'\n", g_lib_name, fname);
+        }
+        free_set(&ipt.set);
+        return 1;
+    }
+    int result = search(&ipt, data, file_stat.st_size);
+    munmap(data, file_stat.st_size);
+    free_set(&ipt.set);
+    return result;
+}
+
+int plugin_init(struct option in_opts[], size_t in_opts_len, void **ctx) {
+    char *DEBUG = getenv("LAB1DEBUG");
+    struct ipt_ctx *ipt = malloc(sizeof(struct ipt_ctx));
+    if (!ipt) {
+        return -1;
+    }
+    if (parse_options(DEBUG, in_opts, in_opts_len, ipt) == -1) {
+        free(ipt);
+        return -1;
+    }
+    *ctx = ipt;
+    return 0;
+}
+
+int plugin_process_buffer_ctx(void *ctx, const void *data, size_t len) {
+    return search(ctx, data, len);
+}
+
+void plugin_fini(void *ctx) {
+    struct ipt_ctx *ipt = ctx;
+    free_set(&ipt->set);
+    free(ipt);
+}
+
+void plugin_set_matches(void *ctx, struct plugin_matches *matches) {
+    struct ipt_ctx *ipt = ctx;
+    ipt->matches = matches;
+}
+
+int plugin_process_batch(void *ctx, const struct plugin_buffer *files, size_t count,
+                         int *verdicts) {
+    for (size_t i = 0; i < count; i++) {
+        verdicts[i] = search(ctx, files[i].data, files[i].len);
+    }
+    return 0;
+}
+
+#define STREAM_CONTINUE 2
+
+/*
+ * Per-file state of a streamed search. Candidates before 'examined' are
+ * searched; the last bytes seen are kept from IPT_CONTEXT before it, so that
+ * runs crossing windows are seen whole. Windows shorter than two contexts
+ * are only added to them.
+ */
+struct ipt_stream {
+    const struct ipt_ctx *ipt;
+    unsigned char kept[4 * IPT_CONTEXT];
+    size_t kept_len;
+    /* File offsets of kept[0] and of the first candidate not searched yet */
+    size_t kept_base;
+    size_t examined;
+    int found;
+};
+
+int plugin_stream_begin(void *ctx, size_t len, void **state) {
+    (void)len;
+    struct ipt_stream *stream = malloc(sizeof(struct ipt_stream));
+    if (!stream) {
+        return -1;
+    }
+    stream->ipt = ctx;
+    stream->kept_len = 0;
+    stream->kept_base = 0;
+    stream->examined = 0;
+    stream->found = 0;
+    *state = stream;
+    return 0;
+}
+
+// Keep the bytes from IPT_CONTEXT before 'examined' on
+static void trim_kept(struct ipt_stream *stream) {
+    size_t base = stream->examined > IPT_CONTEXT ? stream->examined - IPT_CONTEXT : 0;
+    if (base > stream->kept_base) {
+        size_t drop = base - stream->kept_base;
+        memmove(stream->kept, stream->kept + drop, stream->kept_len - drop);
+        stream->kept_len -= drop;
+        stream->kept_base = base;
+    }
+}
+
+int plugin_stream_feed(void *state, const void *chunk, size_t len, size_t offset) {
+    struct ipt_stream *stream = state;
+    const struct ipt_ctx *ipt = stream->ipt;
+    const unsigned char *data = chunk;
+    size_t head = len < 2 * IPT_CONTEXT ? len : 2 * IPT_CONTEXT;
+    memcpy(stream->kept + stream->kept_len, data, head);
+    size_t joined_len = stream->kept_len + head;
+    size_t from = stream->examined - stream->kept_base;
+
+    if (head < len) {
+        // Runs with a candidate before the window or in its first context, then the rest of it
+        if (scan(ipt, stream->kept, joined_len, from, offset + IPT_CONTEXT - stream->kept_base,
+                 stream->kept_base) == 0) {
+            stream->found = 1;
+        }
+        if ((!stream->found || ipt->matches) &&
+            scan(ipt, data, len, IPT_CONTEXT, len - IPT_CONTEXT, offset) == 0) {
+            stream->found = 1;
+        }
+        memcpy(stream->kept, data + len - 2 * IPT_CONTEXT, 2 * IPT_CONTEXT);
+        stream->kept_len = 2 * IPT_CONTEXT;
+        stream->kept_base = offset + len - 2 * IPT_CONTEXT;
+        stream->examined = offset + len - IPT_CONTEXT;
+    } else {
+        stream->kept_len = joined_len;
+        size_t to = joined_len > IPT_CONTEXT ? joined_len - IPT_CONTEXT : 0;
+        if (to > from) {
+            if (scan(ipt, stream->kept, joined_len, from, to, stream->kept_base) == 0) {
+                stream->found = 1;
+            }
+            stream->examined = stream->kept_base + to;
+        }
+        trim_kept(stream);
+    }
+    return stream->found && !ipt->matches ? 0 : STREAM_CONTINUE;
+}
+
+int plugin_stream_finish(void *state) {
+    struct ipt_stream *stream = state;
+    // The end of the file ends the runs still open
+    if ((!stream->found || stream->ipt->matches) &&
+        scan(stream->ipt, stream->kept, stream->kept_len, stream->examined - stream->kept_base,
+             stream->kept_len, stream->kept_base) == 0) {
+        stream->found = 1;
+    }
+    int result = stream->found ? 0 : 1;
+    free(stream);
+    return result;
+}
@@ -0,0 +1,845 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct plugin_option {
+    struct option opt;
+    const char *opt_descr;
+};
+
+struct plugin_info {
+    const char *plugin_purpose;
+    const char *plugin_author;
+    size_t sup_opts_len;
+    struct plugin_option *sup_opts;
+    size_t min_size;
+    size_t header_len;
+    int whole_file;
+    int thread_safe;
+};
+
+// Contents of one file of a batch, as in plugin_api.h
+struct plugin_buffer {
+    const void *data;
+    size_t len;
+};
+
+// Version of the plugin interface this plugin is built for
+const int plugin_abi_version = 2;
+
+static char *g_lib_name = "libsig.so";
+static struct plugin_option g_pi[] = {
+    {{"sig", required_argument, NULL, 0}, "Сигнатуры через запятую: байты в hex, ?? для любого байта, например 4D5A??00"},
+    {{"sig-file", required_argument, NULL, 0}, "Файл сигнатур, по одной в строке: [ИМЯ=]HEX, # для комментариев"},
+    {{NULL, 0, NULL, 0}, NULL} // Terminate the array
+};
+
+int plugin_get_info(struct plugin_info *ppi) {
+    ppi->plugin_purpose = "Поиск файлов, содержащих одну из заданных сигнатур байтов";
+    ppi->plugin_author = "Беляков Никита, N3245";
+    ppi->sup_opts_len = 2;
+    ppi->sup_opts = g_pi;
+    // Every signature has at least one byte
+    ppi->min_size = 1;
+    // The automaton is only read, the stream state is per file
+    ppi->thread_safe = 1;
+    return 0;
+}
+
+// Longest signature, the stream keeps one byte less of every window
+#define SIG_MAX_LEN 1024
+// Up to this many bytes starting an anchor, the search skips to the next one with vectors
+#define SIG_SKIP_MAX 48
+// No state, no output entry
+#define SIG_NONE UINT32_MAX
+
+struct signature {
+    char *name;
+    /* Bytes with the wildcards cleared, and 0xff for fixed bytes or 0 for ?? in mask */
+    unsigned char *bytes;
+    unsigned char *mask;
+    size_t len;
+    /* Longest run of fixed bytes, the part the automaton looks for */
+    size_t anchor;
+    size_t anchor_len;
+};
+
+/*
+ * Signature set compiled once. The anchors of all signatures go into an
+ * Aho-Corasick automaton with a full transition table, so each file is
+ * scanned once whatever the number of signatures; every anchor found is
+ * then verified against its whole signature, wildcards included. While the
+ * automaton is at its root, bytes that start no anchor are skipped with a
+ * vector classifier when there are few enough such bytes.
+ */
+struct sig_set {
+    struct signature *sigs;
+    size_t len;
+    size_t capacity;
+    size_t max_len;
+    /* 256 transitions per state, state 0 is the root */
+    uint32_t *delta;
+    size_t states;
+    size_t states_capacity;
+    /* First output entry of a state, its own anchors and then those of its suffixes */
+    uint32_t *outputs;
+    /* Output entries: signature and next entry of the same list */
+    uint32_t *out_sig;
+    uint32_t *out_next;
+    size_t out_len;
+    /* Bytes that start an anchor, and whether to skip to them with vectors */
+    unsigned char starts[256];
+    int skip;
+    /* Nibble tables of the starting bytes for the vector classifier */
+    unsigned char lo_table[16];
+    unsigned char hi_table[16];
+};
+
+struct sig_match {
+    size_t offset;
+    size_t sig;
+};
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Parse "4D 5A ?? 00" into a signature named 'name', 0 if it is not one
+static int parse_signature(const char *name, const char *hex, struct signature *sig) {
+    unsigned char bytes[SIG_MAX_LEN];
+    unsigned char mask[SIG_MAX_LEN];
+    size_t len = 0;
+    for (const char *c = hex; *c;) {
+        if (*c == ' ' || *c == '\t') {
+            c++;
+            continue;
+        }
+        if (len == SIG_MAX_LEN || !c[1]) {
+            return 0;
+        }
+        if (c[0] == '?' && c[1] == '?') {
+            bytes[len] = 0;
+            mask[len] = 0;
+        } else if (hex_value(c[0]) >= 0 && hex_value(c[1]) >= 0) {
+            bytes[len] = (unsigned char)(hex_value(c[0]) << 4 | hex_value(c[1]));
+            mask[len] = 0xff;
+        } else {
+            return 0;
+        }
+        len++;
+        c += 2;
+    }
+
+    // The anchor is the longest run of fixed bytes, the first of equal ones
+    size_t anchor = 0;
+    size_t anchor_len = 0;
+    for (size_t i = 0; i < len;) {
+        size_t run = 0;
+        while (i + run < len && mask[i + run]) {
+            run++;
+        }
+        if (run > anchor_len) {
+            anchor = i;
+            anchor_len = run;
+        }
+        i += run ? run : 1;
+    }
+    if (anchor_len == 0) {
+        return 0;
+    }
+
+    sig->name = strdup(name);
+    sig->bytes = malloc(len);
+    sig->mask = malloc(len);
+    if (!sig->name || !sig->bytes || !sig->mask) {
+        free(sig->name);
+        free(sig->bytes);
+        free(sig->mask);
+        return 0;
+    }
+    memcpy(sig->bytes, bytes, len);
+    memcpy(sig->mask, mask, len);
+    sig->len = len;
+    sig->anchor = anchor;
+    sig->anchor_len = anchor_len;
+    return 1;
+}
+
+static int add_signature(struct sig_set *set, const char *name, const char *hex) {
+    if (set->len == set->capacity) {
+        size_t capacity = set->capacity ? set->capacity * 2 : 16;
+        struct signature *sigs = realloc(set->sigs, capacity * sizeof(struct signature));
+        if (!sigs) {
+            return 0;
+        }
+        set->sigs = sigs;
+        set->capacity = capacity;
+    }
+    if (!parse_signature(name, hex, &set->sigs[set->len])) {
+        return 0;
+    }
+    if (set->sigs[set->len].len > set->max_len) {
+        set->max_len = set->sigs[set->len].len;
+    }
+    set->len++;
+    return 1;
+}
+
+// Add the signatures of a comma separated list, named after themselves.
+// 0 if one of them is invalid.
+static int add_signature_list(struct sig_set *set, const char *list) {
+    char *copy = strdup(list);
+    if (!copy) {
+        return 0;
+    }
+    int valid = 1;
+    char *saveptr = NULL;
+    for (char *item = strtok_r(copy, ",", &saveptr); item && valid;
+         item = strtok_r(NULL, ",", &saveptr)) {
+        valid = add_signature(set, item, item);
+    }
+    free(copy);
+    return valid;
+}
+
+// Add the signatures of a file, -1 if it cannot be read, the number of the
+// invalid line if there is one
+static long add_signature_file(struct sig_set *set, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    char *line = NULL;
+    size_t line_capacity = 0;
+    long line_no = 0;
+    long status = 0;
+    while (status == 0 && getline(&line, &line_capacity, file) != -1) {
+        line_no++;
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        char *start = line;
+        while (*start == ' ' || *start == '\t') {
+            start++;
+        }
+        char *end = start + strlen(start);
+        while (end > start && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' ||
+                               end[-1] == '\r')) {
+            *--end = '\0';
+        }
+        if (*start == '\0') {
+            continue;
+        }
+        char *hex = strchr(start, '=');
+        if (hex) {
+            *hex++ = '\0';
+        }
+        if (!add_signature(set, start, hex ? hex : start)) {
+            status = line_no;
+        }
+    }
+    free(line);
+    fclose(file);
+    return status;
+}
+
+static uint32_t new_state(struct sig_set *set) {
+    if (set->states == set->states_capacity) {
+        size_t capacity = set->states_capacity ? set->states_capacity * 2 : 64;
+        uint32_t *delta = realloc(set->delta, capacity * 256 * sizeof(uint32_t));
+        if (!delta) {
+            return SIG_NONE;
+        }
+        set->delta = delta;
+        uint32_t *outputs = realloc(set->outputs, capacity * sizeof(uint32_t));
+        if (!outputs) {
+            return SIG_NONE;
+        }
+        set->outputs = outputs;
+        set->states_capacity = capacity;
+    }
+    uint32_t state = (uint32_t)set->states++;
+    for (size_t b = 0; b < 256; b++) {
+        set->delta[(size_t)state * 256 + b] = SIG_NONE;
+    }
+    set->outputs[state] = SIG_NONE;
+    return state;
+}
+
+// Build the automaton once every signature is added
+static int build_automaton(struct sig_set *set) {
+    size_t anchors = 0;
+    for (size_t i = 0; i < set->len; i++) {
+        anchors += set->sigs[i].anchor_len;
+    }
+    set->out_sig = malloc(set->len * sizeof(uint32_t));
+    set->out_next = malloc(set->len * sizeof(uint32_t));
+    uint32_t *fail = malloc((anchors + 1) * sizeof(uint32_t));
+    uint32_t *queue = malloc((anchors + 1) * sizeof(uint32_t));
+    int status = set->out_sig && set->out_next && fail && queue && new_state(set) == 0 ? 0 : -1;
+
+    // Trie of the anchors, every signature is an output of the state its anchor ends in
+    for (size_t i = 0; i < set->len && status == 0; i++) {
+        const struct signature *sig = &set->sigs[i];
+        uint32_t state = 0;
+        for (size_t j = 0; j < sig->anchor_len && status == 0; j++) {
+            uint32_t *next = &set->delta[(size_t)state * 256 + sig->bytes[sig->anchor + j]];
+            if (*next == SIG_NONE) {
+                uint32_t created = new_state(set);
+                if (created == SIG_NONE) {
+                    status = -1;
+                    break;
+                }
+                // new_state may move the table
+                next = &set->delta[(size_t)state * 256 + sig->bytes[sig->anchor + j]];
+                *next = created;
+            }
+            state = *next;
+        }
+        if (status == 0) {
+            set->out_sig[set->out_len] = (uint32_t)i;
+            set->out_next[set->out_len] = set->outputs[state];
+            set->outputs[state] = (uint32_t)set->out_len++;
+        }
+    }
+
+    // Breadth first, so the longest proper suffix of a state is done before it
+    size_t head = 0;
+    size_t tail = 0;
+    for (size_t b = 0; b < 256 && status == 0; b++) {
+        uint32_t child = set->delta[b];
+        if (child == SIG_NONE) {
+            set->delta[b] = 0;
+        } else {
+            set->starts[b] = 1;
+            fail[child] = 0;
+            queue[tail++] = child;
+        }
+    }
+    while (head < tail && status == 0) {
+        uint32_t state = queue[head++];
+        // Own outputs are followed by those of the suffix
+        uint32_t *last = &set->outputs[state];
+        while (*last != SIG_NONE) {
+            last = &set->out_next[*last];
+        }
+        *last = set->outputs[fail[state]];
+        for (size_t b = 0; b < 256; b++) {
+            uint32_t *next = &set->delta[(size_t)state * 256 + b];
+            uint32_t fallback = set->delta[(size_t)fail[state] * 256 + b];
+            if (*next == SIG_NONE) {
+                *next = fallback;
+            } else {
+                fail[*next] = fallback;
+                queue[tail++] = *next;
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+
+    size_t starts = 0;
+    for (size_t b = 0; b < 256; b++) {
+        if (set->starts[b]) {
+            starts++;
+            // Buckets by the high nibble modulo 8, so b ^ 0x80 may pass as well
+            set->lo_table[b & 0x0f] |= (unsigned char)(1u << ((b >> 4) & 7));
+        }
+    }
+    for (size_t h = 0; h < 16; h++) {
+        set->hi_table[h] = (unsigned char)(1u << (h & 7));
+    }
+    set->skip = starts <= SIG_SKIP_MAX;
+    return status;
+}
+
+static void free_set(struct sig_set *set) {
+    for (size_t i = 0; i < set->len; i++) {
+        free(set->sigs[i].name);
+        free(set->sigs[i].bytes);
+        free(set->sigs[i].mask);
+    }
+    free(set->sigs);
+    free(set->delta);
+    free(set->outputs);
+    free(set->out_sig);
+    free(set->out_next);
+}
+
+static size_t skip_scalar(const struct sig_set *set, const unsigned char *data, size_t i,
+                          size_t len) {
+    while (i < len && !set->starts[data[i]]) {
+        i++;
+    }
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/*
+ * Position of the next byte that may start an anchor. A byte passes when
+ * the entry of its low nibble has the bit of its high nibble's bucket, which
+ * two pshufb lookups tell for a whole vector at once; the scalar table then
+ * rules out the other byte of the bucket.
+ */
+__attribute__((target("ssse3"))) static size_t skip_ssse3(const struct sig_set *set,
+                                                          const unsigned char *data, size_t i,
+                                                          size_t len) {
+    const __m128i lo_table = _mm_loadu_si128((const __m128i *)set->lo_table);
+    const __m128i hi_table = _mm_loadu_si128((const __m128i *)set->hi_table);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    for (; i + 16 <= len; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i lo = _mm_shuffle_epi8(lo_table, _mm_and_si128(bytes, nibble));
+        __m128i hi = _mm_shuffle_epi8(hi_table, _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble));
+        __m128i miss = _mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128());
+        uint32_t mask = ~(uint32_t)_mm_movemask_epi8(miss) & 0xffff;
+        while (mask) {
+            size_t at = i + (size_t)__builtin_ctz(mask);
+            if (set->starts[data[at]]) {
+                return at;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return skip_scalar(set, data, i, len);
+}
+
+__attribute__((target("avx2"))) static size_t skip_avx2(const struct sig_set *set,
+                                                        const unsigned char *data, size_t i,
+                                                        size_t len) {
+    const __m256i lo_table =
+        _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->lo_table));
+    const __m256i hi_table =
+        _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set->hi_table));
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    for (; i + 32 <= len; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i lo = _mm256_shuffle_epi8(lo_table, _mm256_and_si256(bytes, nibble));
+        __m256i hi =
+            _mm256_shuffle_epi8(hi_table, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble));
+        __m256i miss = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256());
+        uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(miss);
+        while (mask) {
+            size_t at = i + (size_t)__builtin_ctz(mask);
+            if (set->starts[data[at]]) {
+                return at;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return skip_scalar(set, data, i, len);
+}
+#endif
+
+// Skip kernel for this CPU, picked once when the plugin is loaded
+static size_t (*g_skip)(const struct sig_set *, const unsigned char *, size_t,
+                        size_t) = skip_scalar;
+
+__attribute__((constructor)) static void select_skip(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        g_skip = skip_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        g_skip = skip_ssse3;
+    }
+#endif
+}
+
+// Whether the signature is in 'data' at 'start'
+static int verify(const struct signature *sig, const unsigned char *data, size_t len,
+                  size_t start) {
+    if (len - start < sig->len) {
+        return 0;
+    }
+    for (size_t j = 0; j < sig->len; j++) {
+        if ((data[start + j] & sig->mask[j]) != sig->bytes[j]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Whether a signature whose anchor ends at 'i' in 'state' is really there
+static int check_outputs(const struct sig_set *set, const unsigned char *data, size_t len,
+                         size_t i, uint32_t state, struct sig_match *match) {
+    for (uint32_t entry = set->outputs[state]; entry != SIG_NONE; entry = set->out_next[entry]) {
+        const struct signature *sig = &set->sigs[set->out_sig[entry]];
+        size_t before = sig->anchor + sig->anchor_len;
+        if (i + 1 >= before && verify(sig, data, len, i + 1 - before)) {
+            match->offset = i + 1 - before;
+            match->sig = set->out_sig[entry];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Run the automaton over [from, to) of 'data' from '*state'
+static int scan_range(const struct sig_set *set, const unsigned char *data, size_t len,
+                      size_t from, size_t to, uint32_t *state, struct sig_match *match) {
+    uint32_t current = *state;
+    for (size_t i = from; i < to; i++) {
+        if (current == 0 && set->skip) {
+            i = g_skip(set, data, i, to);
+            if (i == to) {
+                break;
+            }
+        }
+        current = set->delta[(size_t)current * 256 + data[i]];
+        if (set->outputs[current] != SIG_NONE &&
+            check_outputs(set, data, len, i, current, match)) {
+            return 1;
+        }
+    }
+    *state = current;
+    return 0;
+}
+
+/*
+ * Find the first signature whose anchor ends in 'data', 0 if there is none.
+ * Every step of the automaton waits for the transition loaded by the one
+ * before, so large buffers without a skip are cut into SIG_LANES parts
+ * that are run in lockstep. Each part goes on for the longest signature
+ * past its end, the next part starts from the root and cannot see
+ * signatures that begin before it.
+ */
+#define SIG_LANES 4
+
+static int find_match(const struct sig_set *set, const unsigned char *data, size_t len,
+                      struct sig_match *match) {
+    uint32_t state = 0;
+    size_t part = len / SIG_LANES;
+    if (set->skip || part < 4 * set->max_len) {
+        return scan_range(set, data, len, 0, len, &state, match);
+    }
+
+    size_t pos[SIG_LANES];
+    size_t end[SIG_LANES];
+    uint32_t states[SIG_LANES];
+    for (size_t lane = 0; lane < SIG_LANES; lane++) {
+        pos[lane] = lane * part;
+        end[lane] = lane + 1 < SIG_LANES ? pos[lane] + part + set->max_len - 1 : len;
+        states[lane] = 0;
+    }
+    size_t steps = end[0] - pos[0] < end[SIG_LANES - 1] - pos[SIG_LANES - 1]
+                       ? end[0] - pos[0]
+                       : end[SIG_LANES - 1] - pos[SIG_LANES - 1];
+    for (size_t step = 0; step < steps; step++) {
+        for (size_t lane = 0; lane < SIG_LANES; lane++) {
+            size_t i = pos[lane] + step;
+            states[lane] = set->delta[(size_t)states[lane] * 256 + data[i]];
+            if (set->outputs[states[lane]] != SIG_NONE &&
+                check_outputs(set, data, len, i, states[lane], match)) {
+                return 1;
+            }
+        }
+    }
+    for (size_t lane = 0; lane < SIG_LANES; lane++) {
+        if (scan_range(set, data, len, pos[lane] + steps, end[lane], &states[lane], match)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Every scan thread gets a context from plugin_init, all with the same
+ * options. The first one compiles the set and the others share it, it is
+ * only read during the scan; the last plugin_fini frees it.
+ */
+struct sig_shared {
+    struct sig_set set;
+    /* Options the set was compiled from, see options_key */
+    char *key;
+    size_t refs;
+};
+
+static pthread_mutex_t g_shared_lock = PTHREAD_MUTEX_INITIALIZER;
+// Set of the contexts alive, NULL when there are none
+static struct sig_shared *g_shared;
+
+struct sig_ctx {
+    const struct sig_set *set;
+    /* NULL when the set belongs to a single call */
+    struct sig_shared *shared;
+    int debug;
+};
+
+// Check the options and compile the signatures, -1 if they are invalid
+static int parse_options(const char *DEBUG, struct option in_opts[], size_t in_opts_len,
+                         struct sig_set *set) {
+    memset(set, 0, sizeof(*set));
+    for (size_t i = 0; i < in_opts_len; i++) {
+        const char *arg = (const char *)in_opts[i].flag;
+        if (DEBUG) {
+            fprintf(stderr, "DEBUG: %s: Got option '%s' with arg '%s'\n", g_lib_name, in_opts[i].name, arg);
+        }
+        if (strcmp(in_opts[i].name, "sig") == 0) {
+            if (!add_signature_list(set, arg)) {
+                fprintf(stdout, "Неверный аргумент опции sig\n");
+                free_set(set);
+                return -1;
+            }
+        } else if (strcmp(in_opts[i].name, "sig-file") == 0) {
+            long status = add_signature_file(set, arg);
+            if (status != 0) {
+                if (status == -1) {
+                    fprintf(stdout, "Не удалось прочитать файл %s опции sig-file\n", arg);
+                } else {
+                    fprintf(stdout, "Неверная сигнатура в строке %ld файла %s\n", status, arg);
+                }
+                free_set(set);
+                return -1;
+            }
+        }
+    }
+    if (set->len == 0) {
+        fprintf(stdout, "Не заданы сигнатуры для поиска\n");
+        fprintf(stderr, "DEBUG: %s: No signatures in 'sig' or 'sig-file'\n", g_lib_name);
+        free_set(set);
+        return -1;
+    }
+    if (build_automaton(set) == -1) {
+        fprintf(stderr, "DEBUG: %s: Out of memory for the signature automaton\n", g_lib_name);
+        free_set(set);
+        return -1;
+    }
+    if (DEBUG) {
+        fprintf(stderr, "DEBUG: %s: %zu signatures, %zu states\n", g_lib_name, set->len,
+                set->states);
+    }
+    return 0;
+}
+
+// The options as "NAME=ARG" lines, what contexts sharing a set agree on; NULL when out
+// of memory
+static char *options_key(struct option in_opts[], size_t in_opts_len) {
+    size_t len = 1;
+    for (size_t i = 0; i < in_opts_len; i++) {
+        len += strlen(in_opts[i].name) + strlen((const char *)in_opts[i].flag) + 2;
+    }
+    char *key = malloc(len);
+    if (!key) {
+        return NULL;
+    }
+    char *end = key;
+    for (size_t i = 0; i < in_opts_len; i++) {
+        end += sprintf(end, "%s=%s\n", in_opts[i].name, (const char *)in_opts[i].flag);
+    }
+    *end = '\0';
+    return key;
+}
+
+// Take a reference to the set of the contexts alive, or compile one; NULL on error
+static struct sig_shared *acquire_set(const char *DEBUG, struct option in_opts[],
+                                      size_t in_opts_len) {
+    char *key = options_key(in_opts, in_opts_len);
+    if (!key) {
+        return NULL;
+    }
+    pthread_mutex_lock(&g_shared_lock);
+    struct sig_shared *shared = g_shared;
+    if (shared && strcmp(shared->key, key) == 0) {
+        shared->refs++;
+        pthread_mutex_unlock(&g_shared_lock);
+        free(key);
+        return shared;
+    }
+    // Compiled under the lock, so the other threads wait for this set instead of
+    // compiling their own
+    shared = malloc(sizeof(struct sig_shared));
+    if (!shared || parse_options(DEBUG, in_opts, in_opts_len, &shared->set) == -1) {
+        pthread_mutex_unlock(&g_shared_lock);
+        free(shared);
+        free(key);
+        return NULL;
+    }
+    shared->key = key;
+    shared->refs = 1;
+    // Contexts with other options keep a set of their own
+    if (!g_shared) {
+        g_shared = shared;
+    }
+    pthread_mutex_unlock(&g_shared_lock);
+    return shared;
+}
+
+static void release_set(struct sig_shared *shared) {
+    pthread_mutex_lock(&g_shared_lock);
+    int last = --shared->refs == 0;
+    if (last && g_shared == shared) {
+        g_shared = NULL;
+    }
+    pthread_mutex_unlock(&g_shared_lock);
+    if (last) {
+        free_set(&shared->set);
+        free(shared->key);
+        free(shared);
+    }
+}
+
+static int search(const struct sig_ctx *sig, const void *data, size_t len) {
+    struct sig_match match;
+    if (!find_match(sig->set, data, len, &match)) {
+        return 1;
+    }
+    if (sig->debug) {
+        fprintf(stderr, "DEBUG: %s: Found '%s' at offset %zu\n", g_lib_name,
+                sig->set->sigs[match.sig].name, match.offset);
+    }
+    return 0;
+}
+
+int plugin_process_buffer(const void *data, size_t len, struct option in_opts[], size_t in_opts_len) {
+    char *DEBUG = getenv("LAB1DEBUG");
+    struct sig_set set;
+    if (parse_options(DEBUG, in_opts, in_opts_len, &set) == -1) {
+        return -1;
+    }
+    struct sig_ctx sig = {&set, NULL, DEBUG != NULL};
+    int result = search(&sig, data, len);
+    free_set(&set);
+    return result;
+}
+
+int plugin_process_file(const char *fname, struct option in_opts[], size_t in_opts_len) {
+    char *DEBUG = getenv("LAB1DEBUG");
+    struct sig_set set;
+    if (parse_options(DEBUG, in_opts, in_opts_len, &set) == -1) {
+        return -1;
+    }
+    struct sig_ctx sig = {&set, NULL, DEBUG != NULL};
+
+    int fd = open(fname, O_RDONLY);
+    struct stat file_stat;
+    if (fd == -1 || fstat(fd, &file_stat) == -1 || file_stat.st_size == 0) {
+        if (DEBUG) {
+            fprintf(stderr, "DEBUG: %s: Cannot read file '%s' or it is empty\n", g_lib_name, fname);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+        free_set(&set);
+        return 1;
+    }
+    char *data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        if (DEBUG) {
+            fprintf(stderr, "DEBUG: %s: mmap failed for file '%s'\n", g_lib_name, fname);
+        }
+        free_set(&set);
+        return 1;
+    }
+    int result = search(&sig, data, file_stat.st_size);
+    munmap(data, file_stat.st_size);
+    free_set(&set);
+    return result;
+}
+
+int plugin_init(struct option in_opts[], size_t in_opts_len, void **ctx) {
+    char *DEBUG = getenv("LAB1DEBUG");
+    struct sig_ctx *sig = malloc(sizeof(struct sig_ctx));
+    if (!sig) {
+        return -1;
+    }
+    sig->shared = acquire_set(DEBUG, in_opts, in_opts_len);
+    if (!sig->shared) {
+        free(sig);
+        return -1;
+    }
+    sig->set = &sig->shared->set;
+    sig->debug = DEBUG != NULL;
+    *ctx = sig;
+    return 0;
+}
+
+int plugin_process_buffer_ctx(void *ctx, const void *data, size_t len) {
+    return search(ctx, data, len);
+}
+
+void plugin_fini(void *ctx) {
+    struct sig_ctx *sig = ctx;
+    release_set(sig->shared);
+    free(sig);
+}
+
+int plugin_process_batch(void *ctx, const struct plugin_buffer *files, size_t count,
+                         int *verdicts) {
+    for (size_t i = 0; i < count; i++) {
+        verdicts[i] = search(ctx, files[i].data, files[i].len);
+    }
+    return 0;
+}
+
+#define STREAM_CONTINUE 2
+
+// Per-file state of a streamed search
+struct sig_stream {
+    const struct sig_ctx *sig;
+    /* Last bytes of the previous windows, a signature may span two of them */
+    unsigned char tail[SIG_MAX_LEN - 1];
+    size_t tail_len;
+    /* Tail followed by the start of the current window */
+    unsigned char joined[2 * (SIG_MAX_LEN - 1)];
+};
+
+int plugin_stream_begin(void *ctx, size_t len, void **state) {
+    (void)len;
+    struct sig_stream *stream = malloc(sizeof(struct sig_stream));
+    if (!stream) {
+        return -1;
+    }
+    stream->sig = ctx;
+    stream->tail_len = 0;
+    *state = stream;
+    return 0;
+}
+
+int plugin_stream_feed(void *state, const void *chunk, size_t len, size_t offset) {
+    (void)offset;
+    struct sig_stream *stream = state;
+    const unsigned char *data = chunk;
+    size_t keep = stream->sig->set->max_len - 1;
+
+    // Signatures starting in the tail and ending in this window
+    size_t head = len < keep ? len : keep;
+    memcpy(stream->joined, stream->tail, stream->tail_len);
+    memcpy(stream->joined + stream->tail_len, data, head);
+    if ((stream->tail_len && search(stream->sig, stream->joined, stream->tail_len + head) == 0) ||
+        search(stream->sig, data, len) == 0) {
+        return 0;
+    }
+
+    // Keep the last bytes seen, some of them from the old tail if the window is short
+    size_t kept = stream->tail_len + head;
+    memcpy(stream->joined + stream->tail_len, data + len - head, head);
+    stream->tail_len = kept < keep ? kept : keep;
+    memcpy(stream->tail, stream->joined + kept - stream->tail_len, stream->tail_len);
+    return STREAM_CONTINUE;
+}
+
+int plugin_stream_finish(void *state) {
+    free(state);
+    return 1;
+}
@@ -1,10 +1,27 @@
 #include "file_handler.h"
 #include "logger.h"
+#include "result_sink.h"
+#include "scan_cache.h"
+#include "scan_dedup.h"
+#include "scan_dir.h"
+#include "scan_filter.h"
+#include "scan_list.h"
+#include "scan_order.h"
+#include "scan_pool.h"
+#include "scan_query.h"
+#include "scan_watch.h"
+#include "uring_reader.h"
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 // Function to evaluate flags based on the 'option_O' flag
@@ -12,83 +29,1507 @@ int evaluate_flags(int flag1, int flag2) {
     return option_O ? (flag1 && flag2) : (flag1 || flag2);
 }
 
-// Function to check a file against the plugins in the list
-int process_file_with_plugins(char *filename, struct plugin_list *plugins) {
-    LOG_DEBUG("process_file_with_plugins: Processing file: %s", filename);
+// Paths read from the file list by one task, the next part is left to another task
+#define FILE_LIST_BATCH 1024
 
-    struct plugin_list_node *current_plugin = plugins->head;
-    int combined_flag = option_O;
-    int plugin_result;
+// Files larger than this are fed to streaming plugins in windows of this size,
+// small enough to stay in L2 while every plugin looks at them
+#define STREAM_WINDOW (256 * 1024)
+// No streamed result for a plugin
+#define STREAM_NONE (-2)
+// plugin_get_ranges asked for the whole file
+#define RANGES_WHOLE_FILE (-3)
 
-    while (current_plugin) {
-        plugin_result = (*(current_plugin->plugin.func))(filename, 
-                            current_plugin->plugin.opts,
-                            current_plugin->plugin.opts_len);
-        
-        if (plugin_result == -1) {
-            LOG_ERROR("process_file_with_plugins: Error in plugin while processing file: %s",
-                    filename);
-            return -1;
+// Files a worker checks between two sorts of its plugin order
+#define ORDER_INTERVAL 256
+
+// Small files of one directory are read together and given to the plugins
+// that take batches (plugin_process_batch) in one call, up to this many at a
+// time and up to this size. Batched files are never streamed.
+#define BATCH_FILES 64
+#define BATCH_FILE_MAX (64 * 1024)
+
+// Buffers reused by one worker for every task it runs
+struct worker_state {
+    struct scan_path path;
+    struct scan_dirents dirents;
+    /* Files of the directory being listed, in the order they will be processed */
+    struct scan_entry **files;
+    size_t files_len;
+    size_t files_capacity;
+    /* Verdict of every plugin for the current file, in list order */
+    struct plugin_verdict *verdicts;
+    /* The same states in the form kept by the dedup tables */
+    unsigned char *states;
+    /* Per plugin state and result of the streamed pass over the current file,
+       or the results of the batch plugins for it */
+    void **stream_states;
+    int *stream_results;
+    /* Order the plugins are tried in, as indices into the list */
+    size_t *order;
+    /* Operand order of the --where expression */
+    size_t *query_order;
+    /* Parts of files read with pread for plugins that declared what they need */
+    unsigned char *read_buffer;
+    size_t read_capacity;
+    /* Cost and verdicts measured by this worker, and scratch space to merge them */
+    struct scan_order_stats *stats;
+    struct scan_order_stats *merged;
+    size_t since_sort;
+    /* Contents of the files of the current batch, one after another */
+    unsigned char *batch_data;
+    size_t batch_capacity;
+    struct plugin_buffer batch_files[BATCH_FILES];
+    /* Files one batch plugin is asked about, and its verdicts for them */
+    struct plugin_buffer batch_asked[BATCH_FILES];
+    size_t batch_positions[BATCH_FILES];
+    int batch_verdicts[BATCH_FILES];
+    /* Results of the batch plugins, plugins_len per file of the batch */
+    int *batch_results;
+    /* Context of every plugin for this worker, its own for ABI 2 plugins */
+    void **contexts;
+    /* Matches reported for the current file, option_matches entries of
+       match_list per plugin. NULL unless --matches is in effect. */
+    struct plugin_matches *matches;
+    struct plugin_match *match_list;
+};
+
+struct scan_context {
+    struct plugin_list *plugins;
+    /* Watched root (--watch), without trailing slashes */
+    const char *root_path;
+    size_t root_len;
+    /* File list (--files-from), read by one SCAN_TASK_LIST at a time */
+    struct scan_list *list;
+    size_t plugins_len;
+    struct result_sink *sink;
+    struct worker_state *workers;
+    size_t workers_len;
+    /* One io_uring reader per worker when option_U is in effect */
+    struct uring_reader *readers;
+    /* Plugins by their position in the list */
+    struct loaded_plugin **plugin_table;
+    /* Held while a plugin that is not thread safe runs, by position in the list */
+    pthread_mutex_t *plugin_locks;
+    /* Verdict cache (--cache) and the key of every plugin, in list order */
+    struct scan_cache *cache;
+    uint64_t *plugin_keys;
+    /* Statistics of earlier runs (--plugin-stats), in list order */
+    struct scan_order_stats *prior;
+    /* Whether plugin calls are timed, for the adaptive order or the statistics file */
+    int measure;
+    /* Compiled --where expression, NULL to combine all plugins with -A or -O */
+    struct scan_query *query;
+    /* Verdicts shared between hard links (and identical files with --dedup-content) */
+    struct scan_dedup *dedup;
+    /* Whether any plugin takes files in windows (plugin_stream_begin) */
+    int streaming;
+    /* Whether any plugin takes many files at once (plugin_process_batch) */
+    int batching;
+};
+
+// State shared with the entry handler while one directory is listed
+struct listing {
+    struct scan_pool *pool;
+    size_t worker;
+    struct worker_state *state;
+};
+
+// Directory entry with the physical position of its data (--fiemap)
+struct placed_entry {
+    uint64_t physical;
+    struct scan_entry *entry;
+};
+
+// State of one batch going through the io_uring reader
+struct batch_run {
+    struct scan_context *ctx;
+    size_t worker;
+    struct scan_dir *dir;
+    struct scan_batch *batch;
+};
+
+// Contents of the file being checked, read once for all plugins that take a buffer
+struct file_view {
+    /* Descriptor of the directory and the name of the file in it */
+    int dirfd;
+    const char *name;
+    const unsigned char *data;
+    size_t len;
+    /* Mapping made by file_view_load, NULL when 'data' belongs to the caller */
+    void *mapping;
+    /* Descriptor opened by file_view_open, -1 before, and the file size then */
+    int fd;
+    size_t size;
+    int failed;
+};
+
+static int file_view_open(struct file_view *view) {
+    if (view->fd != -1) {
+        return 0;
+    }
+    if (view->failed) {
+        return -1;
+    }
+    view->failed = 1;
+    // Relative to the directory, the kernel does not walk the whole path again
+    int fd = openat(view->dirfd, view->name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    view->fd = fd;
+    view->size = (size_t)st.st_size;
+    view->failed = 0;
+    return 0;
+}
+
+static int file_view_load(struct file_view *view) {
+    if (view->data) {
+        return 0;
+    }
+    if (file_view_open(view) == -1) {
+        return -1;
+    }
+    if (view->size == 0) {
+        // Truncated since it was listed, nothing to map
+        view->data = (const unsigned char *)"";
+        view->len = 0;
+        return 0;
+    }
+    void *mapping = mmap(NULL, view->size, PROT_READ, MAP_PRIVATE, view->fd, 0);
+    if (mapping == MAP_FAILED) {
+        view->failed = 1;
+        return -1;
+    }
+    // Plugins scan the buffer front to back
+    madvise(mapping, view->size, MADV_SEQUENTIAL);
+    view->mapping = mapping;
+    view->data = (const unsigned char *)mapping;
+    view->len = view->size;
+    return 0;
+}
+
+// Size of the file, from the contents when they are in memory already
+static int file_view_size(struct file_view *view, size_t *size) {
+    if (view->data) {
+        *size = view->len;
+        return 0;
+    }
+    if (file_view_open(view) == -1) {
+        return -1;
+    }
+    *size = view->size;
+    return 0;
+}
+
+// Bytes [offset, offset + len) of the file, from memory when the file is there
+// and read into the buffer of the worker otherwise. NULL when the file is
+// shorter or cannot be read.
+static const unsigned char *file_view_range(struct file_view *view, struct worker_state *state,
+                                            size_t offset, size_t len) {
+    if (view->data) {
+        return offset + len <= view->len ? view->data + offset : NULL;
+    }
+    if (file_view_open(view) == -1) {
+        return NULL;
+    }
+    if (len > state->read_capacity) {
+        unsigned char *buffer = (unsigned char *)realloc(state->read_buffer, len);
+        if (!buffer) {
+            LOG_ERROR("file_view_range: Out of memory");
+            return NULL;
         }
+        state->read_buffer = buffer;
+        state->read_capacity = len;
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t got = pread(view->fd, state->read_buffer + done, len - done, (off_t)(offset + done));
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return NULL;
+        }
+        done += (size_t)got;
+    }
+    return state->read_buffer;
+}
+
+static void file_view_release(struct file_view *view) {
+    if (view->mapping) {
+        munmap(view->mapping, view->len);
+    }
+    if (view->fd != -1) {
+        close(view->fd);
+    }
+}
+
+// Full path of a file, built into the path buffer of the worker the first time
+// it is needed: for the output, log messages and plugin_process_file
+struct file_name {
+    const struct scan_dir *dir;
+    const struct scan_entry *entry;
+    struct scan_path *buf;
+    const char *path;
+};
+
+static const char *file_name_path(struct file_name *name) {
+    if (!name->path) {
+        name->path = scan_path_build(name->buf, name->dir, name->entry);
+    }
+    return name->path;
+}
+
+static long long monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
 
-        combined_flag = evaluate_flags(combined_flag, plugin_result);
-        
-        if (combined_flag && option_A) {
+// Feed only the ranges a plugin asked for, RANGES_WHOLE_FILE when it wants all of the file
+static int run_plugin_ranges(const struct loaded_plugin *plugin, void *context,
+                             struct file_name *name, struct file_view *view,
+                             struct worker_state *state) {
+    size_t size;
+    if (file_view_size(view, &size) == -1) {
+        LOG_DEBUG("run_plugin_ranges: Cannot read file: %s", file_name_path(name));
+        return 1;
+    }
+    struct plugin_range ranges[PLUGIN_RANGES_MAX];
+    size_t ranges_len = PLUGIN_RANGES_MAX;
+    int status = plugin->get_ranges(context, size, ranges, &ranges_len);
+    if (status != 0) {
+        return status == 1 ? RANGES_WHOLE_FILE : -1;
+    }
+    void *stream = NULL;
+    if (plugin->stream_begin(context, size, &stream) == -1) {
+        return -1;
+    }
+    int result = PLUGIN_STREAM_CONTINUE;
+    for (size_t i = 0; i < ranges_len && i < PLUGIN_RANGES_MAX && result == PLUGIN_STREAM_CONTINUE;
+         i++) {
+        size_t offset = ranges[i].offset;
+        size_t end = offset < size && ranges[i].len < size - offset ? offset + ranges[i].len : size;
+        while (offset < end && result == PLUGIN_STREAM_CONTINUE) {
+            size_t len = end - offset < STREAM_WINDOW ? end - offset : STREAM_WINDOW;
+            const unsigned char *chunk = file_view_range(view, state, offset, len);
+            if (!chunk) {
+                // Shrunk or unreadable, plugin_stream_finish tells what that means
+                end = 0;
+                break;
+            }
+            result = plugin->stream_feed(stream, chunk, len, offset);
+            offset += len;
+        }
+        if (end == 0) {
             break;
         }
-        
-        current_plugin = current_plugin->next;
     }
+    int finished = plugin->stream_finish(stream);
+    return result == PLUGIN_STREAM_CONTINUE ? finished : result;
+}
 
-    return !combined_flag;
+// Run one plugin, on the shared contents when it takes a buffer, or on the
+// parts of the file it declared it needs. 'context' is the plugin context of
+// the calling worker.
+static int run_plugin(const struct loaded_plugin *plugin, void *context, struct file_name *name,
+                      struct file_view *view, struct worker_state *state) {
+    if (plugin->get_ranges && plugin->ready) {
+        int result = run_plugin_ranges(plugin, context, name, view, state);
+        if (result != RANGES_WHOLE_FILE) {
+            return result;
+        }
+    }
+    if (plugin->header_len && !view->data && (plugin->ready || plugin->process_buffer)) {
+        size_t size;
+        if (file_view_size(view, &size) == 0 && size > plugin->header_len) {
+            const unsigned char *header = file_view_range(view, state, 0, plugin->header_len);
+            if (header) {
+                return plugin->ready ? plugin->process_ctx(context, header, plugin->header_len)
+                                     : plugin->process_buffer(header, plugin->header_len,
+                                                              plugin->opts, plugin->opts_len);
+            }
+        }
+    }
+    if (plugin->ready) {
+        if (file_view_load(view) == 0) {
+            return plugin->process_ctx(context, view->data, view->len);
+        }
+        LOG_DEBUG("run_plugin: Cannot read file: %s", file_name_path(name));
+        return 1;
+    }
+    if (plugin->process_buffer && file_view_load(view) == 0) {
+        return plugin->process_buffer(view->data, view->len, plugin->opts, plugin->opts_len);
+    }
+    if (plugin->func) {
+        return plugin->func(file_name_path(name), plugin->opts, plugin->opts_len);
+    }
+    // Unreadable files do not match, as with the file based entry point
+    LOG_DEBUG("run_plugin: Cannot read file: %s", file_name_path(name));
+    return 1;
+}
+
+// Plugins that are not thread safe are called by one worker at a time
+static void lock_plugin(struct scan_context *ctx, size_t index) {
+    if (!ctx->plugin_table[index]->thread_safe) {
+        pthread_mutex_lock(&ctx->plugin_locks[index]);
+    }
+}
+
+static void unlock_plugin(struct scan_context *ctx, size_t index) {
+    if (!ctx->plugin_table[index]->thread_safe) {
+        pthread_mutex_unlock(&ctx->plugin_locks[index]);
+    }
 }
 
-// Function to recursively process files in a directory
-void handle_directory_files(char *directory_path, struct plugin_list *plugins) {
-    LOG_DEBUG("handle_directory_files: Processing directory: %s", directory_path);
+// Feed a large file window by window to all streaming plugins the cache cannot
+// answer, so each window is read from memory once and is still in cache for
+// the next plugin. Results land in state->stream_results, STREAM_NONE for
+// plugins that were not streamed.
+static void stream_plugins(const struct scan_entry *entry, struct scan_context *ctx,
+                           struct worker_state *state, struct file_view *view) {
+    int *results = state->stream_results;
+    void **states = state->stream_states;
+    size_t active = 0;
+    size_t index = 0;
 
-    struct dirent *file_entry;
-    struct stat file_stat;
-    DIR *directory = opendir(directory_path);
-    int plugin_result = 0;
+    for (index = 0; index < ctx->plugins_len; index++) {
+        results[index] = STREAM_NONE;
+        states[index] = NULL;
+    }
+    for (size_t step = 0; step < ctx->plugins_len; step++) {
+        index = state->order[step];
+        const struct loaded_plugin *plugin = ctx->plugin_table[index];
+        // Plugins that need less than the whole file are asked on their own
+        if (!plugin->stream_begin || plugin->get_ranges || plugin->header_len ||
+            (ctx->query && !scan_query_uses(ctx->query, index)) ||
+            (ctx->cache && scan_cache_lookup(ctx->cache, entry, ctx->plugin_keys[index]) != -1)) {
+            continue;
+        }
+        // The file may have shrunk since it was listed
+        if (file_view_load(view) == -1 || view->len <= STREAM_WINDOW) {
+            return;
+        }
+        lock_plugin(ctx, index);
+        int begun = plugin->stream_begin(state->contexts[index], view->len, &states[index]);
+        unlock_plugin(ctx, index);
+        if (begun == -1) {
+            results[index] = -1;
+            continue;
+        }
+        results[index] = PLUGIN_STREAM_CONTINUE;
+        active++;
+    }
 
-    if (!directory) {
-        LOG_ERROR("handle_directory_files: Error opening directory: %s", directory_path);
+    // A mismatch settles the result with -A, a match with -O. Which verdicts
+    // a --where expression needs is only known when it is evaluated.
+    int cut = !ctx->query;
+    int settling = option_O ? 0 : 1;
+    for (size_t offset = 0; offset < view->len && active; offset += STREAM_WINDOW) {
+        size_t len = view->len - offset < STREAM_WINDOW ? view->len - offset : STREAM_WINDOW;
+        // A plugin after one that settled the result is never asked
+        int settled = 0;
+        for (size_t step = 0; step < ctx->plugins_len; step++) {
+            index = state->order[step];
+            if (cut && results[index] == settling) {
+                settled = 1;
+            }
+            if (results[index] != PLUGIN_STREAM_CONTINUE) {
+                continue;
+            }
+            if (settled) {
+                results[index] = STREAM_NONE;
+                active--;
+                continue;
+            }
+            lock_plugin(ctx, index);
+            results[index] =
+                ctx->plugin_table[index]->stream_feed(states[index], view->data + offset, len, offset);
+            unlock_plugin(ctx, index);
+            if (results[index] != PLUGIN_STREAM_CONTINUE) {
+                active--;
+            }
+        }
+    }
+
+    for (index = 0; index < ctx->plugins_len; index++) {
+        if (states[index]) {
+            lock_plugin(ctx, index);
+            int result = ctx->plugin_table[index]->stream_finish(states[index]);
+            unlock_plugin(ctx, index);
+            if (results[index] == PLUGIN_STREAM_CONTINUE) {
+                results[index] = result;
+            }
+        }
+    }
+}
+
+// Sort the plugin order of a worker by what it and earlier runs measured
+static void reorder_plugins(struct scan_context *ctx, struct worker_state *state) {
+    for (size_t index = 0; index < ctx->plugins_len; index++) {
+        state->merged[index] = state->stats[index];
+        if (ctx->prior) {
+            state->merged[index].calls += ctx->prior[index].calls;
+            state->merged[index].matches += ctx->prior[index].matches;
+            state->merged[index].total_ns += ctx->prior[index].total_ns;
+        }
+    }
+    if (ctx->query) {
+        scan_query_order(ctx->query, state->merged, state->query_order);
+    } else {
+        scan_order_sort(state->merged, ctx->plugins_len, option_O, state->order);
+    }
+    state->since_sort = 0;
+}
+
+// File being checked, shared by the plugin checks of one file
+struct file_check {
+    struct file_name *name;
+    const struct scan_entry *entry;
+    struct scan_context *ctx;
+    struct worker_state *state;
+    struct file_view view;
+};
+
+// Verdict of one plugin for the file: 0 match, 1 no match, -1 error. Plugins
+// that already gave a verdict for this file are not asked again.
+static int check_plugin(struct file_check *check, size_t index) {
+    struct scan_context *ctx = check->ctx;
+    struct worker_state *state = check->state;
+    struct plugin_verdict *verdict = &state->verdicts[index];
+    int plugin_result = -1;
+
+    if (verdict->state != PLUGIN_VERDICT_SKIPPED) {
+        return verdict->state == PLUGIN_VERDICT_MATCH ? 0 : 1;
+    }
+    // The cache keeps no offsets, plugins reporting matches (--matches) are always run
+    int reports_matches = state->matches && ctx->plugin_table[index]->set_matches;
+    if (ctx->cache && !reports_matches) {
+        plugin_result = scan_cache_lookup(ctx->cache, check->entry, ctx->plugin_keys[index]);
+        verdict->cached = plugin_result != -1;
+    }
+    if (plugin_result == -1) {
+        if (state->stream_results[index] != STREAM_NONE) {
+            plugin_result = state->stream_results[index];
+        } else if ((size_t)check->entry->size < ctx->plugin_table[index]->min_size) {
+            // Too small to match, nothing to read
+            plugin_result = 1;
+        } else {
+            // Waiting for the lock of a plugin counts as its cost
+            long long started = ctx->measure ? monotonic_ns() : 0;
+            lock_plugin(ctx, index);
+            plugin_result = run_plugin(ctx->plugin_table[index], state->contexts[index],
+                                       check->name, &check->view, state);
+            unlock_plugin(ctx, index);
+            if (ctx->measure) {
+                state->stats[index].calls++;
+                state->stats[index].matches += plugin_result == 0;
+                state->stats[index].total_ns += (uint64_t)(monotonic_ns() - started);
+            }
+        }
+        if (plugin_result != -1 && ctx->cache) {
+            scan_cache_store(ctx->cache, check->entry, ctx->plugin_keys[index], plugin_result);
+        }
+    }
+    if (plugin_result != -1) {
+        verdict->state = plugin_result ? PLUGIN_VERDICT_NO_MATCH : PLUGIN_VERDICT_MATCH;
+        if (reports_matches) {
+            verdict->matches = &state->matches[index];
+        }
+    }
+    return plugin_result;
+}
+
+// A name of the --where expression is true when its plugin matches
+static int query_leaf(size_t plugin, void *arg) {
+    int plugin_result = check_plugin((struct file_check *)arg, plugin);
+    return plugin_result == -1 ? -1 : !plugin_result;
+}
+
+// Function to check a file against the plugins in the list, or the --where
+// expression over them. 'data' holds the file contents when they are already
+// in memory, 'batched' the results of the batch plugins when the file was
+// checked as part of a batch.
+static int process_file_with_plugins(struct file_name *name, const unsigned char *data,
+                                     const int *batched, struct scan_context *ctx,
+                                     struct worker_state *state) {
+    const struct scan_entry *entry = name->entry;
+    LOG_DEBUG("process_file_with_plugins: Processing file: %s", file_name_path(name));
+
+    struct file_check check = {
+        .name = name,
+        .entry = entry,
+        .ctx = ctx,
+        .state = state,
+        .view =
+            {
+                .dirfd = name->dir->fd,
+                .name = entry->name,
+                .data = data,
+                .len = data ? (size_t)entry->size : 0,
+                .mapping = NULL,
+                .fd = -1,
+                .size = 0,
+                .failed = 0,
+            },
+    };
+    int matched = 0;
+
+    for (size_t index = 0; state->matches && index < ctx->plugins_len; index++) {
+        state->matches[index].count = 0;
+        state->matches[index].len = 0;
+    }
+    if (ctx->streaming && entry->size > STREAM_WINDOW) {
+        stream_plugins(entry, ctx, state, &check.view);
+    } else {
+        for (size_t index = 0; index < ctx->plugins_len; index++) {
+            state->stream_results[index] = batched ? batched[index] : STREAM_NONE;
+        }
+    }
+
+    for (size_t index = 0; index < ctx->plugins_len; index++) {
+        state->verdicts[index].state = PLUGIN_VERDICT_SKIPPED;
+        state->verdicts[index].cached = 0;
+        state->verdicts[index].matches = NULL;
+    }
+
+    if (ctx->query) {
+        matched = scan_query_eval(ctx->query, state->query_order, query_leaf, &check);
+    } else {
+        int combined_flag = option_O;
+        for (size_t step = 0; step < ctx->plugins_len; step++) {
+            int plugin_result = check_plugin(&check, state->order[step]);
+            if (plugin_result == -1) {
+                combined_flag = -1;
+                break;
+            }
+
+            combined_flag = evaluate_flags(combined_flag, plugin_result);
+
+            // The remaining plugins cannot change a settled result
+            if (combined_flag != option_O) {
+                break;
+            }
+        }
+        matched = combined_flag == -1 ? -1 : !combined_flag;
+    }
+
+    if (matched == -1) {
+        LOG_ERROR("process_file_with_plugins: Error in plugin while processing file: %s",
+                  file_name_path(name));
+    } else if (ctx->measure && !option_fixed_order && ++state->since_sort == ORDER_INTERVAL) {
+        reorder_plugins(ctx, state);
+    }
+
+    file_view_release(&check.view);
+    return matched;
+}
+
+static void push_entry(struct scan_pool *pool, size_t worker, struct scan_dir *dir,
+                       struct scan_entry *entry, enum scan_task_kind kind) {
+    struct scan_task task = {
+        .kind = kind,
+        .dir = dir,
+        .entry = entry,
+        .batch = NULL,
+    };
+    scan_dir_retain(dir);
+    scan_pool_push(pool, worker, task);
+}
+
+// Files are queued once the listing is complete
+static void collect_file(struct worker_state *state, struct scan_entry *entry) {
+    if (state->files_len == state->files_capacity) {
+        size_t capacity = state->files_capacity ? state->files_capacity * 2 : 256;
+        struct scan_entry **files =
+            (struct scan_entry **)realloc(state->files, capacity * sizeof(struct scan_entry *));
+        if (!files) {
+            LOG_FATAL("queue_entry: Out of memory");
+            exit(EXIT_FAILURE);
+        }
+        state->files = files;
+        state->files_capacity = capacity;
+    }
+    state->files[state->files_len++] = entry;
+}
+
+static void queue_entry(struct scan_dir *dir, struct scan_entry *entry, void *arg) {
+    struct listing *listing = (struct listing *)arg;
+
+    if (entry->type == DT_DIR) {
+        // Prune directories whose entries are all below the depth limit
+        if (scan_filter_descend(&option_filter, dir->depth + 1)) {
+            push_entry(listing->pool, listing->worker, dir, entry, SCAN_TASK_DIR);
+        }
         return;
     }
+    if (scan_filter_match(&option_filter, entry, entry->name, dir->depth + 1)) {
+        collect_file(listing->state, entry);
+    }
+}
 
-    while ((file_entry = readdir(directory)) != NULL) {
-        char *file_path = (char *)malloc(strlen(directory_path) + strlen(file_entry->d_name) + 2);
-        snprintf(file_path, strlen(directory_path) + strlen(file_entry->d_name) + 2, "%s/%s",
-                 directory_path, file_entry->d_name);
+// Listed directories are not walked (find output names them next to their
+// files) and --max-depth does not apply to listed files
+static void queue_listed_entry(struct scan_dir *dir, struct scan_entry *entry, void *arg) {
+    struct listing *listing = (struct listing *)arg;
+    (void)dir;
 
-        if (strcmp(file_entry->d_name, ".") == 0 || strcmp(file_entry->d_name, "..") == 0) {
-            free(file_path);
-            continue;
+    if (entry->type != DT_DIR) {
+        const char *name = strrchr(entry->name, '/');
+        if (scan_filter_match(&option_filter, entry, name ? name + 1 : entry->name, 0)) {
+            collect_file(listing->state, entry);
+        }
+    }
+}
+
+static int compare_placement(const void *a, const void *b) {
+    const struct placed_entry *lhs = (const struct placed_entry *)a;
+    const struct placed_entry *rhs = (const struct placed_entry *)b;
+    if (lhs->physical != rhs->physical) {
+        return lhs->physical < rhs->physical ? -1 : 1;
+    }
+    return (lhs->entry->ino > rhs->entry->ino) - (lhs->entry->ino < rhs->entry->ino);
+}
+
+// Reorder the files of a directory by the physical position of their first extent
+static void sort_by_placement(struct scan_dir *dir, struct worker_state *state) {
+    struct placed_entry *placed =
+        (struct placed_entry *)malloc(state->files_len * sizeof(struct placed_entry));
+    if (!placed) {
+        return;
+    }
+    for (size_t i = 0; i < state->files_len; i++) {
+        placed[i].entry = state->files[i];
+        if (scan_entry_physical_offset(dir, state->files[i], &placed[i].physical) == -1) {
+            placed[i].physical = UINT64_MAX;
+        }
+    }
+    qsort(placed, state->files_len, sizeof(struct placed_entry), compare_placement);
+    for (size_t i = 0; i < state->files_len; i++) {
+        state->files[i] = placed[i].entry;
+    }
+    free(placed);
+}
+
+// Queue files in batches of up to 'per_batch', last batch first
+static void push_batches(struct scan_pool *pool, size_t worker, struct scan_dir *dir,
+                         struct scan_entry **files, size_t files_len, size_t per_batch) {
+    size_t batches = (files_len + per_batch - 1) / per_batch;
+    for (size_t b = batches; b-- > 0;) {
+        size_t first = b * per_batch;
+        size_t len = files_len - first < per_batch ? files_len - first : per_batch;
+        struct scan_batch *batch = (struct scan_batch *)scan_dir_alloc(
+            dir, sizeof(struct scan_batch) + len * sizeof(struct scan_entry *));
+        batch->len = len;
+        memcpy(batch->entries, files + first, len * sizeof(struct scan_entry *));
+
+        struct scan_task task = {
+            .kind = SCAN_TASK_FILES,
+            .dir = dir,
+            .entry = NULL,
+            .batch = batch,
+        };
+        scan_dir_retain(dir);
+        scan_pool_push(pool, worker, task);
+    }
+}
+
+// Queue the collected files so the owner pops them in order: the deque is
+// LIFO for its owner, so the last file (or batch) goes in first
+static void queue_files(struct scan_context *ctx, struct scan_pool *pool, size_t worker,
+                        struct scan_dir *dir) {
+    struct worker_state *state = &ctx->workers[worker];
+
+    if (ctx->readers) {
+        // Keep whole queues of files together for the io_uring reader
+        push_batches(pool, worker, dir, state->files, state->files_len, URING_READER_DEPTH);
+        return;
+    }
+    if (!ctx->batching) {
+        for (size_t i = state->files_len; i-- > 0;) {
+            push_entry(pool, worker, dir, state->files[i], SCAN_TASK_FILE);
         }
+        return;
+    }
 
-        lstat(file_path, &file_stat);
+    // Larger files go one by one after the batches of small ones
+    size_t small = 0;
+    for (size_t i = state->files_len; i-- > 0;) {
+        if (state->files[i]->size > BATCH_FILE_MAX) {
+            push_entry(pool, worker, dir, state->files[i], SCAN_TASK_FILE);
+        }
+    }
+    for (size_t i = 0; i < state->files_len; i++) {
+        if (state->files[i]->size <= BATCH_FILE_MAX) {
+            state->files[small++] = state->files[i];
+        }
+    }
+    push_batches(pool, worker, dir, state->files, small, BATCH_FILES);
+}
+
+// Read one directory and queue its entries as new tasks
+static void scan_directory(struct scan_context *ctx, struct scan_pool *pool, size_t worker,
+                           struct scan_dir *directory) {
+    struct worker_state *state = &ctx->workers[worker];
+    struct listing listing = {
+        .pool = pool,
+        .worker = worker,
+        .state = state,
+    };
+    state->files_len = 0;
+    int subdirs = scan_dir_read(directory, &state->dirents, queue_entry, &listing);
+    if (subdirs == -1) {
+        LOG_ERROR("scan_directory: Error opening directory: %s",
+                  scan_path_build(&state->path, directory, NULL));
+        return;
+    }
+    if (option_fiemap && state->files_len > 1) {
+        sort_by_placement(directory, state);
+    }
+    // The file tasks keep the directory, and its descriptor, until they are done
+    queue_files(ctx, pool, worker, directory);
+}
 
-        if ((!S_ISREG(file_stat.st_mode) && !S_ISDIR(file_stat.st_mode)) ||
-            file_stat.st_size == 0) {
-            free(file_path);
+// Turn the next part of the file list into file tasks. The rest of the list is
+// queued first, so an idle worker steals it and keeps reading while this one
+// works through the files.
+static void read_file_list(struct scan_context *ctx, struct scan_pool *pool, size_t worker) {
+    struct worker_state *state = &ctx->workers[worker];
+    struct listing listing = {
+        .pool = pool,
+        .worker = worker,
+        .state = state,
+    };
+    struct scan_dir *holder = scan_dir_open_list();
+    state->files_len = 0;
+    const char *path = NULL;
+    for (size_t read = 0; read < FILE_LIST_BATCH && (path = scan_list_next(ctx->list)); read++) {
+        scan_dir_add_path(holder, path, queue_listed_entry, &listing);
+    }
+    if (path) {
+        struct scan_task rest = {
+            .kind = SCAN_TASK_LIST,
+            .dir = NULL,
+            .entry = NULL,
+            .batch = NULL,
+        };
+        scan_pool_push(pool, worker, rest);
+    }
+    if (option_fiemap && state->files_len > 1) {
+        sort_by_placement(holder, state);
+    }
+    queue_files(ctx, pool, worker, holder);
+    scan_dir_release(holder);
+}
+
+// Run the plugins on one file, or take the verdict of an earlier copy, and
+// report it if it matches. 'data' holds the file contents when they are in memory.
+static int evaluate_path(struct scan_context *ctx, size_t worker, const struct scan_dir *dir,
+                         const struct scan_entry *entry, const unsigned char *data,
+                         const int *batched) {
+    struct worker_state *state = &ctx->workers[worker];
+    // Only the jsonl format reports timings, skip the clock calls otherwise
+    int timed = option_format == RESULT_FORMAT_JSONL;
+    long long started = timed ? monotonic_ns() : 0;
+
+    struct scan_dedup_key key;
+    enum scan_dedup_kind duplicate;
+    int plugin_result = scan_dedup_find(ctx->dedup, dir, entry, &state->path, data, &key,
+                                        state->states, state->matches, &duplicate);
+    struct file_name name = {
+        .dir = dir,
+        .entry = entry,
+        .buf = &state->path,
+        .path = NULL,
+    };
+    if (plugin_result != -1) {
+        for (size_t i = 0; i < ctx->plugins_len; i++) {
+            struct plugin_verdict *verdict = &state->verdicts[i];
+            verdict->state = (enum plugin_verdict_state)state->states[i];
+            verdict->cached = 0;
+            // The copy has the matches of the file it shares the verdict with
+            verdict->matches = state->matches && ctx->plugin_table[i]->set_matches &&
+                                       verdict->state != PLUGIN_VERDICT_SKIPPED
+                                   ? &state->matches[i]
+                                   : NULL;
+        }
+    } else {
+        plugin_result = process_file_with_plugins(&name, data, batched, ctx, state);
+        if (plugin_result != -1) {
+            for (size_t i = 0; i < ctx->plugins_len; i++) {
+                state->states[i] = (unsigned char)state->verdicts[i].state;
+            }
+            scan_dedup_store(ctx->dedup, &key, plugin_result, state->states, state->matches);
+        }
+    }
+
+    if (plugin_result == 1) {
+        struct result_record record = {
+            .path = file_name_path(&name),
+            .size = entry->size,
+            .elapsed_ns = timed ? monotonic_ns() - started : 0,
+            .origin = duplicate == SCAN_DEDUP_INODE     ? RESULT_SAME_INODE
+                      : duplicate == SCAN_DEDUP_CONTENT ? RESULT_SAME_CONTENT
+                                                        : RESULT_EVALUATED,
+            .verdicts = state->verdicts,
+            .verdicts_len = ctx->plugins_len,
+        };
+        result_sink_write(ctx->sink, worker, &record);
+    }
+    return plugin_result;
+}
+
+static int evaluate_file(struct scan_context *ctx, size_t worker, struct scan_dir *dir,
+                         struct scan_entry *entry, const unsigned char *data) {
+    return evaluate_path(ctx, worker, dir, entry, data, NULL);
+}
+
+// Called by the io_uring reader once a file is in memory (page cache warm for
+// the plugins) or when it has to go through the synchronous path
+static int evaluate_batch_file(size_t index, const unsigned char *data, size_t len, void *arg) {
+    struct batch_run *run = (struct batch_run *)arg;
+    struct scan_entry *entry = run->batch->entries[index];
+    // A file that changed size since it was listed is hashed from disk if needed
+    if (data && len != (size_t)entry->size) {
+        data = NULL;
+    }
+    return evaluate_file(run->ctx, run->worker, run->dir, entry, data) == -1 ? -1 : 0;
+}
+
+// Read a small file whole into 'buffer', which has room for one more byte to
+// notice files that grew since they were listed. -1 when it changed or cannot be read.
+static int read_small_file(int dirfd, const struct scan_entry *entry, unsigned char *buffer) {
+    int fd = openat(dirfd, entry->name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    size_t want = (size_t)entry->size + 1;
+    size_t done = 0;
+    while (done < want) {
+        ssize_t got = read(fd, buffer + done, want - done);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        done += (size_t)got;
+    }
+    close(fd);
+    return done == (size_t)entry->size ? 0 : -1;
+}
+
+// Ask every batch plugin about the files of a batch in one call. Files the
+// cache answers, files too small for the plugin and unread files are left to
+// check_plugin, as are plugins the --where expression does not use.
+static void run_batch_plugins(struct scan_context *ctx, struct worker_state *state,
+                              const struct scan_batch *batch) {
+    int *results = state->batch_results;
+    for (size_t i = 0; i < batch->len * ctx->plugins_len; i++) {
+        results[i] = STREAM_NONE;
+    }
+    for (size_t index = 0; index < ctx->plugins_len; index++) {
+        const struct loaded_plugin *plugin = ctx->plugin_table[index];
+        // A plugin reporting matches has them for one file at a time
+        if (!plugin->process_batch || !plugin->ready || (state->matches && plugin->set_matches) ||
+            (ctx->query && !scan_query_uses(ctx->query, index))) {
             continue;
         }
+        size_t asked = 0;
+        for (size_t i = 0; i < batch->len; i++) {
+            const struct scan_entry *entry = batch->entries[i];
+            if (!state->batch_files[i].data || (size_t)entry->size < plugin->min_size ||
+                (ctx->cache && scan_cache_lookup(ctx->cache, entry, ctx->plugin_keys[index]) != -1)) {
+                continue;
+            }
+            state->batch_asked[asked] = state->batch_files[i];
+            state->batch_positions[asked++] = i;
+        }
+        if (asked == 0) {
+            continue;
+        }
+        long long started = ctx->measure ? monotonic_ns() : 0;
+        lock_plugin(ctx, index);
+        int status = plugin->process_batch(state->contexts[index], state->batch_asked, asked,
+                                           state->batch_verdicts);
+        unlock_plugin(ctx, index);
+        if (status == -1) {
+            for (size_t k = 0; k < asked; k++) {
+                state->batch_verdicts[k] = -1;
+            }
+        }
+        for (size_t k = 0; k < asked; k++) {
+            results[state->batch_positions[k] * ctx->plugins_len + index] = state->batch_verdicts[k];
+        }
+        if (ctx->measure) {
+            // The order works with the cost of one file
+            state->stats[index].calls += asked;
+            for (size_t k = 0; k < asked; k++) {
+                state->stats[index].matches += state->batch_verdicts[k] == 0;
+            }
+            state->stats[index].total_ns += (uint64_t)(monotonic_ns() - started);
+        }
+    }
+}
+
+// Read the small files of a batch into one buffer, run the batch plugins on
+// all of them and check every file with those results at hand. Plugins
+// without plugin_process_batch still run file by file.
+static int evaluate_batch(struct scan_context *ctx, size_t worker, struct scan_dir *dir,
+                          const struct scan_batch *batch) {
+    struct worker_state *state = &ctx->workers[worker];
+    size_t total = 1;
+    for (size_t i = 0; i < batch->len; i++) {
+        total += (size_t)batch->entries[i]->size;
+    }
+    if (total > state->batch_capacity) {
+        unsigned char *data = (unsigned char *)realloc(state->batch_data, total);
+        if (!data) {
+            LOG_ERROR("evaluate_batch: Out of memory");
+            for (size_t i = 0; i < batch->len; i++) {
+                if (evaluate_file(ctx, worker, dir, batch->entries[i], NULL) == -1) {
+                    return -1;
+                }
+            }
+            return 0;
+        }
+        state->batch_data = data;
+        state->batch_capacity = total;
+    }
+
+    size_t offset = 0;
+    for (size_t i = 0; i < batch->len; i++) {
+        const struct scan_entry *entry = batch->entries[i];
+        // The extra byte read past a file lands where the next one is read to
+        int loaded = read_small_file(dir->fd, entry, state->batch_data + offset) == 0;
+        state->batch_files[i].data = loaded ? state->batch_data + offset : NULL;
+        state->batch_files[i].len = (size_t)entry->size;
+        offset += (size_t)entry->size;
+    }
+    run_batch_plugins(ctx, state, batch);
+
+    for (size_t i = 0; i < batch->len; i++) {
+        struct scan_entry *entry = batch->entries[i];
+        if (evaluate_path(ctx, worker, dir, entry, (const unsigned char *)state->batch_files[i].data,
+                          state->batch_results + i * ctx->plugins_len) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void handle_scan_task(struct scan_pool *pool, size_t worker, struct scan_task task, void *arg) {
+    struct scan_context *ctx = (struct scan_context *)arg;
 
-        if ((file_stat.st_mode & S_IFMT) == S_IFDIR) {
-            handle_directory_files(file_path, plugins);
+    if (task.kind == SCAN_TASK_LIST) {
+        read_file_list(ctx, pool, worker);
+        return;
+    }
+    if (task.kind == SCAN_TASK_DIR) {
+        if (!task.entry) {
+            scan_directory(ctx, pool, worker, task.dir);
         } else {
-            plugin_result = process_file_with_plugins(file_path, plugins);
-            if (plugin_result == -1) {
-                free(file_path);
-                closedir(directory);
+            struct scan_dir *directory = scan_dir_open_child(task.dir, task.entry);
+            if (directory) {
+                scan_directory(ctx, pool, worker, directory);
+                scan_dir_release(directory);
+            } else {
+                LOG_ERROR("handle_scan_task: Error opening directory: %s",
+                          scan_path_build(&ctx->workers[worker].path, task.dir, task.entry));
+            }
+        }
+        scan_dir_release(task.dir);
+        return;
+    }
+
+    int status;
+    if (task.kind == SCAN_TASK_FILES && !ctx->readers) {
+        status = evaluate_batch(ctx, worker, task.dir, task.batch);
+    } else if (task.kind == SCAN_TASK_FILES) {
+        struct batch_run run = {
+            .ctx = ctx,
+            .worker = worker,
+            .dir = task.dir,
+            .batch = task.batch,
+        };
+        status = uring_reader_run(&ctx->readers[worker], task.dir->fd, task.batch->entries,
+                                  task.batch->len, evaluate_batch_file, &run);
+    } else {
+        status = evaluate_file(ctx, worker, task.dir, task.entry, NULL);
+    }
+    if (status == -1) {
+        scan_pool_abort(pool);
+    }
+    scan_dir_release(task.dir);
+}
+
+static void discard_scan_task(struct scan_task task, void *arg) {
+    (void)arg;
+    scan_dir_release(task.dir);
+}
+
+// Plugin a name of the --where expression refers to: one of the options given
+// to it, or its library name with or without the ".so" suffix
+static long resolve_query_name(const char *name, void *arg) {
+    const struct scan_context *ctx = (const struct scan_context *)arg;
+    size_t name_len = strlen(name);
+    for (size_t index = 0; index < ctx->plugins_len; index++) {
+        const struct loaded_plugin *plugin = ctx->plugin_table[index];
+        for (size_t i = 0; i < plugin->opts_len; i++) {
+            if (strcmp(plugin->opts[i].name, name) == 0) {
+                return (long)index;
+            }
+        }
+        if (strcmp(plugin->name, name) == 0 ||
+            (strncmp(plugin->name, name, name_len) == 0 && strcmp(plugin->name + name_len, ".so") == 0)) {
+            return (long)index;
+        }
+    }
+    return -1;
+}
+
+// Give the contexts of a worker the place to report matches in (--matches)
+static void set_worker_matches(struct scan_context *ctx, struct worker_state *state) {
+    size_t slots = ctx->plugins_len ? ctx->plugins_len : 1;
+    state->matches = (struct plugin_matches *)calloc(slots, sizeof(struct plugin_matches));
+    state->match_list =
+        (struct plugin_match *)malloc(slots * (size_t)option_matches * sizeof(struct plugin_match));
+    if (!state->matches || !state->match_list) {
+        LOG_FATAL("init_scan_context: Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t index = 0; index < ctx->plugins_len; index++) {
+        const struct loaded_plugin *plugin = ctx->plugin_table[index];
+        state->matches[index].capacity = (size_t)option_matches;
+        state->matches[index].list = state->match_list + index * (size_t)option_matches;
+        if (plugin->set_matches && plugin->ready) {
+            plugin->set_matches(state->contexts[index], &state->matches[index]);
+        }
+    }
+}
+
+static void init_scan_context(struct scan_context *ctx, struct plugin_list *plugins) {
+    ctx->plugins = plugins;
+    ctx->workers_len = option_j ? (size_t)option_j : scan_pool_default_workers();
+    ctx->plugins_len = 0;
+    ctx->sink = result_sink_open(STDOUT_FILENO, (enum result_format)option_format, ctx->workers_len,
+                                 option_S);
+    ctx->workers = (struct worker_state *)calloc(ctx->workers_len, sizeof(struct worker_state));
+    ctx->readers = NULL;
+    ctx->cache = NULL;
+    ctx->plugin_keys = NULL;
+    ctx->prior = NULL;
+    ctx->dedup = NULL;
+    ctx->root_path = NULL;
+    ctx->root_len = 0;
+    ctx->list = NULL;
+    if (!ctx->workers || !ctx->sink) {
+        LOG_FATAL("init_scan_context: Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    ctx->streaming = 0;
+    ctx->batching = 0;
+    for (struct plugin_list_node *node = plugins->head; node; node = node->next) {
+        ctx->plugins_len++;
+        ctx->streaming |= node->plugin.stream_begin && !node->plugin.get_ranges &&
+                          !node->plugin.header_len;
+        ctx->batching |= node->plugin.process_batch != NULL;
+    }
+    size_t slots = ctx->plugins_len ? ctx->plugins_len : 1;
+    ctx->plugin_table = (struct loaded_plugin **)malloc(slots * sizeof(struct loaded_plugin *));
+    if (!ctx->plugin_table) {
+        LOG_FATAL("init_scan_context: Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    size_t position = 0;
+    for (struct plugin_list_node *node = plugins->head; node; node = node->next) {
+        ctx->plugin_table[position++] = &node->plugin;
+    }
+    ctx->plugin_locks = (pthread_mutex_t *)malloc(slots * sizeof(pthread_mutex_t));
+    if (!ctx->plugin_locks) {
+        LOG_FATAL("init_scan_context: Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t index = 0; index < ctx->plugins_len; index++) {
+        pthread_mutex_init(&ctx->plugin_locks[index], NULL);
+    }
+    ctx->query = NULL;
+    if (option_where) {
+        ctx->query = scan_query_compile(option_where, resolve_query_name, ctx);
+        if (!ctx->query) {
+            LOG_FATAL("init_scan_context: Invalid --where expression: %s", option_where);
+            exit(EXIT_FAILURE);
+        }
+        for (size_t index = 0; index < ctx->plugins_len; index++) {
+            if (!scan_query_uses(ctx->query, index)) {
+                LOG_WARN("init_scan_context: Plugin %s is not used by --where",
+                         ctx->plugin_table[index]->name);
+            }
+        }
+    }
+    size_t query_slots = ctx->query && scan_query_order_len(ctx->query)
+                             ? scan_query_order_len(ctx->query)
+                             : 1;
+    // A single plugin has no order to learn
+    ctx->measure = option_plugin_stats_path || (!option_fixed_order && ctx->plugins_len > 1);
+    ctx->dedup = scan_dedup_open(ctx->plugins_len, option_dedup_content);
+    if (!ctx->dedup) {
+        LOG_FATAL("init_scan_context: Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < ctx->workers_len; i++) {
+        ctx->workers[i].verdicts = (struct plugin_verdict *)calloc(
+            ctx->plugins_len ? ctx->plugins_len : 1, sizeof(struct plugin_verdict));
+        ctx->workers[i].states = (unsigned char *)calloc(ctx->plugins_len ? ctx->plugins_len : 1, 1);
+        ctx->workers[i].stream_states =
+            (void **)calloc(ctx->plugins_len ? ctx->plugins_len : 1, sizeof(void *));
+        ctx->workers[i].stream_results =
+            (int *)calloc(ctx->plugins_len ? ctx->plugins_len : 1, sizeof(int));
+        ctx->workers[i].order = (size_t *)malloc(slots * sizeof(size_t));
+        ctx->workers[i].query_order = (size_t *)malloc(query_slots * sizeof(size_t));
+        ctx->workers[i].stats =
+            (struct scan_order_stats *)calloc(slots, sizeof(struct scan_order_stats));
+        ctx->workers[i].merged =
+            (struct scan_order_stats *)calloc(slots, sizeof(struct scan_order_stats));
+        ctx->workers[i].batch_results = (int *)malloc(BATCH_FILES * slots * sizeof(int));
+        ctx->workers[i].contexts = (void **)malloc(slots * sizeof(void *));
+        if (!ctx->workers[i].batch_results || !ctx->workers[i].contexts ||
+            !ctx->workers[i].verdicts || !ctx->workers[i].states || !ctx->workers[i].stream_states ||
+            !ctx->workers[i].stream_results || !ctx->workers[i].order || !ctx->workers[i].stats ||
+            !ctx->workers[i].merged || !ctx->workers[i].query_order) {
+            LOG_FATAL("init_scan_context: Out of memory");
+            exit(EXIT_FAILURE);
+        }
+        if (ctx->query) {
+            memcpy(ctx->workers[i].query_order, scan_query_initial_order(ctx->query),
+                   scan_query_order_len(ctx->query) * sizeof(size_t));
+        }
+        size_t index = 0;
+        for (struct plugin_list_node *node = plugins->head; node; node = node->next) {
+            ctx->workers[i].contexts[index] = node->plugin.ctx;
+            // The first worker keeps the context made when the arguments were checked
+            if (i > 0 && node->plugin.ready && node->plugin.abi_version >= 2 &&
+                node->plugin.init(node->plugin.opts, node->plugin.opts_len,
+                                  &ctx->workers[i].contexts[index]) == -1) {
+                LOG_FATAL("init_scan_context: plugin_init of %s failed for worker %zu",
+                          node->plugin.name, i);
                 exit(EXIT_FAILURE);
             }
-            if (plugin_result) {
-                LOG_INFO("%s\n", file_path);
+            ctx->workers[i].order[index] = index;
+            ctx->workers[i].verdicts[index++].plugin = node->plugin.name;
+        }
+        if (option_matches) {
+            set_worker_matches(ctx, &ctx->workers[i]);
+        }
+    }
+    if (option_U) {
+        ctx->readers = (struct uring_reader *)calloc(ctx->workers_len, sizeof(struct uring_reader));
+        for (size_t i = 0; ctx->readers && i < ctx->workers_len; i++) {
+            if (uring_reader_init(&ctx->readers[i]) == -1) {
+                LOG_WARN("init_scan_context: io_uring is not available, using synchronous reads");
+                while (i-- > 0) {
+                    uring_reader_exit(&ctx->readers[i]);
+                }
+                free(ctx->readers);
+                ctx->readers = NULL;
+            }
+        }
+    }
+
+    if (option_cache_path) {
+        ctx->cache = scan_cache_open(option_cache_path);
+    }
+    if (ctx->cache || option_plugin_stats_path) {
+        ctx->plugin_keys =
+            (uint64_t *)malloc((ctx->plugins_len ? ctx->plugins_len : 1) * sizeof(uint64_t));
+        if (!ctx->plugin_keys) {
+            LOG_FATAL("init_scan_context: Out of memory");
+            exit(EXIT_FAILURE);
+        }
+        size_t index = 0;
+        for (struct plugin_list_node *node = plugins->head; node; node = node->next) {
+            ctx->plugin_keys[index++] =
+                scan_cache_plugin_key(node->plugin.name, node->plugin.file_size,
+                                      node->plugin.file_mtime_ns, node->plugin.opts,
+                                      node->plugin.opts_len);
+        }
+    }
+
+    if (option_plugin_stats_path) {
+        ctx->prior = (struct scan_order_stats *)calloc(slots, sizeof(struct scan_order_stats));
+        if (!ctx->prior) {
+            LOG_FATAL("init_scan_context: Out of memory");
+            exit(EXIT_FAILURE);
+        }
+        if (scan_order_load(option_plugin_stats_path, ctx->plugin_keys, ctx->plugins_len,
+                            ctx->prior) == -1) {
+            LOG_INFO("init_scan_context: No plugin statistics in %s yet", option_plugin_stats_path);
+        } else if (!option_fixed_order) {
+            // Start from the order earlier runs settled on
+            reorder_plugins(ctx, &ctx->workers[0]);
+            for (size_t i = 1; i < ctx->workers_len; i++) {
+                memcpy(ctx->workers[i].order, ctx->workers[0].order, slots * sizeof(size_t));
+                memcpy(ctx->workers[i].query_order, ctx->workers[0].query_order,
+                       query_slots * sizeof(size_t));
+            }
+        }
+    }
+}
+
+// Add up what the workers measured and keep it with the earlier runs
+static void save_plugin_stats(struct scan_context *ctx) {
+    struct scan_order_stats *total = ctx->prior;
+    const char **names = (const char **)malloc((ctx->plugins_len ? ctx->plugins_len : 1) *
+                                               sizeof(const char *));
+    if (!names) {
+        LOG_ERROR("save_plugin_stats: Out of memory");
+        return;
+    }
+    for (size_t index = 0; index < ctx->plugins_len; index++) {
+        names[index] = ctx->plugin_table[index]->name;
+        for (size_t i = 0; i < ctx->workers_len; i++) {
+            total[index].calls += ctx->workers[i].stats[index].calls;
+            total[index].matches += ctx->workers[i].stats[index].matches;
+            total[index].total_ns += ctx->workers[i].stats[index].total_ns;
+        }
+    }
+    scan_order_save(option_plugin_stats_path, ctx->plugin_keys, names, ctx->plugins_len, total);
+    free(names);
+}
+
+static void destroy_scan_context(struct scan_context *ctx) {
+    result_sink_close(ctx->sink);
+    if (ctx->prior) {
+        save_plugin_stats(ctx);
+    }
+    for (size_t i = 0; i < ctx->workers_len; i++) {
+        scan_path_free(&ctx->workers[i].path);
+        scan_dirents_free(&ctx->workers[i].dirents);
+        free(ctx->workers[i].files);
+        free(ctx->workers[i].verdicts);
+        free(ctx->workers[i].states);
+        free(ctx->workers[i].stream_states);
+        free(ctx->workers[i].stream_results);
+        free(ctx->workers[i].order);
+        free(ctx->workers[i].query_order);
+        free(ctx->workers[i].read_buffer);
+        free(ctx->workers[i].stats);
+        free(ctx->workers[i].merged);
+        free(ctx->workers[i].batch_data);
+        free(ctx->workers[i].batch_results);
+        for (size_t index = 0; i > 0 && index < ctx->plugins_len; index++) {
+            const struct loaded_plugin *plugin = ctx->plugin_table[index];
+            if (plugin->ready && plugin->abi_version >= 2) {
+                plugin->fini(ctx->workers[i].contexts[index]);
+            }
+        }
+        free(ctx->workers[i].contexts);
+        free(ctx->workers[i].matches);
+        free(ctx->workers[i].match_list);
+    }
+    free(ctx->workers);
+    for (size_t i = 0; ctx->readers && i < ctx->workers_len; i++) {
+        uring_reader_exit(&ctx->readers[i]);
+    }
+    free(ctx->readers);
+    scan_cache_close(ctx->cache);
+    free(ctx->plugin_keys);
+    free(ctx->prior);
+    for (size_t index = 0; index < ctx->plugins_len; index++) {
+        pthread_mutex_destroy(&ctx->plugin_locks[index]);
+    }
+    free(ctx->plugin_locks);
+    free(ctx->plugin_table);
+    scan_query_free(ctx->query);
+    scan_dedup_close(ctx->dedup);
+    scan_list_close(ctx->list);
+}
+
+// Level of a path below the watched root
+static long path_depth(const struct scan_context *ctx, const char *path) {
+    long depth = 0;
+    for (const char *p = path + ctx->root_len; *p; p++) {
+        if (*p == '/' && p[1] != '/' && p[1] != '\0') {
+            depth++;
+        }
+    }
+    return depth;
+}
+
+// Scan the tree under 'path' on the worker threads, -1 if a plugin failed
+static int scan_tree(struct scan_context *ctx, const char *path) {
+    struct scan_dir *root_dir = scan_dir_open_root(path);
+    if (!root_dir) {
+        LOG_ERROR("scan_tree: Error opening directory: %s", path);
+        return 0;
+    }
+    root_dir->depth = path_depth(ctx, path);
+    struct scan_task root = {
+        .kind = SCAN_TASK_DIR,
+        .dir = root_dir,
+        .entry = NULL,
+        .batch = NULL,
+    };
+    return scan_pool_run(ctx->workers_len, &root, 1, handle_scan_task, discard_scan_task, ctx);
+}
+
+// Scan every search path and the file list in a single run of the workers,
+// -1 if a plugin failed
+static int scan_sources(struct scan_context *ctx, char **paths) {
+    size_t paths_len = 0;
+    while (paths[paths_len]) {
+        paths_len++;
+    }
+    struct scan_task *roots = (struct scan_task *)malloc((paths_len + 1) * sizeof(struct scan_task));
+    if (!roots) {
+        LOG_FATAL("scan_sources: Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    size_t roots_len = 0;
+    for (size_t i = 0; i < paths_len; i++) {
+        struct scan_dir *root_dir = scan_dir_open_root(paths[i]);
+        if (!root_dir) {
+            LOG_ERROR("scan_sources: Error opening directory: %s", paths[i]);
+            continue;
+        }
+        roots[roots_len++] = (struct scan_task){
+            .kind = SCAN_TASK_DIR,
+            .dir = root_dir,
+            .entry = NULL,
+            .batch = NULL,
+        };
+    }
+    if (ctx->list) {
+        roots[roots_len++] = (struct scan_task){
+            .kind = SCAN_TASK_LIST,
+            .dir = NULL,
+            .entry = NULL,
+            .batch = NULL,
+        };
+    }
+    int status = roots_len ? scan_pool_run(ctx->workers_len, roots, roots_len, handle_scan_task,
+                                           discard_scan_task, ctx)
+                           : 0;
+    free(roots);
+    return status;
+}
+
+static volatile sig_atomic_t g_watch_stop = 0;
+
+static void stop_watching(int signum) {
+    (void)signum;
+    g_watch_stop = 1;
+}
+
+// Check a changed file like a listed one, at the depth of its path
+struct watch_change {
+    struct scan_context *ctx;
+    long depth;
+};
+
+static void evaluate_change(struct scan_dir *dir, struct scan_entry *entry, void *arg) {
+    struct watch_change *change = (struct watch_change *)arg;
+
+    if (entry->type == DT_DIR) {
+        return;
+    }
+    const char *name = strrchr(entry->name, '/');
+    if (scan_filter_match(&option_filter, entry, name ? name + 1 : entry->name, change->depth)) {
+        evaluate_file(change->ctx, 0, dir, entry, NULL);
+    }
+}
+
+// Re-evaluate whatever changed. Plugin errors are logged and the watch goes on,
+// files often disappear again before they are looked at.
+static void handle_change(enum scan_watch_kind kind, const char *path, void *arg) {
+    struct scan_context *ctx = (struct scan_context *)arg;
+
+    if (kind == SCAN_WATCH_TREE) {
+        if (scan_filter_descend(&option_filter, path_depth(ctx, path))) {
+            scan_tree(ctx, path);
+        }
+        return;
+    }
+
+    // Same checks the directory reader applies
+    struct watch_change change = {
+        .ctx = ctx,
+        .depth = path_depth(ctx, path),
+    };
+    struct scan_dir *holder = scan_dir_open_list();
+    scan_dir_add_path(holder, path, evaluate_change, &change);
+    scan_dir_release(holder);
+}
+
+// Stream matches among changed files until SIGINT or SIGTERM
+static void watch_tree(struct scan_context *ctx, struct scan_watch *watch) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_watching;
+    sigemptyset(&action.sa_mask);
+    // No SA_RESTART: the signal has to interrupt the blocking read
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    while (!g_watch_stop) {
+        if (scan_watch_wait(watch, handle_change, ctx) == -1) {
+            if (errno == EINTR) {
+                continue;
             }
+            LOG_ERROR("watch_tree: Error reading change events");
+            break;
         }
-        free(file_path);
+        result_sink_flush(ctx->sink);
+    }
+}
+
+// Function to process the files under the search paths and in the file list
+// on option_j worker threads
+void handle_directory_files(char **directory_paths, struct plugin_list *plugins) {
+    if (!directory_paths[0] && !option_files_from) {
+        LOG_ERROR("handle_directory_files: No search path to process");
+        return;
+    }
+
+    struct scan_context ctx;
+    init_scan_context(&ctx, plugins);
+    if (option_files_from) {
+        ctx.list = scan_list_open(option_files_from);
+        if (!ctx.list) {
+            LOG_FATAL("handle_directory_files: Cannot open file list: %s", option_files_from);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Subscribe before the initial scan so nothing written meanwhile is missed
+    struct scan_watch *watch = NULL;
+    if (option_watch) {
+        ctx.root_path = directory_paths[0];
+        ctx.root_len = strlen(ctx.root_path);
+        while (ctx.root_len > 0 && ctx.root_path[ctx.root_len - 1] == '/') {
+            ctx.root_len--;
+        }
+        watch = scan_watch_open(ctx.root_path);
+        if (!watch) {
+            LOG_FATAL("handle_directory_files: Cannot watch directory: %s", ctx.root_path);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    int status = scan_sources(&ctx, directory_paths);
+    if (watch && status != -1) {
+        result_sink_flush(ctx.sink);
+        watch_tree(&ctx, watch);
+    }
+    scan_watch_close(watch);
+    destroy_scan_context(&ctx);
+    if (status == -1) {
+        exit(EXIT_FAILURE);
     }
-    closedir(directory);
 }
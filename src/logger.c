@@ -6,10 +6,13 @@
 #include <time.h>
 #if defined(_WIN32) || defined(_WIN64)
 #include <winsock2.h>
-#elif defined(__APPLE__) && defined(__MACH__)
+#else
 #include <pthread.h>
 #include <sys/time.h>
 #include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif /* defined(__linux__) */
 #endif
 
 
@@ -277,7 +280,7 @@ static void getBackupFileName(const char* basename, unsigned char index,
     strncpy(backupname, basename, size);
     if (index > 0) {
         sprintf(indexname, ".%d", index);
-        strncat(backupname, indexname, strlen(indexname));
+        strncat(backupname, indexname, size - strlen(backupname) - 1);
     }
 }
 
@@ -376,11 +379,11 @@ void logger_log(LogLevel level, const char* file, int line, const char* fmt, ...
     lock();
     if (hasFlag(s_logger, kConsoleLogger)) {
         va_start(carg, fmt);
-        printf(ANSI_COLOR_WHITE "[%s]" ANSI_COLOR_RESET " ", timestamp); /* Timestamp */
-        printf("%s[%c]%s ", LOG_COLOR(level), levelc, ANSI_COLOR_RESET); /* Log level */
-        printf(ANSI_COLOR_CYAN "[%s:%d]" ANSI_COLOR_RESET " ", file, line); /* File and Line */
-        vprintf(fmt, carg);                                                /* Message */
-        printf("\n");
+        fprintf(s_clog.output, ANSI_COLOR_WHITE "[%s]" ANSI_COLOR_RESET " ", timestamp); /* Timestamp */
+        fprintf(s_clog.output, "%s[%c]%s ", LOG_COLOR(level), levelc, ANSI_COLOR_RESET); /* Log level */
+        fprintf(s_clog.output, ANSI_COLOR_CYAN "[%s:%d]" ANSI_COLOR_RESET " ", file, line); /* File and Line */
+        vfprintf(s_clog.output, fmt, carg);                                                /* Message */
+        fprintf(s_clog.output, "\n");
         va_end(carg);
     }
     if (hasFlag(s_logger, kFileLogger)) {
@@ -4,6 +4,7 @@
 #include "logger.h"
 #include "loggerconf.h"
 #include "plugin_api.h"
+#include "scan_filter.h"
 
 struct option *long_options = NULL;
 struct plugin_list plugins = {NULL};
@@ -19,7 +20,8 @@ void initialize_logger() {
         logger_autoFlush(0);
         LOG_INFO("Debug mode is on");
     } else {
-        logger_initConsoleLogger(stdout);
+        // stdout carries the found files only
+        logger_initConsoleLogger(stderr);
         logger_setLevel(LogLevel_INFO);
         logger_autoFlush(0);
         LOG_INFO("Debug mode is off");
@@ -30,22 +32,31 @@ void execute_pipeline(int argc, char *argv[]) {
     char *plugin_path = get_plugin_directory_path(argc, argv);
     LOG_DEBUG("Plugin path: %s", plugin_path);
 
-    load_plugins_from_directory(plugin_path, &plugins, &long_options);
+    load_plugins_from_directory(plugin_path, get_plugin_manifest_path(argc, argv), &plugins,
+                                &long_options);
     free(plugin_path);
 
-    char *search_path = parse_command_line_arguments(argc, argv, long_options, &plugins);
-    LOG_DEBUG("Search path: %s", search_path);
+    char **search_paths = parse_command_line_arguments(argc, argv, long_options, &plugins);
+    for (char **path = search_paths; *path; path++) {
+        LOG_DEBUG("Search path: %s", *path);
+    }
     
     filter_active_plugins(&plugins);
+    load_active_plugins(&plugins);
+    init_active_plugins(&plugins);
 
-    handle_directory_files(search_path, &plugins);
+    handle_directory_files(search_paths, &plugins);
 
-    free(search_path);
+    for (char **path = search_paths; *path; path++) {
+        free(*path);
+    }
+    free(search_paths);
 }
 
 void clean_up() {
     free(long_options);
     clear_plugin_list(&plugins);
+    scan_filter_free(&option_filter);
 }
 
 int main(int argc, char *argv[]) {
@@ -1,20 +1,143 @@
 #include <dirent.h>
 #include <dlfcn.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "plugin_api.h"
 #include "file_handler.h"
+#include "plugin_manifest.h"
+#include "plugin_registry.h"
 #include "logger.h"
+#include "result_sink.h"
+#include "scan_filter.h"
 
 int option_A = 0;
 int option_N = 0;
 int option_O = 0;
+int option_S = 0;
+int option_U = 0;
+long option_j = 0;
+char *option_cache_path = NULL;
+int option_fiemap = 0;
+int option_format = RESULT_FORMAT_PLAIN;
+int option_watch = 0;
+int option_dedup_content = 0;
+struct scan_filter option_filter = SCAN_FILTER_INIT;
+char *option_files_from = NULL;
+char *option_plugin_stats_path = NULL;
+int option_fixed_order = 0;
+char *option_where = NULL;
+long option_matches = 0;
 
+// Long options of the program itself, 'val' tells them apart from plugin options
+enum host_option {
+    HOST_OPT_CACHE = 256,
+    HOST_OPT_FIEMAP,
+    HOST_OPT_FORMAT,
+    HOST_OPT_WATCH,
+    HOST_OPT_DEDUP_CONTENT,
+    HOST_OPT_MIN_SIZE,
+    HOST_OPT_MAX_SIZE,
+    HOST_OPT_NEWER,
+    HOST_OPT_OLDER,
+    HOST_OPT_MAX_DEPTH,
+    HOST_OPT_UID,
+    HOST_OPT_GID,
+    HOST_OPT_PERM,
+    HOST_OPT_EXT,
+    HOST_OPT_FILES_FROM,
+    HOST_OPT_PLUGIN_STATS,
+    HOST_OPT_FIXED_ORDER,
+    HOST_OPT_WHERE,
+    HOST_OPT_PLUGIN_MANIFEST,
+    HOST_OPT_MATCHES,
+};
+
+static struct plugin_option g_host_opts[] = {
+    {{"cache", required_argument, NULL, HOST_OPT_CACHE},
+     "Verdict cache file, unchanged files are not read again"},
+    {{"fiemap", no_argument, NULL, HOST_OPT_FIEMAP},
+     "Process the files of a directory in on-disk order"},
+    {{"format", required_argument, NULL, HOST_OPT_FORMAT},
+     "Output format of found files: plain, null or jsonl"},
+    {{"watch", no_argument, NULL, HOST_OPT_WATCH},
+     "Keep running and check files as they are written or moved in"},
+    {{"dedup-content", no_argument, NULL, HOST_OPT_DEDUP_CONTENT},
+     "Reuse the verdict of an identical file instead of checking copies again"},
+    {{"min-size", required_argument, NULL, HOST_OPT_MIN_SIZE},
+     "Skip files smaller than SIZE bytes (k, M, G, T suffixes)"},
+    {{"max-size", required_argument, NULL, HOST_OPT_MAX_SIZE},
+     "Skip files larger than SIZE bytes (k, M, G, T suffixes)"},
+    {{"newer", required_argument, NULL, HOST_OPT_NEWER},
+     "Only files modified after TIME (@EPOCH, YYYY-MM-DD[THH:MM[:SS]] or an age like 12h, 7d)"},
+    {{"older", required_argument, NULL, HOST_OPT_OLDER},
+     "Only files modified before TIME (same forms as --newer)"},
+    {{"max-depth", required_argument, NULL, HOST_OPT_MAX_DEPTH},
+     "Descend at most N levels (1: files in the search path only)"},
+    {{"uid", required_argument, NULL, HOST_OPT_UID},
+     "Only files owned by this user (name or number)"},
+    {{"gid", required_argument, NULL, HOST_OPT_GID},
+     "Only files owned by this group (name or number)"},
+    {{"perm", required_argument, NULL, HOST_OPT_PERM},
+     "Permission bits: MODE exactly, -MODE all of them, /MODE any of them (octal)"},
+    {{"ext", required_argument, NULL, HOST_OPT_EXT},
+     "Only files with one of these comma separated extensions"},
+    {{"files-from", required_argument, NULL, HOST_OPT_FILES_FROM},
+     "Also check the files listed in FILE (- for stdin), newline or NUL separated"},
+    {{"plugin-stats", required_argument, NULL, HOST_OPT_PLUGIN_STATS},
+     "Keep plugin cost and match rates in FILE to order the plugins of later runs"},
+    {{"fixed-order", no_argument, NULL, HOST_OPT_FIXED_ORDER},
+     "Run plugins in command line order instead of cheapest and most decisive first"},
+    {{"where", required_argument, NULL, HOST_OPT_WHERE},
+     "Match files by an expression over plugins instead of -A/-O, e.g. '(entropy AND NOT ipv4-addr-bin) OR seq-num'"},
+    {{"plugin-manifest", required_argument, NULL, HOST_OPT_PLUGIN_MANIFEST},
+     "Keep plugin options in FILE and load only the plugins the command line uses"},
+    {{"matches", required_argument, NULL, HOST_OPT_MATCHES},
+     "Count matches and list up to N offsets per plugin in --format jsonl, where plugins support it"},
+};
+
+#define HOST_OPTS_LEN (sizeof(g_host_opts) / sizeof(g_host_opts[0]))
+
+// Plugins recorded by earlier runs (--plugin-manifest), until the used ones are loaded
+static struct plugin_manifest g_manifest;
+
+#ifndef PATH_MAX
 #define PATH_MAX 1000
+#endif
+
+// Store the argument of a prefilter option in option_filter, -1 if it is invalid
+static int parse_filter_option(int opt, const char *arg) {
+    switch (opt) {
+        case HOST_OPT_MIN_SIZE:
+            return scan_filter_parse_size(arg, &option_filter.min_size);
+        case HOST_OPT_MAX_SIZE:
+            return scan_filter_parse_size(arg, &option_filter.max_size);
+        case HOST_OPT_NEWER:
+            return scan_filter_parse_time(arg, &option_filter.newer_ns);
+        case HOST_OPT_OLDER:
+            return scan_filter_parse_time(arg, &option_filter.older_ns);
+        case HOST_OPT_MAX_DEPTH: {
+            char *endptr = NULL;
+            option_filter.max_depth = strtol(arg, &endptr, 10);
+            return *arg == '\0' || *endptr != '\0' || option_filter.max_depth < 0 ? -1 : 0;
+        }
+        case HOST_OPT_UID:
+            return scan_filter_parse_owner(arg, 0, &option_filter.uid);
+        case HOST_OPT_GID:
+            return scan_filter_parse_owner(arg, 1, &option_filter.gid);
+        case HOST_OPT_PERM:
+            return scan_filter_parse_perm(&option_filter, arg);
+        case HOST_OPT_EXT:
+            return scan_filter_add_extensions(&option_filter, arg);
+        default:
+            return -1;
+    }
+}
 
 void print_version(const char *program_name) {
     LOG_DEBUG("print_version: Printing version");
@@ -24,7 +147,7 @@ void print_version(const char *program_name) {
 void print_help(const char *program_name, const struct plugin_list *plugins) {
     LOG_DEBUG("print_help: Printing help");
 
-    printf("Usage: %s [OPTION] path\n", program_name);
+    printf("Usage: %s [OPTION] [path...]\n", program_name);
     printf("Options:\n");
     printf("  -h\t\tPrint help\n");
     printf("  -v\t\tPrint version\n");
@@ -32,12 +155,24 @@ void print_help(const char *program_name, const struct plugin_list *plugins) {
     printf("  -A\t\tFilter files\n");
     printf("  -O\t\tFiles that passed at least one filter\n");
     printf("  -P path\tPath to plugins directory\n");
+    printf("  -j N\t\tNumber of scan threads (default: number of CPUs)\n");
+    printf("  -S\t\tSort found files (deterministic output order)\n");
+    printf("  -U\t\tRead files through io_uring (falls back to synchronous reads)\n");
+    for (size_t i = 0; i < HOST_OPTS_LEN; i++) {
+        printf("  --%-15s %s\n", g_host_opts[i].opt.name, g_host_opts[i].opt_descr);
+    }
 
     const struct plugin_list_node *current = plugins->head;
     while (current) {
         struct plugin_info ppi;
-        int (*info)(struct plugin_info *) = dlsym(current->plugin.handle, "plugin_get_info");
-        if (info && info(&ppi) == 0) {
+        memset(&ppi, 0, sizeof(ppi));
+        // Plugins known from the manifest are described by it
+        if (current->plugin.manifest) {
+            ppi.plugin_purpose = current->plugin.manifest->purpose;
+            ppi.sup_opts_len = current->plugin.manifest->opts_len;
+            ppi.sup_opts = current->plugin.manifest->opts;
+        }
+        if (current->plugin.manifest || current->plugin.get_info(&ppi) == 0) {
             printf("Plugin: %s\n", ppi.plugin_purpose);
             printf("Options:\n");
             for (size_t i = 0; i < ppi.sup_opts_len; i++) {
@@ -58,7 +193,13 @@ void add_plugin(struct plugin_list *list, struct loaded_plugin plugin) {
 void clear_plugin_list(struct plugin_list *list) {
     while (list->head) {
         struct plugin_list_node *next = list->head->next;
-        dlclose(list->head->plugin.handle);
+        if (list->head->plugin.ready) {
+            list->head->plugin.fini(list->head->plugin.ctx);
+        }
+        if (list->head->plugin.handle) {
+            dlclose(list->head->plugin.handle);
+        }
+        free(list->head->plugin.name);
         free(list->head->plugin.opts);
         free(list->head);
         list->head = next;
@@ -71,7 +212,10 @@ void filter_active_plugins(struct plugin_list *list) {
         if (!(*current)->plugin.flag) {
             struct plugin_list_node *to_remove = *current;
             *current = (*current)->next;
-            dlclose(to_remove->plugin.handle);
+            if (to_remove->plugin.handle) {
+                dlclose(to_remove->plugin.handle);
+            }
+            free(to_remove->plugin.name);
             free(to_remove->plugin.opts);
             free(to_remove);
         } else {
@@ -96,10 +240,28 @@ void filter_active_plugins(struct plugin_list *list) {
     }
 }
 
+void init_active_plugins(struct plugin_list *list) {
+    for (struct plugin_list_node *node = list->head; node; node = node->next) {
+        struct loaded_plugin *plugin = &node->plugin;
+        if (!plugin->init) {
+            continue;
+        }
+        if (plugin->init(plugin->opts, plugin->opts_len, &plugin->ctx) == -1) {
+            LOG_FATAL("init_active_plugins: Invalid arguments for plugin %s", plugin->name);
+            exit(EXIT_FAILURE);
+        }
+        plugin->ready = 1;
+    }
+}
+
 void create_option_array(size_t count, struct option **options, struct plugin_list *list) {
-    *options = (struct option *)malloc((count + 1) * sizeof(struct option));
+    *options = (struct option *)malloc((HOST_OPTS_LEN + count + 1) * sizeof(struct option));
     struct option *opt_array = *options;
     size_t index = 0;
+    for (size_t i = 0; i < HOST_OPTS_LEN; i++) {
+        opt_array[index++] = g_host_opts[i].opt;
+    }
+    count += HOST_OPTS_LEN;
     for (struct plugin_list_node *node = list->head; node; node = node->next) {
         for (size_t i = 0; i < node->plugin.opts_len; i++) {
             opt_array[index++] = node->plugin.opts[i];
@@ -111,19 +273,205 @@ void create_option_array(size_t count, struct option **options, struct plugin_li
     opt_array[count].val = 0;
 }
 
-void load_plugins_from_directory(const char *path, struct plugin_list *list, struct option **options) {
+// Ask a plugin for its info and check its entry points, then set the entry
+// points and capabilities of 'plugin'. -1 when it cannot be used.
+static int bind_plugin(struct loaded_plugin *plugin, const char *origin,
+                       struct plugin_entry_points entry, struct plugin_info *ppi) {
+    memset(ppi, 0, sizeof(*ppi));
+    if (!entry.get_info || entry.get_info(ppi) != 0) {
+        LOG_WARN("load_plugins_from_directory: Failed to get plugin info for %s", origin);
+        return -1;
+    }
+    int abi_version = entry.abi_version ? *entry.abi_version : 1;
+    if (abi_version < 1 || abi_version > PLUGIN_ABI_VERSION) {
+        LOG_WARN("load_plugins_from_directory: %s is built for plugin ABI %d, "
+                 "versions 1 to %d are supported", origin, abi_version, PLUGIN_ABI_VERSION);
+        return -1;
+    }
+    if (entry.init && (!entry.process_ctx || !entry.fini)) {
+        LOG_WARN("load_plugins_from_directory: %s exports plugin_init without "
+                 "plugin_process_buffer_ctx and plugin_fini", origin);
+        return -1;
+    }
+    if (!entry.init || !entry.stream_feed || !entry.stream_finish) {
+        // Streaming needs the context and all three functions
+        entry.stream_begin = NULL;
+    }
+    if (entry.get_ranges && !entry.stream_begin) {
+        LOG_WARN("load_plugins_from_directory: %s exports plugin_get_ranges without "
+                 "the stream functions, reading whole files", origin);
+        entry.get_ranges = NULL;
+    }
+    if (entry.set_matches && (!entry.init || abi_version < 2)) {
+        // A version 1 context is shared by all threads, there is no file to tie matches to
+        LOG_WARN("load_plugins_from_directory: %s exports plugin_set_matches without "
+                 "plugin_init or plugin ABI 2, not reporting matches", origin);
+        entry.set_matches = NULL;
+    }
+    if (entry.process_batch && !entry.init) {
+        LOG_WARN("load_plugins_from_directory: %s exports plugin_process_batch without "
+                 "plugin_init, checking files one by one", origin);
+        entry.process_batch = NULL;
+    }
+    if (ppi->whole_file) {
+        entry.stream_begin = NULL;
+        entry.get_ranges = NULL;
+        ppi->header_len = 0;
+    }
+    if (!entry.process_file && !entry.process_buffer && !entry.init) {
+        LOG_WARN("load_plugins_from_directory: No entry point in %s", origin);
+        return -1;
+    }
+    plugin->get_info = entry.get_info;
+    plugin->func = entry.process_file;
+    plugin->process_buffer = entry.process_buffer;
+    plugin->init = entry.init;
+    plugin->process_ctx = entry.process_ctx;
+    plugin->fini = entry.fini;
+    plugin->stream_begin = entry.stream_begin;
+    plugin->stream_feed = entry.stream_feed;
+    plugin->stream_finish = entry.stream_finish;
+    plugin->get_ranges = entry.get_ranges;
+    plugin->process_batch = entry.process_batch;
+    plugin->set_matches = entry.set_matches;
+    plugin->min_size = ppi->min_size;
+    plugin->header_len = ppi->header_len;
+    plugin->abi_version = abi_version;
+    // Version 1 plugins made no promise about threads
+    plugin->thread_safe = abi_version >= 2 && ppi->thread_safe;
+    return 0;
+}
+
+// Check the entry points of a plugin and add it to the list, -1 when it cannot
+// be used. 'ppi' receives what the plugin told about itself.
+static int register_plugin(struct plugin_list *list, const char *name, const char *origin,
+                           struct plugin_entry_points entry, void *handle,
+                           const struct stat *file, size_t *option_count,
+                           struct plugin_info *ppi) {
+    struct loaded_plugin plugin;
+    memset(&plugin, 0, sizeof(plugin));
+    if (bind_plugin(&plugin, origin, entry, ppi) == -1) {
+        return -1;
+    }
+    struct option *opts = (struct option *)malloc(ppi->sup_opts_len * sizeof(struct option));
+    for (size_t i = 0; i < ppi->sup_opts_len; i++) {
+        opts[i] = ppi->sup_opts[i].opt;
+        LOG_DEBUG("load_plugins_from_directory: Option %s added for plugin %s", opts[i].name, origin);
+    }
+    plugin.name = strdup(name);
+    plugin.opts_len = ppi->sup_opts_len;
+    plugin.opts = opts;
+    plugin.handle = handle;
+    if (file) {
+        plugin.file_size = (uint64_t)file->st_size;
+        plugin.file_mtime_ns = (long long)file->st_mtim.tv_sec * 1000000000LL + file->st_mtim.tv_nsec;
+    }
+    add_plugin(list, plugin);
+    *option_count += ppi->sup_opts_len;
+    return 0;
+}
+
+// Add a plugin with the options recorded in the manifest, without loading it
+static void register_manifest_plugin(struct plugin_list *list, const char *name,
+                                     const struct plugin_manifest_entry *entry,
+                                     size_t *option_count) {
+    struct loaded_plugin plugin;
+    memset(&plugin, 0, sizeof(plugin));
+    struct option *opts = (struct option *)malloc(entry->opts_len * sizeof(struct option));
+    plugin.name = strdup(name);
+    if ((!opts && entry->opts_len) || !plugin.name) {
+        LOG_FATAL("register_manifest_plugin: Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < entry->opts_len; i++) {
+        opts[i] = entry->opts[i].opt;
+    }
+    plugin.opts_len = entry->opts_len;
+    plugin.opts = opts;
+    plugin.manifest = entry;
+    plugin.file_size = entry->size;
+    plugin.file_mtime_ns = entry->mtime_ns;
+    add_plugin(list, plugin);
+    *option_count += entry->opts_len;
+}
+
+static struct plugin_entry_points find_entry_points(void *handle) {
+    struct plugin_entry_points entry_points = {
+        .get_info = dlsym(handle, "plugin_get_info"),
+        .process_file = dlsym(handle, "plugin_process_file"),
+        .process_buffer = dlsym(handle, "plugin_process_buffer"),
+        .init = dlsym(handle, "plugin_init"),
+        .process_ctx = dlsym(handle, "plugin_process_buffer_ctx"),
+        .fini = dlsym(handle, "plugin_fini"),
+        .stream_begin = dlsym(handle, "plugin_stream_begin"),
+        .stream_feed = dlsym(handle, "plugin_stream_feed"),
+        .stream_finish = dlsym(handle, "plugin_stream_finish"),
+        .get_ranges = dlsym(handle, "plugin_get_ranges"),
+        .process_batch = dlsym(handle, "plugin_process_batch"),
+        .set_matches = dlsym(handle, "plugin_set_matches"),
+        .abi_version = dlsym(handle, "plugin_abi_version"),
+    };
+    return entry_points;
+}
+
+static int plugin_registered(const struct plugin_list *list, const char *name) {
+    for (const struct plugin_list_node *node = list->head; node; node = node->next) {
+        if (strcmp(node->plugin.name, name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void load_plugins_from_directory(const char *path, const char *manifest_path,
+                                 struct plugin_list *list, struct option **options) {
+    size_t option_count = 0;
+#ifdef BUILTIN_PLUGINS
+    // Compiled in plugins change with the program
+    struct stat program;
+    int program_known = stat("/proc/self/exe", &program) == 0;
+    for (size_t i = 0; i < builtin_plugins_len; i++) {
+        struct plugin_info ppi;
+        register_plugin(list, builtin_plugins[i].name, builtin_plugins[i].name,
+                        builtin_plugins[i].entry, NULL, program_known ? &program : NULL,
+                        &option_count, &ppi);
+    }
+    LOG_DEBUG("load_plugins_from_directory: %zu plugins compiled in", builtin_plugins_len);
+#endif
+    if (manifest_path && plugin_manifest_load(manifest_path, &g_manifest) == -1) {
+        LOG_INFO("load_plugins_from_directory: No plugin manifest in %s yet", manifest_path);
+    }
     LOG_DEBUG("load_plugins_from_directory: Loading plugins from %s", path);
     DIR *dir = opendir(path);
     if (!dir) {
         LOG_ERROR("load_plugins_from_directory: opendir failed for path %s", path);
+        create_option_array(option_count, options, list);
         return;
     }
     struct dirent *entry;
-    size_t option_count = 0;
     while ((entry = readdir(dir)) != NULL) {
         if (entry->d_type == DT_REG && strstr(entry->d_name, ".so")) {
             char full_path[PATH_MAX];
             snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
+            if (plugin_registered(list, entry->d_name)) {
+                LOG_DEBUG("load_plugins_from_directory: %s is compiled in, skipping %s",
+                          entry->d_name, full_path);
+                continue;
+            }
+            struct stat st;
+            int have_stat = stat(full_path, &st) == 0;
+            int known = manifest_path && have_stat;
+            long long mtime_ns =
+                known ? (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec : 0;
+            const struct plugin_manifest_entry *recorded =
+                known ? plugin_manifest_find(&g_manifest, full_path, (uint64_t)st.st_size, mtime_ns)
+                      : NULL;
+            if (recorded) {
+                LOG_DEBUG("load_plugins_from_directory: Options of %s taken from the manifest",
+                          full_path);
+                register_manifest_plugin(list, entry->d_name, recorded, &option_count);
+                continue;
+            }
             LOG_DEBUG("load_plugins_from_directory: Found plugin %s", full_path);
             void *handle = dlopen(full_path, RTLD_NOW);
             if (!handle) {
@@ -131,33 +479,127 @@ void load_plugins_from_directory(const char *path, struct plugin_list *list, str
                 continue;
             }
             struct plugin_info ppi;
-            int (*info)(struct plugin_info *) = dlsym(handle, "plugin_get_info");
-            if (!info || info(&ppi) != 0) {
-                LOG_WARN("load_plugins_from_directory: Failed to get plugin info for %s", full_path);
+            if (register_plugin(list, entry->d_name, full_path, find_entry_points(handle), handle,
+                                have_stat ? &st : NULL, &option_count, &ppi) == -1) {
                 dlclose(handle);
-                continue;
-            }
-            struct option *opts = (struct option *)malloc(ppi.sup_opts_len * sizeof(struct option));
-            for (size_t i = 0; i < ppi.sup_opts_len; i++) {
-                opts[i] = ppi.sup_opts[i].opt;
-                LOG_DEBUG("load_plugins_from_directory: Option %s added for plugin %s", opts[i].name, full_path);
+            } else if (known) {
+                plugin_manifest_put(&g_manifest, full_path, (uint64_t)st.st_size, mtime_ns, &ppi);
             }
-            struct loaded_plugin plugin = {
-                .func = dlsym(handle, "plugin_process_file"),
-                .opts_len = ppi.sup_opts_len,
-                .opts = opts,
-                .flag = 0,
-                .handle = handle,
-            };
-            add_plugin(list, plugin);
-            option_count += ppi.sup_opts_len;
         }
     }
     closedir(dir);
+    if (manifest_path) {
+        plugin_manifest_save(manifest_path, &g_manifest);
+    }
     LOG_INFO("load_plugins_from_directory: All plugins loaded");
     create_option_array(option_count, options, list);
 }
 
+// Plugin file opened by a thread of load_active_plugins
+struct pending_plugin {
+    const char *path;
+    void *handle;
+    char *error;
+    pthread_t thread;
+    int threaded;
+};
+
+static void *open_pending_plugin(void *arg) {
+    struct pending_plugin *pending = (struct pending_plugin *)arg;
+    pending->handle = dlopen(pending->path, RTLD_NOW);
+    if (!pending->handle) {
+        // dlerror is per thread
+        const char *error = dlerror();
+        pending->error = strdup(error ? error : "unknown error");
+    }
+    return NULL;
+}
+
+// Give the options parsed with the names from the manifest the names of the
+// loaded plugin, -1 if it no longer has one of them
+static int adopt_plugin_options(struct loaded_plugin *plugin, const struct plugin_info *ppi) {
+    for (size_t i = 0; i < plugin->opts_len; i++) {
+        size_t j = 0;
+        while (j < ppi->sup_opts_len &&
+               strcmp(ppi->sup_opts[j].opt.name, plugin->opts[i].name) != 0) {
+            j++;
+        }
+        if (j == ppi->sup_opts_len) {
+            LOG_FATAL("load_active_plugins: Plugin %s has no option --%s any more", plugin->name,
+                      plugin->opts[i].name);
+            return -1;
+        }
+        int *argument = plugin->opts[i].flag;
+        plugin->opts[i] = ppi->sup_opts[j].opt;
+        plugin->opts[i].flag = argument;
+    }
+    return 0;
+}
+
+void load_active_plugins(struct plugin_list *list) {
+    size_t pending_len = 0;
+    for (struct plugin_list_node *node = list->head; node; node = node->next) {
+        pending_len += node->plugin.manifest != NULL;
+    }
+    struct pending_plugin *pending = (struct pending_plugin *)calloc(
+        pending_len ? pending_len : 1, sizeof(struct pending_plugin));
+    if (!pending) {
+        LOG_FATAL("load_active_plugins: Out of memory");
+        exit(EXIT_FAILURE);
+    }
+
+    // Open the files side by side, a single one needs no thread
+    size_t index = 0;
+    for (struct plugin_list_node *node = list->head; node; node = node->next) {
+        if (node->plugin.manifest) {
+            pending[index].path = node->plugin.manifest->path;
+            pending[index].threaded = pending_len > 1 && pthread_create(&pending[index].thread, NULL,
+                                                                        open_pending_plugin,
+                                                                        &pending[index]) == 0;
+            if (!pending[index].threaded) {
+                open_pending_plugin(&pending[index]);
+            }
+            index++;
+        }
+    }
+
+    index = 0;
+    int failed = 0;
+    for (struct plugin_list_node *node = list->head; node; node = node->next) {
+        struct loaded_plugin *plugin = &node->plugin;
+        if (!plugin->manifest) {
+            continue;
+        }
+        struct pending_plugin *current = &pending[index++];
+        if (current->threaded) {
+            pthread_join(current->thread, NULL);
+        }
+        struct plugin_info ppi;
+        if (!current->handle) {
+            LOG_FATAL("load_active_plugins: dlopen failed for %s: %s", current->path,
+                      current->error);
+            failed = 1;
+        } else if (bind_plugin(plugin, current->path, find_entry_points(current->handle), &ppi) ==
+                       -1 ||
+                   adopt_plugin_options(plugin, &ppi) == -1) {
+            LOG_FATAL("load_active_plugins: Plugin %s cannot be used", current->path);
+            dlclose(current->handle);
+            failed = 1;
+        } else {
+            LOG_DEBUG("load_active_plugins: Loaded %s", current->path);
+            plugin->handle = current->handle;
+        }
+        plugin->manifest = NULL;
+        free(current->error);
+    }
+    free(pending);
+    // The options now point into the loaded plugins
+    plugin_manifest_free(&g_manifest);
+    if (failed) {
+        exit(EXIT_FAILURE);
+    }
+}
+
 char *get_plugin_directory_path(int argc, char *argv[]) {
     LOG_DEBUG("get_plugin_directory_path: Getting plugin path");
     char *path = NULL;
@@ -180,12 +622,26 @@ char *get_plugin_directory_path(int argc, char *argv[]) {
     return path;
 }
 
-char *parse_command_line_arguments(int argc, char *argv[], struct option *options, struct plugin_list *list) {
+const char *get_plugin_manifest_path(int argc, char *argv[]) {
+    static const char option[] = "--plugin-manifest";
+    const char *path = NULL;
+    for (int i = 1; i < argc && strcmp(argv[i], "--") != 0; i++) {
+        if (strcmp(argv[i], option) == 0 && i + 1 < argc) {
+            path = argv[++i];
+        } else if (strncmp(argv[i], option, sizeof(option) - 1) == 0 &&
+                   argv[i][sizeof(option) - 1] == '=') {
+            path = argv[i] + sizeof(option);
+        }
+    }
+    return path;
+}
+
+char **parse_command_line_arguments(int argc, char *argv[], struct option *options, struct plugin_list *list) {
     LOG_DEBUG("parse_command_line_arguments: Parsing command line options");
     int opt, optindex;
     opterr = 0;
     optind = 1;
-    while ((opt = getopt_long(argc, argv, "hvNOAP:", options, &optindex)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hvNOAP:j:SU", options, &optindex)) != -1) {
         switch (opt) {
             case 'h':
                 print_help(argv[0], list);
@@ -224,6 +680,83 @@ char *parse_command_line_arguments(int argc, char *argv[], struct option *option
                 break;
             case 'P':
                 break;
+            case HOST_OPT_CACHE:
+                option_cache_path = optarg;
+                break;
+            case HOST_OPT_FIEMAP:
+                option_fiemap = 1;
+                break;
+            case HOST_OPT_FORMAT: {
+                enum result_format format;
+                if (result_format_parse(optarg, &format) == -1) {
+                    LOG_FATAL("parse_command_line_arguments: Unknown output format: %s", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                option_format = (int)format;
+                break;
+            }
+            case HOST_OPT_WATCH:
+                option_watch = 1;
+                break;
+            case HOST_OPT_DEDUP_CONTENT:
+                option_dedup_content = 1;
+                break;
+            case HOST_OPT_MIN_SIZE:
+            case HOST_OPT_MAX_SIZE:
+            case HOST_OPT_NEWER:
+            case HOST_OPT_OLDER:
+            case HOST_OPT_MAX_DEPTH:
+            case HOST_OPT_UID:
+            case HOST_OPT_GID:
+            case HOST_OPT_PERM:
+            case HOST_OPT_EXT:
+                if (parse_filter_option(opt, optarg) == -1) {
+                    LOG_FATAL("parse_command_line_arguments: Invalid value for --%s: %s",
+                              options[optindex].name, optarg);
+                    exit(EXIT_FAILURE);
+                }
+                option_filter.active = 1;
+                break;
+            case HOST_OPT_FILES_FROM:
+                option_files_from = optarg;
+                break;
+            case HOST_OPT_PLUGIN_STATS:
+                option_plugin_stats_path = optarg;
+                break;
+            case HOST_OPT_FIXED_ORDER:
+                option_fixed_order = 1;
+                break;
+            case HOST_OPT_WHERE:
+                option_where = optarg;
+                break;
+            case HOST_OPT_MATCHES: {
+                char *endptr = NULL;
+                option_matches = strtol(optarg, &endptr, 10);
+                if (*optarg == '\0' || *endptr != '\0' || option_matches < 1 ||
+                    option_matches > 65536) {
+                    LOG_FATAL("parse_command_line_arguments: Invalid number of matches: %s", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case HOST_OPT_PLUGIN_MANIFEST:
+                // Used before parsing, by get_plugin_manifest_path
+                break;
+            case 'j': {
+                char *endptr = NULL;
+                option_j = strtol(optarg, &endptr, 10);
+                if (*optarg == '\0' || *endptr != '\0' || option_j < 1) {
+                    LOG_FATAL("parse_command_line_arguments: Invalid number of threads: %s", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case 'S':
+                option_S = 1;
+                break;
+            case 'U':
+                option_U = 1;
+                break;
             case 0: {
                 struct plugin_list_node *current = list->head;
                 while (current) {
@@ -247,15 +780,43 @@ char *parse_command_line_arguments(int argc, char *argv[], struct option *option
                 exit(EXIT_FAILURE);
         }
     }
-    if (!option_A && !option_O) {
+    if (option_where && (option_A || option_O)) {
+        LOG_FATAL("parse_command_line_arguments: --where cannot be used with -A or -O");
+        exit(EXIT_FAILURE);
+    }
+    if (option_matches && option_format != RESULT_FORMAT_JSONL) {
+        LOG_WARN("parse_command_line_arguments: --matches needs --format jsonl, ignoring it");
+        option_matches = 0;
+    }
+    if (!option_A && !option_O && !option_where) {
         option_A = 1;
     }
-    if (argc - optind > 1) {
-        LOG_FATAL("parse_command_line_arguments: Too many arguments detected");
+    if (option_watch && (argc - optind > 1 || option_files_from)) {
+        LOG_FATAL("parse_command_line_arguments: --watch takes a single search path and no --files-from");
         exit(EXIT_FAILURE);
-    } else if (argc - optind == 1) {
-        return realpath(argv[optind], NULL);
-    } else {
-        return realpath(".", NULL);
     }
-}
\ No newline at end of file
+
+    // The current directory is searched when nothing else is given
+    int use_cwd = argc == optind && !option_files_from;
+    char **paths = (char **)calloc((size_t)(argc - optind) + 2, sizeof(char *));
+    if (!paths) {
+        LOG_FATAL("parse_command_line_arguments: Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    size_t paths_len = 0;
+    if (use_cwd) {
+        paths[paths_len] = realpath(".", NULL);
+        if (paths[paths_len]) {
+            paths_len++;
+        }
+    }
+    for (int i = optind; i < argc; i++) {
+        paths[paths_len] = realpath(argv[i], NULL);
+        if (!paths[paths_len]) {
+            LOG_ERROR("parse_command_line_arguments: Search path does not exist: %s", argv[i]);
+            continue;
+        }
+        paths_len++;
+    }
+    return paths;
+}
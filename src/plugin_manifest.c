@@ -0,0 +1,251 @@
+#include "plugin_manifest.h"
+#include "logger.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PLUGIN_MANIFEST_HEADER "# plugin manifest: path, size, mtime, purpose and options of every plugin\n"
+
+static void free_entry(struct plugin_manifest_entry *entry) {
+    if (!entry) {
+        return;
+    }
+    for (size_t i = 0; i < entry->opts_len; i++) {
+        free((char *)entry->opts[i].opt.name);
+        free((char *)entry->opts[i].opt_descr);
+    }
+    free(entry->opts);
+    free(entry->purpose);
+    free(entry->path);
+    free(entry);
+}
+
+static struct plugin_manifest_entry *new_entry(const char *path, uint64_t size, long long mtime_ns) {
+    struct plugin_manifest_entry *entry =
+        (struct plugin_manifest_entry *)calloc(1, sizeof(struct plugin_manifest_entry));
+    if (!entry) {
+        return NULL;
+    }
+    entry->path = strdup(path);
+    entry->purpose = strdup("");
+    if (!entry->path || !entry->purpose) {
+        free_entry(entry);
+        return NULL;
+    }
+    entry->size = size;
+    entry->mtime_ns = mtime_ns;
+    return entry;
+}
+
+static int add_option(struct plugin_manifest_entry *entry, int has_arg, const char *name,
+                      const char *descr) {
+    struct plugin_option *opts = (struct plugin_option *)realloc(
+        entry->opts, (entry->opts_len + 1) * sizeof(struct plugin_option));
+    if (!opts) {
+        return -1;
+    }
+    entry->opts = opts;
+    struct plugin_option *option = &entry->opts[entry->opts_len];
+    option->opt.name = strdup(name);
+    option->opt.has_arg = has_arg;
+    option->opt.flag = NULL;
+    option->opt.val = 0;
+    option->opt_descr = strdup(descr ? descr : "");
+    if (!option->opt.name || !option->opt_descr) {
+        free((char *)option->opt.name);
+        free((char *)option->opt_descr);
+        return -1;
+    }
+    entry->opts_len++;
+    return 0;
+}
+
+// Put an entry in place of the one with the same path, or add it
+static int store_entry(struct plugin_manifest *manifest, struct plugin_manifest_entry *entry) {
+    for (size_t i = 0; i < manifest->len; i++) {
+        if (strcmp(manifest->entries[i]->path, entry->path) == 0) {
+            free_entry(manifest->entries[i]);
+            manifest->entries[i] = entry;
+            return 0;
+        }
+    }
+    if (manifest->len == manifest->capacity) {
+        size_t capacity = manifest->capacity ? manifest->capacity * 2 : 16;
+        struct plugin_manifest_entry **entries = (struct plugin_manifest_entry **)realloc(
+            manifest->entries, capacity * sizeof(struct plugin_manifest_entry *));
+        if (!entries) {
+            return -1;
+        }
+        manifest->entries = entries;
+        manifest->capacity = capacity;
+    }
+    manifest->entries[manifest->len++] = entry;
+    return 0;
+}
+
+// Split 'line' at tabs into at most 'max' fields, the last one keeps the rest
+static size_t split_fields(char *line, char **fields, size_t max) {
+    size_t count = 0;
+    while (count < max) {
+        fields[count++] = line;
+        if (count == max) {
+            break;
+        }
+        char *tab = strchr(line, '\t');
+        if (!tab) {
+            break;
+        }
+        *tab = '\0';
+        line = tab + 1;
+    }
+    return count;
+}
+
+int plugin_manifest_load(const char *path, struct plugin_manifest *manifest) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t line_len;
+    struct plugin_manifest_entry *current = NULL;
+    while ((line_len = getline(&line, &line_capacity, file)) != -1) {
+        if (line_len > 0 && line[line_len - 1] == '\n') {
+            line[line_len - 1] = '\0';
+        }
+        if (strncmp(line, "purpose\t", 8) == 0) {
+            char *purpose = current ? strdup(line + 8) : NULL;
+            if (purpose) {
+                free(current->purpose);
+                current->purpose = purpose;
+            }
+            continue;
+        }
+        char *fields[4];
+        size_t count = split_fields(line, fields, 4);
+        if (count == 4 && strcmp(fields[0], "plugin") == 0) {
+            uint64_t size;
+            long long mtime_ns;
+            if (sscanf(fields[1], "%" SCNu64, &size) != 1 ||
+                sscanf(fields[2], "%lld", &mtime_ns) != 1) {
+                current = NULL;
+                continue;
+            }
+            current = new_entry(fields[3], size, mtime_ns);
+            if (current && store_entry(manifest, current) == -1) {
+                free_entry(current);
+                current = NULL;
+            }
+        } else if (current && count >= 3 && strcmp(fields[0], "option") == 0) {
+            add_option(current, atoi(fields[1]), fields[2], count == 4 ? fields[3] : "");
+        }
+    }
+    free(line);
+    fclose(file);
+    manifest->dirty = 0;
+    return 0;
+}
+
+const struct plugin_manifest_entry *plugin_manifest_find(const struct plugin_manifest *manifest,
+                                                         const char *path, uint64_t size,
+                                                         long long mtime_ns) {
+    for (size_t i = 0; i < manifest->len; i++) {
+        const struct plugin_manifest_entry *entry = manifest->entries[i];
+        if (strcmp(entry->path, path) == 0) {
+            return entry->size == size && entry->mtime_ns == mtime_ns ? entry : NULL;
+        }
+    }
+    return NULL;
+}
+
+int plugin_manifest_put(struct plugin_manifest *manifest, const char *path, uint64_t size,
+                        long long mtime_ns, const struct plugin_info *info) {
+    struct plugin_manifest_entry *entry = new_entry(path, size, mtime_ns);
+    if (!entry) {
+        return -1;
+    }
+    if (info->plugin_purpose) {
+        free(entry->purpose);
+        entry->purpose = strdup(info->plugin_purpose);
+    }
+    for (size_t i = 0; i < info->sup_opts_len; i++) {
+        if (!entry->purpose || add_option(entry, info->sup_opts[i].opt.has_arg,
+                                          info->sup_opts[i].opt.name,
+                                          info->sup_opts[i].opt_descr) == -1) {
+            free_entry(entry);
+            return -1;
+        }
+    }
+    if (!entry->purpose || store_entry(manifest, entry) == -1) {
+        free_entry(entry);
+        return -1;
+    }
+    manifest->dirty = 1;
+    return 0;
+}
+
+// Write a text field, tabs and line breaks would end it early
+static void write_field(FILE *out, const char *text) {
+    for (const char *c = text; *c; c++) {
+        fputc(*c == '\t' || *c == '\n' || *c == '\r' ? ' ' : *c, out);
+    }
+}
+
+int plugin_manifest_save(const char *path, struct plugin_manifest *manifest) {
+    if (!manifest->dirty) {
+        return 0;
+    }
+    size_t path_len = strlen(path);
+    char *tmp_path = (char *)malloc(path_len + 5);
+    if (!tmp_path) {
+        return -1;
+    }
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", 5);
+
+    FILE *out = fopen(tmp_path, "w");
+    if (!out) {
+        LOG_ERROR("plugin_manifest_save: Cannot write %s", tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+    fputs(PLUGIN_MANIFEST_HEADER, out);
+    for (size_t i = 0; i < manifest->len; i++) {
+        const struct plugin_manifest_entry *entry = manifest->entries[i];
+        fprintf(out, "plugin\t%" PRIu64 "\t%lld\t", entry->size, entry->mtime_ns);
+        write_field(out, entry->path);
+        fputs("\npurpose\t", out);
+        write_field(out, entry->purpose);
+        fputc('\n', out);
+        for (size_t j = 0; j < entry->opts_len; j++) {
+            fprintf(out, "option\t%d\t", entry->opts[j].opt.has_arg);
+            write_field(out, entry->opts[j].opt.name);
+            fputc('\t', out);
+            write_field(out, entry->opts[j].opt_descr);
+            fputc('\n', out);
+        }
+    }
+
+    int status = 0;
+    if (fclose(out) != 0 || rename(tmp_path, path) == -1) {
+        LOG_ERROR("plugin_manifest_save: Cannot replace %s", path);
+        remove(tmp_path);
+        status = -1;
+    } else {
+        manifest->dirty = 0;
+    }
+    free(tmp_path);
+    return status;
+}
+
+void plugin_manifest_free(struct plugin_manifest *manifest) {
+    for (size_t i = 0; i < manifest->len; i++) {
+        free_entry(manifest->entries[i]);
+    }
+    free(manifest->entries);
+    manifest->entries = NULL;
+    manifest->len = 0;
+    manifest->capacity = 0;
+}
@@ -0,0 +1,415 @@
+#include "result_sink.h"
+#include "logger.h"
+#include "plugin_api.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// A worker buffer is written out once it holds this much
+#define RESULT_SINK_BUFFER_SIZE (64 * 1024)
+
+struct sink_buffer {
+    char *data;
+    size_t len;
+    size_t capacity;
+};
+
+// Formatted record kept for sorted output: "<path>\0<output>"
+struct sorted_record {
+    char *data;
+    size_t path_len;
+    size_t len;
+};
+
+struct sorted_records {
+    struct sorted_record *items;
+    size_t len;
+    size_t capacity;
+};
+
+struct result_sink {
+    int fd;
+    enum result_format format;
+    int sorted;
+    /* Serializes write(2) calls so records are never interleaved */
+    pthread_mutex_t lock;
+    /* Set after the first failed write, the rest of the output is dropped */
+    int failed;
+    size_t workers;
+    struct sink_buffer *buffers;
+    /* One list per worker, merged whenever the sink is flushed */
+    struct sorted_records *records;
+};
+
+int result_format_parse(const char *name, enum result_format *format) {
+    if (strcmp(name, "plain") == 0) {
+        *format = RESULT_FORMAT_PLAIN;
+    } else if (strcmp(name, "null") == 0) {
+        *format = RESULT_FORMAT_NULL;
+    } else if (strcmp(name, "jsonl") == 0) {
+        *format = RESULT_FORMAT_JSONL;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static void *checked_realloc(void *ptr, size_t size) {
+    void *result = realloc(ptr, size);
+    if (!result) {
+        LOG_FATAL("result_sink: Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+static void buffer_reserve(struct sink_buffer *buf, size_t extra) {
+    if (buf->len + extra <= buf->capacity) {
+        return;
+    }
+    size_t capacity = buf->capacity ? buf->capacity : RESULT_SINK_BUFFER_SIZE;
+    while (buf->len + extra > capacity) {
+        capacity *= 2;
+    }
+    buf->data = (char *)checked_realloc(buf->data, capacity);
+    buf->capacity = capacity;
+}
+
+static void buffer_append(struct sink_buffer *buf, const char *data, size_t len) {
+    buffer_reserve(buf, len);
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void buffer_append_str(struct sink_buffer *buf, const char *str) {
+    buffer_append(buf, str, strlen(str));
+}
+
+static void buffer_append_number(struct sink_buffer *buf, long long value) {
+    char digits[24];
+    int len = snprintf(digits, sizeof(digits), "%lld", value);
+    buffer_append(buf, digits, (size_t)len);
+}
+
+// Length of the UTF-8 sequence starting at 'p', 0 when it is not valid UTF-8
+// (overlong forms, surrogates and code points past U+10FFFF are not)
+static size_t utf8_sequence(const unsigned char *p) {
+    if (p[0] < 0x80) {
+        return 1;
+    }
+    size_t len;
+    unsigned char low = 0x80;
+    unsigned char high = 0xbf;
+    if (p[0] >= 0xc2 && p[0] <= 0xdf) {
+        len = 2;
+    } else if (p[0] >= 0xe0 && p[0] <= 0xef) {
+        len = 3;
+        low = p[0] == 0xe0 ? 0xa0 : 0x80;
+        high = p[0] == 0xed ? 0x9f : 0xbf;
+    } else if (p[0] >= 0xf0 && p[0] <= 0xf4) {
+        len = 4;
+        low = p[0] == 0xf0 ? 0x90 : 0x80;
+        high = p[0] == 0xf4 ? 0x8f : 0xbf;
+    } else {
+        return 0;
+    }
+    // The range of the second byte rules out the bad forms, the others are 80..bf
+    if (p[1] < low || p[1] > high) {
+        return 0;
+    }
+    for (size_t i = 2; i < len; i++) {
+        if (p[i] < 0x80 || p[i] > 0xbf) {
+            return 0;
+        }
+    }
+    return len;
+}
+
+static int utf8_valid(const char *str) {
+    for (const unsigned char *p = (const unsigned char *)str; *p;) {
+        size_t len = utf8_sequence(p);
+        if (!len) {
+            return 0;
+        }
+        p += len;
+    }
+    return 1;
+}
+
+// Append a JSON string literal. Control characters are escaped and bytes that
+// are not valid UTF-8 become U+FFFD, so every line is valid JSON whatever the
+// file names; anything else is copied as is.
+static void buffer_append_json_string(struct sink_buffer *buf, const char *str) {
+    static const char hex[] = "0123456789abcdef";
+    buffer_append(buf, "\"", 1);
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        char escaped[6];
+        switch (*p) {
+            case '"':
+                buffer_append(buf, "\\\"", 2);
+                break;
+            case '\\':
+                buffer_append(buf, "\\\\", 2);
+                break;
+            case '\n':
+                buffer_append(buf, "\\n", 2);
+                break;
+            case '\t':
+                buffer_append(buf, "\\t", 2);
+                break;
+            default:
+                if (*p < 0x20) {
+                    memcpy(escaped, "\\u00", 4);
+                    escaped[4] = hex[*p >> 4];
+                    escaped[5] = hex[*p & 0xf];
+                    buffer_append(buf, escaped, sizeof(escaped));
+                } else if (*p < 0x80) {
+                    buffer_append(buf, (const char *)p, 1);
+                } else {
+                    size_t len = utf8_sequence(p);
+                    if (len) {
+                        buffer_append(buf, (const char *)p, len);
+                        p += len - 1;
+                    } else {
+                        buffer_append(buf, "\\ufffd", 6);
+                    }
+                }
+        }
+    }
+    buffer_append(buf, "\"", 1);
+}
+
+// Append the bytes of 'str' in base64 as a JSON string literal
+static void buffer_append_base64(struct sink_buffer *buf, const char *str) {
+    static const char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const unsigned char *p = (const unsigned char *)str;
+    size_t len = strlen(str);
+    buffer_append(buf, "\"", 1);
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t group = (uint32_t)p[i] << 16;
+        if (i + 1 < len) {
+            group |= (uint32_t)p[i + 1] << 8;
+        }
+        if (i + 2 < len) {
+            group |= p[i + 2];
+        }
+        char quad[4] = {digits[group >> 18], digits[(group >> 12) & 0x3f],
+                        i + 1 < len ? digits[(group >> 6) & 0x3f] : '=',
+                        i + 2 < len ? digits[group & 0x3f] : '='};
+        buffer_append(buf, quad, sizeof(quad));
+    }
+    buffer_append(buf, "\"", 1);
+}
+
+static const char *verdict_name(enum plugin_verdict_state state) {
+    switch (state) {
+        case PLUGIN_VERDICT_MATCH:
+            return "match";
+        case PLUGIN_VERDICT_NO_MATCH:
+            return "no-match";
+        default:
+            return "skipped";
+    }
+}
+
+static void format_record(struct sink_buffer *buf, enum result_format format,
+                          const struct result_record *record) {
+    if (format == RESULT_FORMAT_PLAIN) {
+        buffer_append_str(buf, record->path);
+        buffer_append(buf, "\n", 1);
+        return;
+    }
+    if (format == RESULT_FORMAT_NULL) {
+        buffer_append(buf, record->path, strlen(record->path) + 1);
+        return;
+    }
+
+    buffer_append_str(buf, "{\"path\":");
+    buffer_append_json_string(buf, record->path);
+    // Names are bytes, those that are not UTF-8 are also given exactly
+    if (!utf8_valid(record->path)) {
+        buffer_append_str(buf, ",\"path_base64\":");
+        buffer_append_base64(buf, record->path);
+    }
+    buffer_append_str(buf, ",\"size\":");
+    buffer_append_number(buf, (long long)record->size);
+    buffer_append_str(buf, ",\"time_ns\":");
+    buffer_append_number(buf, record->elapsed_ns);
+    if (record->origin == RESULT_SAME_INODE) {
+        buffer_append_str(buf, ",\"duplicate\":\"inode\"");
+    } else if (record->origin == RESULT_SAME_CONTENT) {
+        buffer_append_str(buf, ",\"duplicate\":\"content\"");
+    }
+    buffer_append_str(buf, ",\"plugins\":[");
+    for (size_t i = 0; i < record->verdicts_len; i++) {
+        const struct plugin_verdict *verdict = &record->verdicts[i];
+        buffer_append_str(buf, i ? ",{\"name\":" : "{\"name\":");
+        buffer_append_json_string(buf, verdict->plugin);
+        buffer_append_str(buf, ",\"verdict\":\"");
+        buffer_append_str(buf, verdict_name(verdict->state));
+        buffer_append_str(buf, verdict->cached ? "\",\"cached\":true" : "\",\"cached\":false");
+        if (verdict->matches) {
+            buffer_append_str(buf, ",\"matches\":");
+            buffer_append_number(buf, (long long)verdict->matches->count);
+            buffer_append_str(buf, ",\"offsets\":[");
+            for (size_t j = 0; j < verdict->matches->len; j++) {
+                buffer_append_str(buf, j ? ",[" : "[");
+                buffer_append_number(buf, (long long)verdict->matches->list[j].offset);
+                buffer_append_str(buf, ",");
+                buffer_append_number(buf, (long long)verdict->matches->list[j].len);
+                if (verdict->matches->list[j].label) {
+                    buffer_append_str(buf, ",");
+                    buffer_append_json_string(buf, verdict->matches->list[j].label);
+                }
+                buffer_append_str(buf, "]");
+            }
+            buffer_append_str(buf, "]");
+        }
+        buffer_append_str(buf, "}");
+    }
+    buffer_append_str(buf, "]}\n");
+}
+
+// Write all of 'data' to the output. Called with the sink lock held.
+static void write_locked(struct result_sink *sink, const char *data, size_t len) {
+    while (len > 0 && !sink->failed) {
+        ssize_t written = write(sink->fd, data, len);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG_ERROR("result_sink: Cannot write results: %s", strerror(errno));
+            sink->failed = 1;
+            return;
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+}
+
+static void flush_buffer(struct result_sink *sink, struct sink_buffer *buf) {
+    if (buf->len == 0) {
+        return;
+    }
+    pthread_mutex_lock(&sink->lock);
+    write_locked(sink, buf->data, buf->len);
+    pthread_mutex_unlock(&sink->lock);
+    buf->len = 0;
+}
+
+struct result_sink *result_sink_open(int fd, enum result_format format, size_t workers, int sorted) {
+    struct result_sink *sink = (struct result_sink *)calloc(1, sizeof(struct result_sink));
+    if (!sink) {
+        return NULL;
+    }
+    sink->fd = fd;
+    sink->format = format;
+    sink->sorted = sorted;
+    sink->workers = workers;
+    sink->buffers = (struct sink_buffer *)calloc(workers, sizeof(struct sink_buffer));
+    sink->records = (struct sorted_records *)calloc(workers, sizeof(struct sorted_records));
+    if (!sink->buffers || !sink->records) {
+        free(sink->buffers);
+        free(sink->records);
+        free(sink);
+        return NULL;
+    }
+    pthread_mutex_init(&sink->lock, NULL);
+    return sink;
+}
+
+void result_sink_write(struct result_sink *sink, size_t worker, const struct result_record *record) {
+    struct sink_buffer *buf = &sink->buffers[worker];
+
+    if (!sink->sorted) {
+        format_record(buf, sink->format, record);
+        if (buf->len >= RESULT_SINK_BUFFER_SIZE) {
+            flush_buffer(sink, buf);
+        }
+        return;
+    }
+
+    // The worker buffer is only scratch space here, each record gets its own copy
+    size_t path_len = strlen(record->path);
+    buf->len = 0;
+    buffer_append(buf, record->path, path_len + 1);
+    format_record(buf, sink->format, record);
+
+    struct sorted_records *records = &sink->records[worker];
+    if (records->len == records->capacity) {
+        records->capacity = records->capacity ? records->capacity * 2 : 256;
+        records->items = (struct sorted_record *)checked_realloc(
+            records->items, records->capacity * sizeof(struct sorted_record));
+    }
+    struct sorted_record *item = &records->items[records->len++];
+    item->data = (char *)checked_realloc(NULL, buf->len);
+    memcpy(item->data, buf->data, buf->len);
+    item->path_len = path_len;
+    item->len = buf->len;
+    buf->len = 0;
+}
+
+static int compare_records(const void *a, const void *b) {
+    return strcmp(((const struct sorted_record *)a)->data, ((const struct sorted_record *)b)->data);
+}
+
+// Merge the per-worker lists, sort them by path and write them in large chunks
+static void write_sorted(struct result_sink *sink) {
+    size_t total = 0;
+    for (size_t i = 0; i < sink->workers; i++) {
+        total += sink->records[i].len;
+    }
+    if (total == 0) {
+        return;
+    }
+    struct sorted_record *all =
+        (struct sorted_record *)checked_realloc(NULL, total * sizeof(struct sorted_record));
+    size_t len = 0;
+    for (size_t i = 0; i < sink->workers; i++) {
+        memcpy(all + len, sink->records[i].items, sink->records[i].len * sizeof(struct sorted_record));
+        len += sink->records[i].len;
+        sink->records[i].len = 0;
+    }
+    qsort(all, total, sizeof(struct sorted_record), compare_records);
+
+    struct sink_buffer *buf = &sink->buffers[0];
+    for (size_t i = 0; i < total; i++) {
+        buffer_append(buf, all[i].data + all[i].path_len + 1, all[i].len - all[i].path_len - 1);
+        if (buf->len >= RESULT_SINK_BUFFER_SIZE) {
+            flush_buffer(sink, buf);
+        }
+        free(all[i].data);
+    }
+    flush_buffer(sink, buf);
+    free(all);
+}
+
+void result_sink_flush(struct result_sink *sink) {
+    if (sink->sorted) {
+        write_sorted(sink);
+        return;
+    }
+    for (size_t i = 0; i < sink->workers; i++) {
+        flush_buffer(sink, &sink->buffers[i]);
+    }
+}
+
+void result_sink_close(struct result_sink *sink) {
+    if (!sink) {
+        return;
+    }
+    result_sink_flush(sink);
+    for (size_t i = 0; i < sink->workers; i++) {
+        free(sink->buffers[i].data);
+        free(sink->records[i].items);
+    }
+    free(sink->buffers);
+    free(sink->records);
+    pthread_mutex_destroy(&sink->lock);
+    free(sink);
+}
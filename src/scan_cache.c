@@ -0,0 +1,327 @@
+#include "scan_cache.h"
+#include "logger.h"
+#include "scan_dir.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC "LAB2VC01"
+#define CACHE_VERSION 1
+#define CACHE_INITIAL_CAPACITY 4096
+// Slots not touched by this many scans are dropped on rebuild
+#define CACHE_MAX_AGE 8
+
+struct cache_header {
+    char magic[8];
+    uint32_t version;
+    /* Set while a process has the table open, a crash leaves it set */
+    uint32_t dirty;
+    uint64_t capacity;
+    uint64_t count;
+    uint32_t generation;
+    uint32_t reserved[7];
+};
+
+struct cache_slot {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t plugin_key;
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint32_t generation;
+    uint8_t used;
+    uint8_t verdict;
+    uint8_t reserved[2];
+};
+
+struct scan_cache {
+    pthread_mutex_t lock;
+    char *path;
+    int fd;
+    size_t map_size;
+    struct cache_header *header;
+    struct cache_slot *slots;
+};
+
+static size_t table_size(uint64_t capacity) {
+    return sizeof(struct cache_header) + capacity * sizeof(struct cache_slot);
+}
+
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static uint64_t slot_hash(uint64_t dev, uint64_t ino, uint64_t plugin_key) {
+    return mix64(dev * 0x9e3779b97f4a7c15ULL ^ mix64(ino) ^ plugin_key);
+}
+
+// Slot holding the key, or the empty slot where it would go
+static struct cache_slot *find_slot(struct cache_slot *slots, uint64_t capacity, uint64_t dev,
+                                    uint64_t ino, uint64_t plugin_key) {
+    uint64_t mask = capacity - 1;
+    for (uint64_t i = slot_hash(dev, ino, plugin_key) & mask;; i = (i + 1) & mask) {
+        struct cache_slot *slot = &slots[i];
+        if (!slot->used ||
+            (slot->dev == dev && slot->ino == ino && slot->plugin_key == plugin_key)) {
+            return slot;
+        }
+    }
+}
+
+static int map_table(int fd, size_t size, struct cache_header **header) {
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    *header = (struct cache_header *)map;
+    return 0;
+}
+
+// Create an empty table in 'fd', the file is truncated first
+static int create_table(int fd, uint64_t capacity, uint32_t generation, struct cache_header **header) {
+    size_t size = table_size(capacity);
+    if (ftruncate(fd, 0) == -1 || ftruncate(fd, (off_t)size) == -1 || map_table(fd, size, header) == -1) {
+        return -1;
+    }
+    memcpy((*header)->magic, CACHE_MAGIC, sizeof((*header)->magic));
+    (*header)->version = CACHE_VERSION;
+    (*header)->dirty = 1;
+    (*header)->capacity = capacity;
+    (*header)->count = 0;
+    (*header)->generation = generation;
+    return 0;
+}
+
+static int valid_table(const struct cache_header *header, size_t file_size) {
+    return memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) == 0 &&
+           header->version == CACHE_VERSION && !header->dirty && header->capacity != 0 &&
+           (header->capacity & (header->capacity - 1)) == 0 &&
+           table_size(header->capacity) == file_size;
+}
+
+struct scan_cache *scan_cache_open(const char *path) {
+    LOG_DEBUG("scan_cache_open: Opening cache %s", path);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        LOG_WARN("scan_cache_open: Cannot open cache %s, scanning without it", path);
+        return NULL;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+        LOG_WARN("scan_cache_open: Cache %s is used by another process, scanning without it", path);
+        close(fd);
+        return NULL;
+    }
+
+    struct scan_cache *cache = (struct scan_cache *)calloc(1, sizeof(struct scan_cache));
+    struct stat st;
+    if (!cache || fstat(fd, &st) == -1) {
+        free(cache);
+        close(fd);
+        return NULL;
+    }
+    cache->fd = fd;
+    cache->path = strdup(path);
+
+    struct cache_header *header = NULL;
+    if ((size_t)st.st_size >= sizeof(struct cache_header) &&
+        map_table(fd, (size_t)st.st_size, &header) == 0) {
+        if (valid_table(header, (size_t)st.st_size)) {
+            cache->map_size = (size_t)st.st_size;
+        } else {
+            LOG_WARN("scan_cache_open: Cache %s is stale or damaged, starting over", path);
+            munmap(header, (size_t)st.st_size);
+            header = NULL;
+        }
+    }
+    if (!header) {
+        if (!cache->path || create_table(fd, CACHE_INITIAL_CAPACITY, 0, &header) == -1) {
+            LOG_WARN("scan_cache_open: Cannot create cache %s, scanning without it", path);
+            free(cache->path);
+            free(cache);
+            close(fd);
+            return NULL;
+        }
+        cache->map_size = table_size(CACHE_INITIAL_CAPACITY);
+    }
+
+    header->generation++;
+    header->dirty = 1;
+    cache->header = header;
+    cache->slots = (struct cache_slot *)(header + 1);
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+void scan_cache_close(struct scan_cache *cache) {
+    if (!cache) {
+        return;
+    }
+    cache->header->dirty = 0;
+    msync(cache->header, cache->map_size, MS_SYNC);
+    munmap(cache->header, cache->map_size);
+    close(cache->fd);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->path);
+    free(cache);
+}
+
+// Copy recently used slots into a fresh file and swap it in. Called with the lock held.
+static int rebuild_table(struct scan_cache *cache) {
+    struct cache_header *old = cache->header;
+    uint32_t generation = old->generation;
+    uint64_t live = 0;
+    for (uint64_t i = 0; i < old->capacity; i++) {
+        if (cache->slots[i].used && generation - cache->slots[i].generation < CACHE_MAX_AGE) {
+            live++;
+        }
+    }
+    // Leave the new table at most half full
+    uint64_t capacity = CACHE_INITIAL_CAPACITY;
+    while ((live + 1) * 2 > capacity) {
+        capacity *= 2;
+    }
+
+    size_t path_len = strlen(cache->path);
+    char *tmp_path = (char *)malloc(path_len + sizeof(".tmp"));
+    if (!tmp_path) {
+        return -1;
+    }
+    memcpy(tmp_path, cache->path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", sizeof(".tmp"));
+
+    struct cache_header *header = NULL;
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || flock(fd, LOCK_EX | LOCK_NB) == -1 ||
+        create_table(fd, capacity, generation, &header) == -1) {
+        LOG_WARN("rebuild_table: Cannot grow cache %s", cache->path);
+        if (fd != -1) {
+            close(fd);
+            unlink(tmp_path);
+        }
+        free(tmp_path);
+        return -1;
+    }
+
+    struct cache_slot *slots = (struct cache_slot *)(header + 1);
+    for (uint64_t i = 0; i < old->capacity; i++) {
+        const struct cache_slot *slot = &cache->slots[i];
+        if (slot->used && generation - slot->generation < CACHE_MAX_AGE) {
+            *find_slot(slots, capacity, slot->dev, slot->ino, slot->plugin_key) = *slot;
+        }
+    }
+    header->count = live;
+
+    if (rename(tmp_path, cache->path) == -1) {
+        LOG_WARN("rebuild_table: Cannot replace cache %s", cache->path);
+        munmap(header, table_size(capacity));
+        close(fd);
+        unlink(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+    free(tmp_path);
+
+    munmap(old, cache->map_size);
+    close(cache->fd);
+    cache->fd = fd;
+    cache->map_size = table_size(capacity);
+    cache->header = header;
+    cache->slots = slots;
+    return 0;
+}
+
+static uint64_t fnv_feed(uint64_t hash, const char *str, char terminator) {
+    for (const char *p = str; p && *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 0x100000001b3ULL;
+    }
+    return (hash ^ (unsigned char)terminator) * 0x100000001b3ULL;
+}
+
+static uint64_t fnv_feed_u64(uint64_t hash, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        hash = (hash ^ (value & 0xff)) * 0x100000001b3ULL;
+        value >>= 8;
+    }
+    return hash;
+}
+
+uint64_t scan_cache_plugin_key(const char *name, uint64_t file_size, long long file_mtime_ns,
+                               const struct option *opts, size_t opts_len) {
+    // FNV-1a over "name\0" SIZE MTIME, then "opt=arg\0" per option followed by
+    // DEV INO SIZE MTIME when the argument is a regular file
+    uint64_t hash = fnv_feed(0xcbf29ce484222325ULL, name, '\0');
+    hash = fnv_feed_u64(hash, file_size);
+    hash = fnv_feed_u64(hash, (uint64_t)file_mtime_ns);
+    for (size_t i = 0; i < opts_len; i++) {
+        const char *arg = (const char *)opts[i].flag;
+        hash = fnv_feed(hash, opts[i].name, '=');
+        hash = fnv_feed(hash, arg, '\0');
+        struct stat st;
+        if (arg && stat(arg, &st) == 0 && S_ISREG(st.st_mode)) {
+            hash = fnv_feed_u64(hash, (uint64_t)st.st_dev);
+            hash = fnv_feed_u64(hash, (uint64_t)st.st_ino);
+            hash = fnv_feed_u64(hash, (uint64_t)st.st_size);
+            hash = fnv_feed_u64(hash, (uint64_t)st.st_mtim.tv_sec * 1000000000ULL +
+                                          (uint64_t)st.st_mtim.tv_nsec);
+        }
+    }
+    return hash;
+}
+
+static int slot_matches(const struct cache_slot *slot, const struct scan_entry *entry) {
+    return slot->size == (uint64_t)entry->size && slot->mtime_ns == entry->mtime_ns &&
+           slot->ctime_ns == entry->ctime_ns;
+}
+
+int scan_cache_lookup(struct scan_cache *cache, const struct scan_entry *entry, uint64_t plugin_key) {
+    int verdict = -1;
+    pthread_mutex_lock(&cache->lock);
+    struct cache_slot *slot = find_slot(cache->slots, cache->header->capacity, (uint64_t)entry->dev,
+                                        (uint64_t)entry->ino, plugin_key);
+    if (slot->used && slot_matches(slot, entry)) {
+        slot->generation = cache->header->generation;
+        verdict = slot->verdict;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return verdict;
+}
+
+void scan_cache_store(struct scan_cache *cache, const struct scan_entry *entry, uint64_t plugin_key,
+                      int verdict) {
+    pthread_mutex_lock(&cache->lock);
+    struct cache_slot *slot = find_slot(cache->slots, cache->header->capacity, (uint64_t)entry->dev,
+                                        (uint64_t)entry->ino, plugin_key);
+    if (!slot->used) {
+        if ((cache->header->count + 1) * 10 > cache->header->capacity * 7) {
+            if (rebuild_table(cache) == -1) {
+                pthread_mutex_unlock(&cache->lock);
+                return;
+            }
+            slot = find_slot(cache->slots, cache->header->capacity, (uint64_t)entry->dev,
+                             (uint64_t)entry->ino, plugin_key);
+        }
+        cache->header->count++;
+    }
+    slot->dev = (uint64_t)entry->dev;
+    slot->ino = (uint64_t)entry->ino;
+    slot->plugin_key = plugin_key;
+    slot->size = (uint64_t)entry->size;
+    slot->mtime_ns = entry->mtime_ns;
+    slot->ctime_ns = entry->ctime_ns;
+    slot->generation = cache->header->generation;
+    slot->used = 1;
+    slot->verdict = verdict ? 1 : 0;
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,499 @@
+#include "scan_dedup.h"
+#include "logger.h"
+#include "plugin_api.h"
+#include "scan_dir.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DEDUP_INITIAL_CAPACITY 1024
+#define DEDUP_BLOCK_SIZE (64 * 1024)
+// Chunk size used when a file has to be read for hashing
+#define DEDUP_READ_SIZE (64 * 1024)
+
+// Verdict shared by all copies of a file
+struct dedup_record {
+    int result;
+    /* Matches of every plugin (--matches), NULL without them */
+    struct plugin_matches *matches;
+    unsigned char states[];
+};
+
+// Last evaluation of an inode, only trusted while the stat data is unchanged
+struct inode_entry {
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    struct dedup_record *record;
+};
+
+// First file seen with a given size, hashed once a second one turns up
+struct size_entry {
+    const char *path;
+    uint64_t dev;
+    uint64_t ino;
+    /* Set while a worker is hashing the file */
+    int hashing;
+    int hashed;
+    uint64_t hash[2];
+};
+
+// Open addressing table keyed by three words, an empty slot has no value
+struct dedup_slot {
+    uint64_t key[3];
+    void *value;
+};
+
+struct dedup_table {
+    struct dedup_slot *slots;
+    size_t capacity;
+    size_t count;
+};
+
+struct dedup_block {
+    struct dedup_block *next;
+    size_t used;
+    size_t size;
+    unsigned char data[];
+};
+
+struct scan_dedup {
+    pthread_mutex_t lock;
+    size_t plugins_len;
+    int by_content;
+    /* (dev, ino) -> struct inode_entry */
+    struct dedup_table inodes;
+    /* size -> struct size_entry */
+    struct dedup_table sizes;
+    /* (size, hash) -> struct dedup_record */
+    struct dedup_table contents;
+    /* Everything above is allocated from these blocks and freed at once */
+    struct dedup_block *blocks;
+};
+
+// Streaming MurmurHash3 x64 128
+struct hash_state {
+    uint64_t h1;
+    uint64_t h2;
+    uint64_t len;
+    unsigned char tail[16];
+    size_t tail_len;
+};
+
+#define HASH_C1 0x87c37b91114253d5ULL
+#define HASH_C2 0x4cf5ad432745937fULL
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static void hash_block(struct hash_state *state, const unsigned char *block) {
+    uint64_t k1, k2;
+    memcpy(&k1, block, sizeof(k1));
+    memcpy(&k2, block + 8, sizeof(k2));
+
+    k1 *= HASH_C1;
+    k1 = rotl64(k1, 31);
+    k1 *= HASH_C2;
+    state->h1 ^= k1;
+    state->h1 = rotl64(state->h1, 27);
+    state->h1 += state->h2;
+    state->h1 = state->h1 * 5 + 0x52dce729;
+
+    k2 *= HASH_C2;
+    k2 = rotl64(k2, 33);
+    k2 *= HASH_C1;
+    state->h2 ^= k2;
+    state->h2 = rotl64(state->h2, 31);
+    state->h2 += state->h1;
+    state->h2 = state->h2 * 5 + 0x38495ab5;
+}
+
+static void hash_update(struct hash_state *state, const unsigned char *data, size_t len) {
+    state->len += len;
+    if (state->tail_len > 0) {
+        size_t take = 16 - state->tail_len < len ? 16 - state->tail_len : len;
+        memcpy(state->tail + state->tail_len, data, take);
+        state->tail_len += take;
+        data += take;
+        len -= take;
+        if (state->tail_len < 16) {
+            return;
+        }
+        hash_block(state, state->tail);
+        state->tail_len = 0;
+    }
+    for (; len >= 16; data += 16, len -= 16) {
+        hash_block(state, data);
+    }
+    memcpy(state->tail, data, len);
+    state->tail_len = len;
+}
+
+static void hash_final(struct hash_state *state, uint64_t hash[2]) {
+    uint64_t k1 = 0, k2 = 0;
+    for (size_t i = state->tail_len; i-- > 8;) {
+        k2 ^= (uint64_t)state->tail[i] << ((i - 8) * 8);
+    }
+    for (size_t i = state->tail_len < 8 ? state->tail_len : 8; i-- > 0;) {
+        k1 ^= (uint64_t)state->tail[i] << (i * 8);
+    }
+    if (state->tail_len > 8) {
+        k2 *= HASH_C2;
+        k2 = rotl64(k2, 33);
+        k2 *= HASH_C1;
+        state->h2 ^= k2;
+    }
+    if (state->tail_len > 0) {
+        k1 *= HASH_C1;
+        k1 = rotl64(k1, 31);
+        k1 *= HASH_C2;
+        state->h1 ^= k1;
+    }
+
+    state->h1 ^= state->len;
+    state->h2 ^= state->len;
+    state->h1 += state->h2;
+    state->h2 += state->h1;
+    state->h1 = fmix64(state->h1);
+    state->h2 = fmix64(state->h2);
+    state->h1 += state->h2;
+    state->h2 += state->h1;
+    hash[0] = state->h1;
+    hash[1] = state->h2;
+}
+
+// Hash a file through its name relative to 'dirfd', 'st' receives the stat data
+// of the hashed file
+static int hash_file(int dirfd, const char *name, uint64_t hash[2], struct stat *st) {
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, st) == -1) {
+        close(fd);
+        return -1;
+    }
+    struct hash_state state = {0};
+    unsigned char buf[DEDUP_READ_SIZE];
+    ssize_t len;
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        hash_update(&state, buf, (size_t)len);
+    }
+    close(fd);
+    if (len == -1 || state.len != (uint64_t)st->st_size) {
+        return -1;
+    }
+    hash_final(&state, hash);
+    return 0;
+}
+
+static void *dedup_alloc(struct scan_dedup *dedup, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    struct dedup_block *block = dedup->blocks;
+    if (!block || block->size - block->used < size) {
+        size_t block_size = size > DEDUP_BLOCK_SIZE ? size : DEDUP_BLOCK_SIZE;
+        block = (struct dedup_block *)malloc(sizeof(struct dedup_block) + block_size);
+        if (!block) {
+            LOG_FATAL("dedup_alloc: Out of memory");
+            exit(EXIT_FAILURE);
+        }
+        block->next = dedup->blocks;
+        block->used = 0;
+        block->size = block_size;
+        dedup->blocks = block;
+    }
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// Slot holding the key, or the empty slot where it would go
+static struct dedup_slot *table_slot(struct dedup_slot *slots, size_t capacity, uint64_t a, uint64_t b,
+                                     uint64_t c) {
+    size_t mask = capacity - 1;
+    for (size_t i = mix64(a * 0x9e3779b97f4a7c15ULL ^ mix64(b) ^ c) & mask;; i = (i + 1) & mask) {
+        struct dedup_slot *slot = &slots[i];
+        if (!slot->value || (slot->key[0] == a && slot->key[1] == b && slot->key[2] == c)) {
+            return slot;
+        }
+    }
+}
+
+static void *table_get(const struct dedup_table *table, uint64_t a, uint64_t b, uint64_t c) {
+    if (!table->slots) {
+        return NULL;
+    }
+    return table_slot(table->slots, table->capacity, a, b, c)->value;
+}
+
+static void table_put(struct dedup_table *table, uint64_t a, uint64_t b, uint64_t c, void *value) {
+    // Keep the table at most half full
+    if ((table->count + 1) * 2 > table->capacity) {
+        size_t capacity = table->capacity ? table->capacity * 2 : DEDUP_INITIAL_CAPACITY;
+        struct dedup_slot *slots = (struct dedup_slot *)calloc(capacity, sizeof(struct dedup_slot));
+        if (!slots) {
+            LOG_FATAL("table_put: Out of memory");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < table->capacity; i++) {
+            const struct dedup_slot *slot = &table->slots[i];
+            if (slot->value) {
+                *table_slot(slots, capacity, slot->key[0], slot->key[1], slot->key[2]) = *slot;
+            }
+        }
+        free(table->slots);
+        table->slots = slots;
+        table->capacity = capacity;
+    }
+    struct dedup_slot *slot = table_slot(table->slots, table->capacity, a, b, c);
+    if (!slot->value) {
+        slot->key[0] = a;
+        slot->key[1] = b;
+        slot->key[2] = c;
+        table->count++;
+    }
+    slot->value = value;
+}
+
+struct scan_dedup *scan_dedup_open(size_t plugins_len, int by_content) {
+    struct scan_dedup *dedup = (struct scan_dedup *)calloc(1, sizeof(struct scan_dedup));
+    if (!dedup) {
+        return NULL;
+    }
+    pthread_mutex_init(&dedup->lock, NULL);
+    dedup->plugins_len = plugins_len;
+    dedup->by_content = by_content;
+    return dedup;
+}
+
+void scan_dedup_close(struct scan_dedup *dedup) {
+    if (!dedup) {
+        return;
+    }
+    free(dedup->inodes.slots);
+    free(dedup->sizes.slots);
+    free(dedup->contents.slots);
+    while (dedup->blocks) {
+        struct dedup_block *next = dedup->blocks->next;
+        free(dedup->blocks);
+        dedup->blocks = next;
+    }
+    pthread_mutex_destroy(&dedup->lock);
+    free(dedup);
+}
+
+// Record of the inode if its stat data still matches. Called with the lock held.
+static struct dedup_record *inode_record(struct scan_dedup *dedup, uint64_t dev, uint64_t ino,
+                                         uint64_t size, int64_t mtime_ns, int64_t ctime_ns) {
+    struct inode_entry *entry = (struct inode_entry *)table_get(&dedup->inodes, dev, ino, 0);
+    if (!entry || entry->size != size || entry->mtime_ns != mtime_ns || entry->ctime_ns != ctime_ns) {
+        return NULL;
+    }
+    return entry->record;
+}
+
+static int reuse_record(struct scan_dedup *dedup, const struct dedup_record *record,
+                        unsigned char *states, struct plugin_matches *matches) {
+    memcpy(states, record->states, dedup->plugins_len);
+    for (size_t i = 0; matches && i < dedup->plugins_len; i++) {
+        matches[i].count = 0;
+        matches[i].len = 0;
+        if (record->matches) {
+            const struct plugin_matches *copy = &record->matches[i];
+            matches[i].count = copy->count;
+            matches[i].len = copy->len < matches[i].capacity ? copy->len : matches[i].capacity;
+            memcpy(matches[i].list, copy->list, matches[i].len * sizeof(struct plugin_match));
+        }
+    }
+    return record->result;
+}
+
+// Point the inode at 'record'. Called with the lock held.
+static void set_inode_record(struct scan_dedup *dedup, const struct scan_dedup_key *key,
+                             struct dedup_record *record) {
+    struct inode_entry *entry = (struct inode_entry *)table_get(&dedup->inodes, key->dev, key->ino, 0);
+    if (!entry) {
+        entry = (struct inode_entry *)dedup_alloc(dedup, sizeof(struct inode_entry));
+        table_put(&dedup->inodes, key->dev, key->ino, 0, entry);
+    }
+    entry->size = key->size;
+    entry->mtime_ns = key->mtime_ns;
+    entry->ctime_ns = key->ctime_ns;
+    entry->record = record;
+}
+
+// Hash the first file of a size so later copies can find its verdict
+static void hash_first_file(struct scan_dedup *dedup, struct size_entry *first) {
+    struct stat st;
+    uint64_t hash[2];
+    int status = hash_file(AT_FDCWD, first->path, hash, &st);
+
+    pthread_mutex_lock(&dedup->lock);
+    first->hashing = 0;
+    if (status == 0 && (uint64_t)st.st_dev == first->dev && (uint64_t)st.st_ino == first->ino) {
+        first->hashed = 1;
+        first->hash[0] = hash[0];
+        first->hash[1] = hash[1];
+        // The verdict may also arrive later, see scan_dedup_store
+        struct dedup_record *record =
+            inode_record(dedup, first->dev, first->ino, (uint64_t)st.st_size,
+                         st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec,
+                         st.st_ctim.tv_sec * 1000000000LL + st.st_ctim.tv_nsec);
+        if (record && !table_get(&dedup->contents, (uint64_t)st.st_size, hash[0], hash[1])) {
+            table_put(&dedup->contents, (uint64_t)st.st_size, hash[0], hash[1], record);
+        }
+    }
+    pthread_mutex_unlock(&dedup->lock);
+}
+
+int scan_dedup_find(struct scan_dedup *dedup, const struct scan_dir *dir,
+                    const struct scan_entry *entry, struct scan_path *path,
+                    const unsigned char *data, struct scan_dedup_key *key, unsigned char *states,
+                    struct plugin_matches *matches, enum scan_dedup_kind *kind) {
+    key->dev = (uint64_t)entry->dev;
+    key->ino = (uint64_t)entry->ino;
+    key->size = (uint64_t)entry->size;
+    key->mtime_ns = entry->mtime_ns;
+    key->ctime_ns = entry->ctime_ns;
+    // Without content mode only files with several links can be met twice
+    key->by_inode = dedup->by_content || entry->nlink > 1;
+    key->hashed = 0;
+    *kind = SCAN_DEDUP_NONE;
+    if (!key->by_inode) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&dedup->lock);
+    struct dedup_record *record =
+        inode_record(dedup, key->dev, key->ino, key->size, key->mtime_ns, key->ctime_ns);
+    if (record) {
+        int result = reuse_record(dedup, record, states, matches);
+        pthread_mutex_unlock(&dedup->lock);
+        *kind = SCAN_DEDUP_INODE;
+        return result;
+    }
+    if (!dedup->by_content) {
+        pthread_mutex_unlock(&dedup->lock);
+        return -1;
+    }
+
+    struct size_entry *first = (struct size_entry *)table_get(&dedup->sizes, key->size, 0, 0);
+    if (!first) {
+        // Hashed later, maybe once its directory is gone, so it is kept by path
+        const char *full_path = scan_path_build(path, dir, entry);
+        size_t path_len = strlen(full_path);
+        first = (struct size_entry *)dedup_alloc(dedup, sizeof(struct size_entry));
+        char *path_copy = (char *)dedup_alloc(dedup, path_len + 1);
+        memcpy(path_copy, full_path, path_len + 1);
+        first->path = path_copy;
+        first->dev = key->dev;
+        first->ino = key->ino;
+        first->hashing = 0;
+        first->hashed = 0;
+        table_put(&dedup->sizes, key->size, 0, 0, first);
+        pthread_mutex_unlock(&dedup->lock);
+        return -1;
+    }
+    int hash_first = !first->hashed && !first->hashing && first->ino != key->ino;
+    if (hash_first) {
+        first->hashing = 1;
+    }
+    pthread_mutex_unlock(&dedup->lock);
+
+    // A second file of this size, compare contents
+    if (hash_first) {
+        hash_first_file(dedup, first);
+    }
+    if (data) {
+        struct hash_state state = {0};
+        hash_update(&state, data, (size_t)entry->size);
+        hash_final(&state, key->hash);
+    } else {
+        struct stat st;
+        if (hash_file(dir->fd, entry->name, key->hash, &st) == -1 ||
+            (uint64_t)st.st_size != key->size) {
+            return -1;
+        }
+    }
+    key->hashed = 1;
+
+    pthread_mutex_lock(&dedup->lock);
+    record = (struct dedup_record *)table_get(&dedup->contents, key->size, key->hash[0], key->hash[1]);
+    int result = -1;
+    if (record) {
+        // Other links to this inode need no hashing
+        set_inode_record(dedup, key, record);
+        result = reuse_record(dedup, record, states, matches);
+        *kind = SCAN_DEDUP_CONTENT;
+    }
+    pthread_mutex_unlock(&dedup->lock);
+    return result;
+}
+
+void scan_dedup_store(struct scan_dedup *dedup, const struct scan_dedup_key *key, int result,
+                      const unsigned char *states, const struct plugin_matches *matches) {
+    if (!key->by_inode && !key->hashed) {
+        return;
+    }
+
+    pthread_mutex_lock(&dedup->lock);
+    struct dedup_record *record =
+        (struct dedup_record *)dedup_alloc(dedup, sizeof(struct dedup_record) + dedup->plugins_len);
+    record->result = result;
+    memcpy(record->states, states, dedup->plugins_len);
+    record->matches = NULL;
+    if (matches) {
+        record->matches = (struct plugin_matches *)dedup_alloc(
+            dedup, dedup->plugins_len * sizeof(struct plugin_matches));
+        for (size_t i = 0; i < dedup->plugins_len; i++) {
+            struct plugin_matches *copy = &record->matches[i];
+            *copy = matches[i];
+            copy->capacity = matches[i].len;
+            copy->list = (struct plugin_match *)dedup_alloc(
+                dedup, matches[i].len * sizeof(struct plugin_match));
+            memcpy(copy->list, matches[i].list, matches[i].len * sizeof(struct plugin_match));
+        }
+    }
+
+    if (key->by_inode) {
+        set_inode_record(dedup, key, record);
+    }
+
+    uint64_t hash[2] = {key->hash[0], key->hash[1]};
+    int hashed = key->hashed;
+    if (!hashed && dedup->by_content) {
+        // The first file of its size may have been hashed while it was evaluated
+        struct size_entry *first = (struct size_entry *)table_get(&dedup->sizes, key->size, 0, 0);
+        if (first && first->hashed && first->dev == key->dev && first->ino == key->ino) {
+            hash[0] = first->hash[0];
+            hash[1] = first->hash[1];
+            hashed = 1;
+        }
+    }
+    if (hashed && !table_get(&dedup->contents, key->size, hash[0], hash[1])) {
+        table_put(&dedup->contents, key->size, hash[0], hash[1], record);
+    }
+    pthread_mutex_unlock(&dedup->lock);
+}
@@ -0,0 +1,363 @@
+#include "scan_dir.h"
+#include "logger.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif /* defined(__linux__) */
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+struct scan_arena_block {
+    struct scan_arena_block *next;
+    size_t used;
+    size_t capacity;
+    alignas(max_align_t) unsigned char data[];
+};
+
+static void *arena_alloc(struct scan_arena *arena, size_t size) {
+    size = (size + alignof(struct scan_entry) - 1) & ~(alignof(struct scan_entry) - 1);
+    struct scan_arena_block *block = arena->head;
+    if (!block || block->capacity - block->used < size) {
+        size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = (struct scan_arena_block *)malloc(sizeof(struct scan_arena_block) + capacity);
+        if (!block) {
+            LOG_FATAL("arena_alloc: Out of memory");
+            exit(EXIT_FAILURE);
+        }
+        block->next = arena->head;
+        block->used = 0;
+        block->capacity = capacity;
+        arena->head = block;
+    }
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+static void arena_free(struct scan_arena *arena) {
+    while (arena->head) {
+        struct scan_arena_block *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+}
+
+static struct scan_dir *dir_new(struct scan_dir *parent, const char *name, size_t name_len, int fd) {
+    struct scan_dir *dir = (struct scan_dir *)malloc(sizeof(struct scan_dir));
+    if (!dir) {
+        LOG_FATAL("dir_new: Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    dir->parent = parent;
+    dir->name = name;
+    dir->name_len = name_len;
+    dir->depth = parent ? parent->depth + 1 : 0;
+    dir->fd = fd;
+    atomic_init(&dir->refs, 1);
+    dir->arena.head = NULL;
+    return dir;
+}
+
+struct scan_dir *scan_dir_open_root(const char *path) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    char *name = strdup(path);
+    if (!name) {
+        close(fd);
+        return NULL;
+    }
+    // "/" becomes an empty name so children are built as "/name"
+    size_t name_len = strlen(name);
+    while (name_len > 0 && name[name_len - 1] == '/') {
+        name_len--;
+    }
+    return dir_new(NULL, name, name_len, fd);
+}
+
+struct scan_dir *scan_dir_open_list(void) {
+    // Entries are opened by their own (absolute or relative) path
+    return dir_new(NULL, NULL, 0, AT_FDCWD);
+}
+
+struct scan_dir *scan_dir_open_child(struct scan_dir *parent, const struct scan_entry *entry) {
+    int fd = openat(parent->fd, entry->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    scan_dir_retain(parent);
+    return dir_new(parent, entry->name, entry->name_len, fd);
+}
+
+void scan_dir_retain(struct scan_dir *dir) {
+    atomic_fetch_add(&dir->refs, 1);
+}
+
+void scan_dir_release(struct scan_dir *dir) {
+    while (dir && atomic_fetch_sub(&dir->refs, 1) == 1) {
+        struct scan_dir *parent = dir->parent;
+        if (dir->fd >= 0) {
+            close(dir->fd);
+        }
+        arena_free(&dir->arena);
+        if (!parent) {
+            free((char *)dir->name);
+        }
+        free(dir);
+        dir = parent;
+    }
+}
+
+// Check one directory entry and pass it on if it is a non-empty regular file or a directory.
+// Return 1 for a directory, 0 otherwise.
+static int add_entry(struct scan_dir *dir, const char *name, unsigned char type, ino_t ino,
+                     scan_entry_handler handler, void *arg) {
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        return 0;
+    }
+
+    struct stat file_stat;
+    file_stat.st_size = 1;
+    if (type == DT_REG || type == DT_UNKNOWN) {
+        // Only regular files (and file systems without d_type) need a stat
+        if (fstatat(dir->fd, name, &file_stat, AT_SYMLINK_NOFOLLOW) == -1) {
+            return 0;
+        }
+        if (S_ISREG(file_stat.st_mode)) {
+            type = DT_REG;
+        } else if (S_ISDIR(file_stat.st_mode)) {
+            type = DT_DIR;
+        } else {
+            return 0;
+        }
+    }
+    if ((type != DT_REG && type != DT_DIR) || file_stat.st_size == 0) {
+        return 0;
+    }
+
+    size_t name_len = strlen(name);
+    struct scan_entry *entry =
+        (struct scan_entry *)arena_alloc(&dir->arena, sizeof(struct scan_entry) + name_len + 1);
+    if (type == DT_REG) {
+        entry->dev = file_stat.st_dev;
+        entry->ino = file_stat.st_ino;
+        entry->size = file_stat.st_size;
+        entry->nlink = file_stat.st_nlink;
+        entry->uid = file_stat.st_uid;
+        entry->gid = file_stat.st_gid;
+        entry->mode = file_stat.st_mode;
+        entry->mtime_ns = file_stat.st_mtim.tv_sec * 1000000000LL + file_stat.st_mtim.tv_nsec;
+        entry->ctime_ns = file_stat.st_ctim.tv_sec * 1000000000LL + file_stat.st_ctim.tv_nsec;
+    } else {
+        memset(entry, 0, sizeof(struct scan_entry));
+        entry->ino = ino;
+    }
+    entry->type = type;
+    entry->name_len = name_len;
+    memcpy(entry->name, name, name_len + 1);
+    handler(dir, entry, arg);
+    return type == DT_DIR;
+}
+
+#ifdef SYS_getdents64
+
+// Record layout returned by getdents64(2)
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static int compare_inodes(const void *a, const void *b) {
+    const struct linux_dirent64 *lhs = *(const struct linux_dirent64 *const *)a;
+    const struct linux_dirent64 *rhs = *(const struct linux_dirent64 *const *)b;
+    return (lhs->d_ino > rhs->d_ino) - (lhs->d_ino < rhs->d_ino);
+}
+
+static void dirents_reserve(struct scan_dirents *buf) {
+    if (!buf->data) {
+        buf->data = (unsigned char *)malloc(SCAN_DIRENTS_SIZE);
+        // Every record takes at least 20 bytes (header plus name and terminator)
+        buf->records_capacity = SCAN_DIRENTS_SIZE / 20;
+        buf->records = (void **)malloc(buf->records_capacity * sizeof(void *));
+        if (!buf->data || !buf->records) {
+            LOG_FATAL("dirents_reserve: Out of memory");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+int scan_dir_read(struct scan_dir *dir, struct scan_dirents *buf, scan_entry_handler handler,
+                  void *arg) {
+    dirents_reserve(buf);
+
+    size_t subdirs = 0;
+    for (int first = 1;; first = 0) {
+        long len = syscall(SYS_getdents64, dir->fd, buf->data, SCAN_DIRENTS_SIZE);
+        if (len <= 0) {
+            if (len == -1 && first) {
+                return -1;
+            }
+            break;
+        }
+
+        // Stat and open the batch in inode order instead of hash order
+        size_t records_len = 0;
+        for (long offset = 0; offset < len && records_len < buf->records_capacity;) {
+            struct linux_dirent64 *record = (struct linux_dirent64 *)(buf->data + offset);
+            buf->records[records_len++] = record;
+            offset += record->d_reclen;
+        }
+        qsort(buf->records, records_len, sizeof(void *), compare_inodes);
+
+        for (size_t i = 0; i < records_len; i++) {
+            const struct linux_dirent64 *record = (const struct linux_dirent64 *)buf->records[i];
+            subdirs += add_entry(dir, record->d_name, record->d_type, (ino_t)record->d_ino,
+                                 handler, arg);
+        }
+    }
+    return (int)(subdirs > INT_MAX ? INT_MAX : subdirs);
+}
+
+#else /* SYS_getdents64 */
+
+int scan_dir_read(struct scan_dir *dir, struct scan_dirents *buf, scan_entry_handler handler,
+                  void *arg) {
+    (void)buf;
+    // fdopendir takes ownership of the descriptor, keep ours for openat/fstatat
+    int list_fd = dup(dir->fd);
+    DIR *directory = list_fd == -1 ? NULL : fdopendir(list_fd);
+    if (!directory) {
+        if (list_fd != -1) {
+            close(list_fd);
+        }
+        return -1;
+    }
+
+    size_t subdirs = 0;
+    struct dirent *file_entry;
+    while ((file_entry = readdir(directory)) != NULL) {
+        subdirs += add_entry(dir, file_entry->d_name, file_entry->d_type, file_entry->d_ino,
+                             handler, arg);
+    }
+    closedir(directory);
+    return (int)(subdirs > INT_MAX ? INT_MAX : subdirs);
+}
+
+#endif /* SYS_getdents64 */
+
+void scan_dirents_free(struct scan_dirents *buf) {
+    free(buf->data);
+    free(buf->records);
+    buf->data = NULL;
+    buf->records = NULL;
+    buf->records_capacity = 0;
+}
+
+int scan_entry_physical_offset(const struct scan_dir *dir, const struct scan_entry *entry,
+                               uint64_t *physical) {
+#ifdef FS_IOC_FIEMAP
+    int fd = openat(dir->fd, entry->name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.map.fm_start = 0;
+    request.map.fm_length = FIEMAP_MAX_OFFSET;
+    request.map.fm_extent_count = 1;
+    int res = ioctl(fd, FS_IOC_FIEMAP, &request.map);
+    close(fd);
+    if (res == -1 || request.map.fm_mapped_extents == 0) {
+        return -1;
+    }
+    *physical = request.extent.fe_physical;
+    return 0;
+#else
+    (void)dir;
+    (void)entry;
+    (void)physical;
+    return -1;
+#endif /* FS_IOC_FIEMAP */
+}
+
+void *scan_dir_alloc(struct scan_dir *dir, size_t size) {
+    return arena_alloc(&dir->arena, size);
+}
+
+int scan_dir_add_path(struct scan_dir *list, const char *path, scan_entry_handler handler,
+                      void *arg) {
+    return add_entry(list, path, DT_UNKNOWN, 0, handler, arg);
+}
+
+static size_t path_length(const struct scan_dir *dir) {
+    size_t len = 0;
+    for (; dir; dir = dir->parent) {
+        len += dir->name_len + (dir->parent ? 1 : 0);
+    }
+    return len;
+}
+
+const char *scan_path_build(struct scan_path *buf, const struct scan_dir *dir,
+                            const struct scan_entry *entry) {
+    // Entries of a file list carry their whole path
+    if (!dir->name) {
+        return entry ? entry->name : "";
+    }
+    size_t len = path_length(dir) + (entry ? entry->name_len + 1 : 0);
+    if (len == 0) {
+        return "/";
+    }
+    if (len + 1 > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity : 256;
+        while (capacity < len + 1) {
+            capacity *= 2;
+        }
+        char *data = (char *)realloc(buf->data, capacity);
+        if (!data) {
+            LOG_FATAL("scan_path_build: Out of memory");
+            exit(EXIT_FAILURE);
+        }
+        buf->data = data;
+        buf->capacity = capacity;
+    }
+
+    // Fill from the end, walking up to the root
+    char *end = buf->data + len;
+    *end = '\0';
+    if (entry) {
+        end -= entry->name_len;
+        memcpy(end, entry->name, entry->name_len);
+        *--end = '/';
+    }
+    for (; dir; dir = dir->parent) {
+        end -= dir->name_len;
+        memcpy(end, dir->name, dir->name_len);
+        if (dir->parent) {
+            *--end = '/';
+        }
+    }
+    return buf->data;
+}
+
+void scan_path_free(struct scan_path *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->capacity = 0;
+}
@@ -0,0 +1,276 @@
+#include "scan_filter.h"
+#include "scan_dir.h"
+#include <ctype.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+int scan_filter_parse_size(const char *arg, off_t *size) {
+    char *endptr = NULL;
+    long long value = strtoll(arg, &endptr, 10);
+    if (endptr == arg || value < 0) {
+        return -1;
+    }
+    int shift = 0;
+    switch (*endptr) {
+        case '\0':
+            break;
+        case 'k':
+        case 'K':
+            shift = 10;
+            break;
+        case 'm':
+        case 'M':
+            shift = 20;
+            break;
+        case 'g':
+        case 'G':
+            shift = 30;
+            break;
+        case 't':
+        case 'T':
+            shift = 40;
+            break;
+        default:
+            return -1;
+    }
+    if (shift && endptr[1] != '\0') {
+        return -1;
+    }
+    if (value > (0x7fffffffffffffffLL >> shift)) {
+        return -1;
+    }
+    *size = (off_t)(value << shift);
+    return 0;
+}
+
+int scan_filter_parse_time(const char *arg, long long *time_ns) {
+    char *endptr = NULL;
+
+    if (arg[0] == '@') {
+        long long seconds = strtoll(arg + 1, &endptr, 10);
+        if (endptr == arg + 1 || *endptr != '\0') {
+            return -1;
+        }
+        *time_ns = seconds * 1000000000LL;
+        return 0;
+    }
+
+    // An age relative to now
+    long long amount = strtoll(arg, &endptr, 10);
+    if (endptr != arg && amount >= 0 && endptr[0] != '\0' && endptr[1] == '\0') {
+        long long unit;
+        switch (endptr[0]) {
+            case 's':
+                unit = 1;
+                break;
+            case 'm':
+                unit = 60;
+                break;
+            case 'h':
+                unit = 3600;
+                break;
+            case 'd':
+                unit = 86400;
+                break;
+            default:
+                return -1;
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        *time_ns = ((long long)now.tv_sec - amount * unit) * 1000000000LL + now.tv_nsec;
+        return 0;
+    }
+
+    struct tm calendar;
+    memset(&calendar, 0, sizeof(calendar));
+    int consumed = 0;
+    if (sscanf(arg, "%4d-%2d-%2d%n", &calendar.tm_year, &calendar.tm_mon, &calendar.tm_mday,
+               &consumed) != 3) {
+        return -1;
+    }
+    const char *rest = arg + consumed;
+    if (*rest == 'T' || *rest == ' ') {
+        int time_consumed = 0;
+        if (sscanf(rest + 1, "%2d:%2d%n", &calendar.tm_hour, &calendar.tm_min, &time_consumed) != 2) {
+            return -1;
+        }
+        rest += 1 + time_consumed;
+        if (*rest == ':') {
+            if (sscanf(rest + 1, "%2d%n", &calendar.tm_sec, &time_consumed) != 1) {
+                return -1;
+            }
+            rest += 1 + time_consumed;
+        }
+    }
+    if (*rest != '\0') {
+        return -1;
+    }
+    calendar.tm_year -= 1900;
+    calendar.tm_mon -= 1;
+    calendar.tm_isdst = -1;
+    time_t seconds = mktime(&calendar);
+    if (seconds == (time_t)-1) {
+        return -1;
+    }
+    *time_ns = (long long)seconds * 1000000000LL;
+    return 0;
+}
+
+int scan_filter_parse_owner(const char *arg, int group, long long *id) {
+    char *endptr = NULL;
+    long long value = strtoll(arg, &endptr, 10);
+    if (endptr != arg && *endptr == '\0') {
+        if (value < 0) {
+            return -1;
+        }
+        *id = value;
+        return 0;
+    }
+    if (group) {
+        struct group *entry = getgrnam(arg);
+        if (!entry) {
+            return -1;
+        }
+        *id = entry->gr_gid;
+    } else {
+        struct passwd *entry = getpwnam(arg);
+        if (!entry) {
+            return -1;
+        }
+        *id = entry->pw_uid;
+    }
+    return 0;
+}
+
+int scan_filter_parse_perm(struct scan_filter *filter, const char *arg) {
+    enum scan_filter_perm kind = SCAN_FILTER_PERM_EXACT;
+    if (arg[0] == '-') {
+        kind = SCAN_FILTER_PERM_ALL;
+        arg++;
+    } else if (arg[0] == '/') {
+        kind = SCAN_FILTER_PERM_ANY;
+        arg++;
+    }
+    char *endptr = NULL;
+    long mode = strtol(arg, &endptr, 8);
+    if (endptr == arg || *endptr != '\0' || mode < 0 || mode > 07777) {
+        return -1;
+    }
+    filter->perm_kind = kind;
+    filter->perm = (mode_t)mode;
+    return 0;
+}
+
+int scan_filter_add_extensions(struct scan_filter *filter, const char *arg) {
+    const char *start = arg;
+    while (1) {
+        const char *end = strchr(start, ',');
+        size_t len = end ? (size_t)(end - start) : strlen(start);
+        // Accept "c", ".c" and "*.c"
+        if (len > 0 && start[0] == '*') {
+            start++;
+            len--;
+        }
+        if (len > 0 && start[0] == '.') {
+            start++;
+            len--;
+        }
+        if (len == 0) {
+            return -1;
+        }
+        char **extensions =
+            (char **)realloc(filter->extensions, (filter->extensions_len + 1) * sizeof(char *));
+        char *extension = (char *)malloc(len + 1);
+        if (!extensions || !extension) {
+            if (extensions) {
+                filter->extensions = extensions;
+            }
+            free(extension);
+            return -1;
+        }
+        for (size_t i = 0; i < len; i++) {
+            extension[i] = (char)tolower((unsigned char)start[i]);
+        }
+        extension[len] = '\0';
+        filter->extensions = extensions;
+        filter->extensions[filter->extensions_len++] = extension;
+        if (!end) {
+            return 0;
+        }
+        start = end + 1;
+    }
+}
+
+void scan_filter_free(struct scan_filter *filter) {
+    for (size_t i = 0; i < filter->extensions_len; i++) {
+        free(filter->extensions[i]);
+    }
+    free(filter->extensions);
+    filter->extensions = NULL;
+    filter->extensions_len = 0;
+}
+
+static int match_extension(const struct scan_filter *filter, const char *name) {
+    const char *dot = strrchr(name, '.');
+    // A leading dot marks a hidden file, not an extension
+    if (!dot || dot == name) {
+        return 0;
+    }
+    for (size_t i = 0; i < filter->extensions_len; i++) {
+        if (strcasecmp(dot + 1, filter->extensions[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int scan_filter_match(const struct scan_filter *filter, const struct scan_entry *entry,
+                      const char *name, long depth) {
+    if (!filter->active) {
+        return 1;
+    }
+    if (filter->max_depth >= 0 && depth > filter->max_depth) {
+        return 0;
+    }
+    if (entry->size < filter->min_size || (filter->max_size >= 0 && entry->size > filter->max_size)) {
+        return 0;
+    }
+    if ((filter->newer_ns && entry->mtime_ns <= filter->newer_ns) ||
+        (filter->older_ns && entry->mtime_ns >= filter->older_ns)) {
+        return 0;
+    }
+    if ((filter->uid >= 0 && (long long)entry->uid != filter->uid) ||
+        (filter->gid >= 0 && (long long)entry->gid != filter->gid)) {
+        return 0;
+    }
+    mode_t perm = entry->mode & 07777;
+    switch (filter->perm_kind) {
+        case SCAN_FILTER_PERM_EXACT:
+            if (perm != filter->perm) {
+                return 0;
+            }
+            break;
+        case SCAN_FILTER_PERM_ALL:
+            if ((perm & filter->perm) != filter->perm) {
+                return 0;
+            }
+            break;
+        case SCAN_FILTER_PERM_ANY:
+            if (filter->perm && !(perm & filter->perm)) {
+                return 0;
+            }
+            break;
+        default:
+            break;
+    }
+    return filter->extensions_len == 0 || match_extension(filter, name);
+}
+
+int scan_filter_descend(const struct scan_filter *filter, long depth) {
+    return filter->max_depth < 0 || depth < filter->max_depth;
+}
@@ -0,0 +1,130 @@
+#include "scan_list.h"
+#include "logger.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SCAN_LIST_BUFFER_SIZE (64 * 1024)
+
+struct scan_list {
+    int fd;
+    /* Whether the descriptor is standard input and stays open */
+    int borrowed;
+    int eof;
+    /* '\n' or '\0' once the first separator was seen, -1 before */
+    int separator;
+    char *data;
+    size_t capacity;
+    /* Unread bytes are data[start..end) */
+    size_t start;
+    size_t end;
+};
+
+struct scan_list *scan_list_open(const char *path) {
+    struct scan_list *list = (struct scan_list *)calloc(1, sizeof(struct scan_list));
+    if (!list) {
+        return NULL;
+    }
+    list->separator = -1;
+    list->capacity = SCAN_LIST_BUFFER_SIZE;
+    list->data = (char *)malloc(list->capacity);
+    if (!list->data) {
+        free(list);
+        return NULL;
+    }
+    if (strcmp(path, "-") == 0) {
+        list->fd = STDIN_FILENO;
+        list->borrowed = 1;
+    } else {
+        list->fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (list->fd == -1) {
+            free(list->data);
+            free(list);
+            return NULL;
+        }
+    }
+    return list;
+}
+
+// Append more input to the buffer, 0 at the end of the list
+static ssize_t fill(struct scan_list *list) {
+    if (list->start > 0) {
+        memmove(list->data, list->data + list->start, list->end - list->start);
+        list->end -= list->start;
+        list->start = 0;
+    }
+    // Keep room for the terminator of a last entry without a separator
+    if (list->capacity - list->end < 2) {
+        char *data = (char *)realloc(list->data, list->capacity * 2);
+        if (!data) {
+            LOG_FATAL("scan_list_next: Out of memory");
+            exit(EXIT_FAILURE);
+        }
+        list->data = data;
+        list->capacity *= 2;
+    }
+    ssize_t len;
+    do {
+        len = read(list->fd, list->data + list->end, list->capacity - list->end - 1);
+    } while (len == -1 && errno == EINTR);
+    if (len == -1) {
+        LOG_ERROR("scan_list_next: Error reading the file list");
+        return 0;
+    }
+    if (list->separator == -1) {
+        // Paths never contain NUL, so a single one marks a NUL separated list
+        if (memchr(list->data + list->end, '\0', (size_t)len)) {
+            list->separator = '\0';
+        } else if (memchr(list->data + list->end, '\n', (size_t)len)) {
+            list->separator = '\n';
+        }
+    }
+    list->end += (size_t)len;
+    return len;
+}
+
+const char *scan_list_next(struct scan_list *list) {
+    while (1) {
+        char *entry = list->data + list->start;
+        size_t available = list->end - list->start;
+        char *separator =
+            list->separator == -1 ? NULL : (char *)memchr(entry, list->separator, available);
+        size_t len;
+        if (separator) {
+            len = (size_t)(separator - entry);
+            list->start += len + 1;
+        } else if (list->eof) {
+            if (available == 0) {
+                return NULL;
+            }
+            len = available;
+            list->start = list->end;
+        } else {
+            if (fill(list) == 0) {
+                list->eof = 1;
+            }
+            continue;
+        }
+        if (list->separator == '\n' && len > 0 && entry[len - 1] == '\r') {
+            len--;
+        }
+        if (len == 0) {
+            continue;
+        }
+        entry[len] = '\0';
+        return entry;
+    }
+}
+
+void scan_list_close(struct scan_list *list) {
+    if (!list) {
+        return;
+    }
+    if (!list->borrowed) {
+        close(list->fd);
+    }
+    free(list->data);
+    free(list);
+}
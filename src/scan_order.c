@@ -0,0 +1,148 @@
+#include "scan_order.h"
+#include "logger.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Cost assumed for a plugin that never ran, so it gets tried early and measured
+#define SCAN_ORDER_PRIOR_NS 1000
+// Saved counts are scaled down to this many calls so old runs fade out
+#define SCAN_ORDER_HISTORY 100000
+
+#define SCAN_ORDER_HEADER "# plugin statistics: key calls matches total_ns name\n"
+
+void scan_order_estimate(const struct scan_order_stats *stats, double *cost, double *chance) {
+    *cost = ((double)stats->total_ns + SCAN_ORDER_PRIOR_NS) / ((double)stats->calls + 1);
+    // Laplace smoothing keeps unseen plugins at one in two
+    *chance = ((double)stats->matches + 1) / ((double)stats->calls + 2);
+}
+
+static double expected_cost(const struct scan_order_stats *stats, int settle_on_match) {
+    double cost;
+    double chance;
+    scan_order_estimate(stats, &cost, &chance);
+    return cost / (settle_on_match ? chance : 1 - chance);
+}
+
+void scan_order_sort(const struct scan_order_stats *stats, size_t len, int settle_on_match,
+                     size_t *order) {
+    double *ranks = (double *)malloc((len ? len : 1) * sizeof(double));
+    if (!ranks) {
+        return;
+    }
+    for (size_t i = 0; i < len; i++) {
+        ranks[i] = expected_cost(&stats[i], settle_on_match);
+    }
+    // Insertion sort, chains are short and mostly sorted already
+    for (size_t i = 1; i < len; i++) {
+        size_t index = order[i];
+        size_t j = i;
+        while (j > 0 && (ranks[order[j - 1]] > ranks[index] ||
+                         (ranks[order[j - 1]] == ranks[index] && order[j - 1] > index))) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = index;
+    }
+    free(ranks);
+}
+
+// Parse one line of the statistics file, -1 for comments and malformed lines
+static int parse_line(const char *line, uint64_t *key, struct scan_order_stats *stats) {
+    if (line[0] == '#') {
+        return -1;
+    }
+    if (sscanf(line, "%" SCNx64 " %" SCNu64 " %" SCNu64 " %" SCNu64, key, &stats->calls,
+               &stats->matches, &stats->total_ns) != 4 ||
+        stats->matches > stats->calls) {
+        return -1;
+    }
+    return 0;
+}
+
+int scan_order_load(const char *path, const uint64_t *keys, size_t len,
+                    struct scan_order_stats *stats) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), file)) {
+        uint64_t key;
+        struct scan_order_stats saved;
+        if (parse_line(line, &key, &saved) == -1) {
+            continue;
+        }
+        for (size_t i = 0; i < len; i++) {
+            if (keys[i] == key) {
+                stats[i].calls += saved.calls;
+                stats[i].matches += saved.matches;
+                stats[i].total_ns += saved.total_ns;
+            }
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+int scan_order_save(const char *path, const uint64_t *keys, const char *const *names, size_t len,
+                    const struct scan_order_stats *stats) {
+    size_t path_len = strlen(path);
+    char *tmp_path = (char *)malloc(path_len + 5);
+    if (!tmp_path) {
+        return -1;
+    }
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", 5);
+
+    FILE *out = fopen(tmp_path, "w");
+    if (!out) {
+        LOG_ERROR("scan_order_save: Cannot write %s", tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+    fputs(SCAN_ORDER_HEADER, out);
+
+    // Keep the lines of plugins (or option arguments) not used in this run
+    FILE *in = fopen(path, "r");
+    if (in) {
+        char line[512];
+        while (fgets(line, sizeof(line), in)) {
+            uint64_t key;
+            struct scan_order_stats saved;
+            if (parse_line(line, &key, &saved) == -1) {
+                continue;
+            }
+            int current = 0;
+            for (size_t i = 0; i < len && !current; i++) {
+                current = keys[i] == key;
+            }
+            if (!current) {
+                fputs(line, out);
+            }
+        }
+        fclose(in);
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        struct scan_order_stats saved = stats[i];
+        if (saved.calls > SCAN_ORDER_HISTORY) {
+            double scale = (double)SCAN_ORDER_HISTORY / (double)saved.calls;
+            saved.calls = SCAN_ORDER_HISTORY;
+            saved.matches = (uint64_t)((double)saved.matches * scale);
+            saved.total_ns = (uint64_t)((double)saved.total_ns * scale);
+        }
+        fprintf(out, "%016" PRIx64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %s\n", keys[i], saved.calls,
+                saved.matches, saved.total_ns, names[i]);
+    }
+
+    int status = 0;
+    if (fclose(out) != 0 || rename(tmp_path, path) == -1) {
+        LOG_ERROR("scan_order_save: Cannot replace %s", path);
+        remove(tmp_path);
+        status = -1;
+    }
+    free(tmp_path);
+    return status;
+}
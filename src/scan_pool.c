@@ -0,0 +1,233 @@
+#include "scan_pool.h"
+#include "logger.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEQUE_INITIAL_CAPACITY 64
+
+// Per-worker double ended queue. The owner pushes and pops at the bottom (LIFO,
+// depth first, good locality), thieves take from the top (oldest, usually the
+// biggest subtrees).
+struct scan_deque {
+    pthread_mutex_t lock;
+    struct scan_task *tasks;
+    size_t capacity;
+    size_t top;
+    size_t bottom;
+};
+
+struct scan_worker {
+    struct scan_pool *pool;
+    size_t index;
+    pthread_t thread;
+};
+
+struct scan_pool {
+    struct scan_deque *deques;
+    struct scan_worker *workers;
+    size_t workers_len;
+    scan_task_handler handler;
+    void *arg;
+    /* Tasks pushed and not finished yet */
+    atomic_size_t pending;
+    /* Tasks sitting in a deque */
+    atomic_size_t queued;
+    atomic_size_t sleepers;
+    atomic_int aborted;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+};
+
+static void deque_init(struct scan_deque *deque) {
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->tasks = NULL;
+    deque->capacity = 0;
+    deque->top = 0;
+    deque->bottom = 0;
+}
+
+static void deque_destroy(struct scan_deque *deque, scan_task_discard discard, void *arg) {
+    for (size_t i = deque->top; i != deque->bottom; i++) {
+        discard(deque->tasks[i & (deque->capacity - 1)], arg);
+    }
+    free(deque->tasks);
+    pthread_mutex_destroy(&deque->lock);
+}
+
+static void deque_push(struct scan_deque *deque, struct scan_task task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom - deque->top == deque->capacity) {
+        size_t capacity = deque->capacity ? deque->capacity * 2 : DEQUE_INITIAL_CAPACITY;
+        struct scan_task *tasks = (struct scan_task *)malloc(capacity * sizeof(struct scan_task));
+        if (!tasks) {
+            LOG_FATAL("deque_push: Out of memory");
+            exit(EXIT_FAILURE);
+        }
+        size_t len = deque->bottom - deque->top;
+        for (size_t i = 0; i < len; i++) {
+            tasks[i] = deque->tasks[(deque->top + i) & (deque->capacity - 1)];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->capacity = capacity;
+        deque->top = 0;
+        deque->bottom = len;
+    }
+    deque->tasks[deque->bottom++ & (deque->capacity - 1)] = task;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static int deque_pop(struct scan_deque *deque, struct scan_task *task) {
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom != deque->top) {
+        *task = deque->tasks[--deque->bottom & (deque->capacity - 1)];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static int deque_steal(struct scan_deque *deque, struct scan_task *task) {
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom != deque->top) {
+        *task = deque->tasks[deque->top++ & (deque->capacity - 1)];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static int take_task(struct scan_pool *pool, size_t worker, struct scan_task *task) {
+    if (deque_pop(&pool->deques[worker], task)) {
+        return 1;
+    }
+    for (size_t i = 1; i < pool->workers_len; i++) {
+        if (deque_steal(&pool->deques[(worker + i) % pool->workers_len], task)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void wake_all(struct scan_pool *pool) {
+    pthread_mutex_lock(&pool->idle_lock);
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+// Sleep until there is something to steal or the scan is over
+static void wait_for_work(struct scan_pool *pool) {
+    pthread_mutex_lock(&pool->idle_lock);
+    atomic_fetch_add(&pool->sleepers, 1);
+    while (!atomic_load(&pool->aborted) && atomic_load(&pool->pending) != 0 &&
+           atomic_load(&pool->queued) == 0) {
+        pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+    }
+    atomic_fetch_sub(&pool->sleepers, 1);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+static void *worker_main(void *arg) {
+    struct scan_worker *self = (struct scan_worker *)arg;
+    struct scan_pool *pool = self->pool;
+    struct scan_task task;
+
+    while (!atomic_load(&pool->aborted)) {
+        if (take_task(pool, self->index, &task)) {
+            atomic_fetch_sub(&pool->queued, 1);
+            pool->handler(pool, self->index, task, pool->arg);
+            if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+                wake_all(pool);
+            }
+            continue;
+        }
+        if (atomic_load(&pool->pending) == 0) {
+            break;
+        }
+        wait_for_work(pool);
+    }
+    return NULL;
+}
+
+void scan_pool_push(struct scan_pool *pool, size_t worker, struct scan_task task) {
+    atomic_fetch_add(&pool->pending, 1);
+    atomic_fetch_add(&pool->queued, 1);
+    deque_push(&pool->deques[worker], task);
+    if (atomic_load(&pool->sleepers) != 0) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_signal(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
+
+void scan_pool_abort(struct scan_pool *pool) {
+    atomic_store(&pool->aborted, 1);
+    wake_all(pool);
+}
+
+size_t scan_pool_default_workers(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (size_t)cpus : 1;
+}
+
+int scan_pool_run(size_t workers, const struct scan_task *roots, size_t roots_len,
+                  scan_task_handler handler, scan_task_discard discard, void *arg) {
+    LOG_DEBUG("scan_pool_run: Starting scan with %zu workers", workers);
+
+    struct scan_pool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.workers_len = workers ? workers : 1;
+    pool.handler = handler;
+    pool.arg = arg;
+    pool.deques = (struct scan_deque *)malloc(pool.workers_len * sizeof(struct scan_deque));
+    pool.workers = (struct scan_worker *)malloc(pool.workers_len * sizeof(struct scan_worker));
+    if (!pool.deques || !pool.workers) {
+        LOG_FATAL("scan_pool_run: Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    atomic_init(&pool.pending, 0);
+    atomic_init(&pool.queued, 0);
+    atomic_init(&pool.sleepers, 0);
+    atomic_init(&pool.aborted, 0);
+    pthread_mutex_init(&pool.idle_lock, NULL);
+    pthread_cond_init(&pool.idle_cond, NULL);
+    for (size_t i = 0; i < pool.workers_len; i++) {
+        deque_init(&pool.deques[i]);
+        pool.workers[i].pool = &pool;
+        pool.workers[i].index = i;
+    }
+
+    // Worker 0 pops the first root first, the others steal the rest
+    for (size_t i = roots_len; i-- > 0;) {
+        scan_pool_push(&pool, 0, roots[i]);
+    }
+
+    // Worker 0 runs on the calling thread, so -j 1 never spawns a thread
+    size_t started = 1;
+    for (size_t i = 1; i < pool.workers_len; i++) {
+        if (pthread_create(&pool.workers[i].thread, NULL, worker_main, &pool.workers[i]) != 0) {
+            LOG_WARN("scan_pool_run: Failed to start worker %zu, continuing with %zu", i, started);
+            break;
+        }
+        started++;
+    }
+    worker_main(&pool.workers[0]);
+    for (size_t i = 1; i < started; i++) {
+        pthread_join(pool.workers[i].thread, NULL);
+    }
+
+    int result = atomic_load(&pool.aborted) ? -1 : 0;
+    for (size_t i = 0; i < pool.workers_len; i++) {
+        deque_destroy(&pool.deques[i], discard, arg);
+    }
+    pthread_cond_destroy(&pool.idle_cond);
+    pthread_mutex_destroy(&pool.idle_lock);
+    free(pool.workers);
+    free(pool.deques);
+    return result;
+}
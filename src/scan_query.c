@@ -0,0 +1,449 @@
+#include "scan_query.h"
+#include "logger.h"
+#include <ctype.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+// Deepest nesting of parentheses and NOTs accepted
+#define SCAN_QUERY_MAX_DEPTH 256
+
+enum query_kind {
+    QUERY_LEAF,
+    QUERY_NOT,
+    QUERY_AND,
+    QUERY_OR,
+};
+
+struct query_node {
+    enum query_kind kind;
+    /* Plugin of a leaf, operand of a NOT */
+    size_t target;
+    /* Operands of an AND or OR are order[first..first + len) */
+    size_t first;
+    size_t len;
+};
+
+struct scan_query {
+    /* Every node comes after its operands */
+    struct query_node *nodes;
+    size_t nodes_len;
+    size_t nodes_capacity;
+    size_t *order;
+    size_t order_len;
+    size_t order_capacity;
+    size_t root;
+};
+
+enum token_kind {
+    TOKEN_NAME,
+    TOKEN_AND,
+    TOKEN_OR,
+    TOKEN_NOT,
+    TOKEN_OPEN,
+    TOKEN_CLOSE,
+    TOKEN_END,
+};
+
+struct parser {
+    struct scan_query *query;
+    const char *text;
+    const char *pos;
+    /* Current token */
+    enum token_kind token;
+    const char *start;
+    size_t len;
+    int depth;
+    scan_query_resolve resolve;
+    void *arg;
+};
+
+static int is_name_char(char c) {
+    return isalnum((unsigned char)c) || c == '_' || c == '-' || c == '.';
+}
+
+static int is_keyword(const struct parser *parser, const char *keyword) {
+    return parser->len == strlen(keyword) && strncasecmp(parser->start, keyword, parser->len) == 0;
+}
+
+// Read the next token, -1 on a character that cannot start one
+static int next_token(struct parser *parser) {
+    while (isspace((unsigned char)*parser->pos)) {
+        parser->pos++;
+    }
+    parser->start = parser->pos;
+    parser->len = 1;
+    char c = *parser->pos;
+    if (c == '\0') {
+        parser->token = TOKEN_END;
+        parser->len = 0;
+        return 0;
+    }
+    if (c == '(' || c == ')' || c == '!') {
+        parser->token = c == '(' ? TOKEN_OPEN : c == ')' ? TOKEN_CLOSE : TOKEN_NOT;
+        parser->pos++;
+        return 0;
+    }
+    if ((c == '&' || c == '|') && parser->pos[1] == c) {
+        parser->token = c == '&' ? TOKEN_AND : TOKEN_OR;
+        parser->len = 2;
+        parser->pos += 2;
+        return 0;
+    }
+    if (!is_name_char(c)) {
+        return -1;
+    }
+    while (is_name_char(*parser->pos)) {
+        parser->pos++;
+    }
+    parser->len = (size_t)(parser->pos - parser->start);
+    parser->token = TOKEN_NAME;
+    if (is_keyword(parser, "and")) {
+        parser->token = TOKEN_AND;
+    } else if (is_keyword(parser, "or")) {
+        parser->token = TOKEN_OR;
+    } else if (is_keyword(parser, "not")) {
+        parser->token = TOKEN_NOT;
+    }
+    return 0;
+}
+
+static void syntax_error(const struct parser *parser, const char *reason) {
+    LOG_ERROR("scan_query_compile: %s at offset %zu of '%s'", reason,
+              (size_t)(parser->start - parser->text), parser->text);
+}
+
+static long add_node(struct scan_query *query, struct query_node node) {
+    if (query->nodes_len == query->nodes_capacity) {
+        size_t capacity = query->nodes_capacity ? query->nodes_capacity * 2 : 16;
+        struct query_node *nodes =
+            (struct query_node *)realloc(query->nodes, capacity * sizeof(struct query_node));
+        if (!nodes) {
+            return -1;
+        }
+        query->nodes = nodes;
+        query->nodes_capacity = capacity;
+    }
+    query->nodes[query->nodes_len] = node;
+    return (long)query->nodes_len++;
+}
+
+static int add_operand(struct scan_query *query, size_t node) {
+    if (query->order_len == query->order_capacity) {
+        size_t capacity = query->order_capacity ? query->order_capacity * 2 : 16;
+        size_t *order = (size_t *)realloc(query->order, capacity * sizeof(size_t));
+        if (!order) {
+            return -1;
+        }
+        query->order = order;
+        query->order_capacity = capacity;
+    }
+    query->order[query->order_len++] = node;
+    return 0;
+}
+
+static long parse_or(struct parser *parser);
+
+static long parse_unary(struct parser *parser) {
+    if (++parser->depth > SCAN_QUERY_MAX_DEPTH) {
+        syntax_error(parser, "Expression nested too deeply");
+        return -1;
+    }
+    long node = -1;
+    if (parser->token == TOKEN_NOT) {
+        if (next_token(parser) == -1) {
+            syntax_error(parser, "Unexpected character");
+            return -1;
+        }
+        long operand = parse_unary(parser);
+        if (operand == -1) {
+            return -1;
+        }
+        const struct query_node *inner = &parser->query->nodes[operand];
+        if (inner->kind == QUERY_NOT) {
+            // NOT NOT x is x
+            node = (long)inner->target;
+        } else {
+            struct query_node not_node = {QUERY_NOT, (size_t)operand, 0, 0};
+            node = add_node(parser->query, not_node);
+            if (node == -1) {
+                LOG_ERROR("scan_query_compile: Out of memory");
+                return -1;
+            }
+        }
+    } else if (parser->token == TOKEN_OPEN) {
+        if (next_token(parser) == -1) {
+            syntax_error(parser, "Unexpected character");
+            return -1;
+        }
+        node = parse_or(parser);
+        if (node == -1) {
+            return -1;
+        }
+        if (parser->token != TOKEN_CLOSE) {
+            syntax_error(parser, "Missing ')'");
+            return -1;
+        }
+        if (next_token(parser) == -1) {
+            syntax_error(parser, "Unexpected character");
+            return -1;
+        }
+    } else if (parser->token == TOKEN_NAME) {
+        char name[256];
+        const char *start = parser->start;
+        size_t len = parser->len;
+        // Options may be written as on the command line
+        while (len > 1 && start[0] == '-') {
+            start++;
+            len--;
+        }
+        if (len >= sizeof(name)) {
+            syntax_error(parser, "Name too long");
+            return -1;
+        }
+        memcpy(name, start, len);
+        name[len] = '\0';
+        long plugin = parser->resolve(name, parser->arg);
+        if (plugin < 0) {
+            syntax_error(parser, "No plugin with this option or name");
+            return -1;
+        }
+        struct query_node leaf = {QUERY_LEAF, (size_t)plugin, 0, 0};
+        node = add_node(parser->query, leaf);
+        if (node == -1) {
+            LOG_ERROR("scan_query_compile: Out of memory");
+            return -1;
+        }
+        if (next_token(parser) == -1) {
+            syntax_error(parser, "Unexpected character");
+            return -1;
+        }
+    } else {
+        syntax_error(parser, parser->token == TOKEN_END ? "Unexpected end of expression"
+                                                        : "Expected a name, NOT or '('");
+        return -1;
+    }
+    parser->depth--;
+    return node;
+}
+
+// Parse operands joined by one operator into a single flattened node
+static long parse_chain(struct parser *parser, enum token_kind token, enum query_kind kind,
+                        long (*parse_operand)(struct parser *)) {
+    long first = parse_operand(parser);
+    if (first == -1 || parser->token != token) {
+        return first;
+    }
+    size_t *operands = NULL;
+    size_t operands_len = 0;
+    size_t operands_capacity = 0;
+    long operand = first;
+    long node = -1;
+    while (1) {
+        // Operands of the same kind are merged: a AND (b AND c) is a AND b AND c
+        const struct query_node *inner = &parser->query->nodes[operand];
+        size_t count = inner->kind == kind ? inner->len : 1;
+        if (operands_len + count > operands_capacity) {
+            size_t capacity = operands_capacity * 2 + count + 4;
+            size_t *grown = (size_t *)realloc(operands, capacity * sizeof(size_t));
+            if (!grown) {
+                LOG_ERROR("scan_query_compile: Out of memory");
+                goto out;
+            }
+            operands = grown;
+            operands_capacity = capacity;
+        }
+        if (inner->kind == kind) {
+            memcpy(operands + operands_len, parser->query->order + inner->first,
+                   count * sizeof(size_t));
+        } else {
+            operands[operands_len] = (size_t)operand;
+        }
+        operands_len += count;
+
+        if (parser->token != token) {
+            break;
+        }
+        if (next_token(parser) == -1) {
+            syntax_error(parser, "Unexpected character");
+            goto out;
+        }
+        operand = parse_operand(parser);
+        if (operand == -1) {
+            goto out;
+        }
+    }
+
+    struct query_node chain = {kind, 0, parser->query->order_len, operands_len};
+    for (size_t i = 0; i < operands_len; i++) {
+        if (add_operand(parser->query, operands[i]) == -1) {
+            LOG_ERROR("scan_query_compile: Out of memory");
+            goto out;
+        }
+    }
+    node = add_node(parser->query, chain);
+    if (node == -1) {
+        LOG_ERROR("scan_query_compile: Out of memory");
+    }
+out:
+    free(operands);
+    return node;
+}
+
+static long parse_and(struct parser *parser) {
+    return parse_chain(parser, TOKEN_AND, QUERY_AND, parse_unary);
+}
+
+static long parse_or(struct parser *parser) {
+    return parse_chain(parser, TOKEN_OR, QUERY_OR, parse_and);
+}
+
+struct scan_query *scan_query_compile(const char *text, scan_query_resolve resolve, void *arg) {
+    struct scan_query *query = (struct scan_query *)calloc(1, sizeof(struct scan_query));
+    if (!query) {
+        LOG_ERROR("scan_query_compile: Out of memory");
+        return NULL;
+    }
+    struct parser parser = {
+        .query = query,
+        .text = text,
+        .pos = text,
+        .token = TOKEN_END,
+        .start = text,
+        .len = 0,
+        .depth = 0,
+        .resolve = resolve,
+        .arg = arg,
+    };
+    if (next_token(&parser) == -1) {
+        syntax_error(&parser, "Unexpected character");
+        scan_query_free(query);
+        return NULL;
+    }
+    long root = parse_or(&parser);
+    if (root != -1 && parser.token != TOKEN_END) {
+        syntax_error(&parser, parser.token == TOKEN_CLOSE ? "Unbalanced ')'" : "Expected AND or OR");
+        root = -1;
+    }
+    if (root == -1) {
+        scan_query_free(query);
+        return NULL;
+    }
+    query->root = (size_t)root;
+    return query;
+}
+
+void scan_query_free(struct scan_query *query) {
+    if (!query) {
+        return;
+    }
+    free(query->nodes);
+    free(query->order);
+    free(query);
+}
+
+int scan_query_uses(const struct scan_query *query, size_t plugin) {
+    for (size_t i = 0; i < query->nodes_len; i++) {
+        if (query->nodes[i].kind == QUERY_LEAF && query->nodes[i].target == plugin) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+size_t scan_query_order_len(const struct scan_query *query) {
+    return query->order_len;
+}
+
+const size_t *scan_query_initial_order(const struct scan_query *query) {
+    return query->order;
+}
+
+void scan_query_order(const struct scan_query *query, const struct scan_order_stats *stats,
+                      size_t *order) {
+    double *cost = (double *)malloc((query->nodes_len ? query->nodes_len : 1) * 3 * sizeof(double));
+    if (!cost) {
+        return;
+    }
+    /* Chance that a node is true, and its rank as an operand of its parent */
+    double *chance = cost + query->nodes_len;
+    double *rank = chance + query->nodes_len;
+
+    // Operands come first, so one pass estimates every node
+    for (size_t i = 0; i < query->nodes_len; i++) {
+        const struct query_node *node = &query->nodes[i];
+        switch (node->kind) {
+            case QUERY_LEAF:
+                scan_order_estimate(&stats[node->target], &cost[i], &chance[i]);
+                break;
+            case QUERY_NOT:
+                cost[i] = cost[node->target];
+                chance[i] = 1 - chance[node->target];
+                break;
+            case QUERY_AND:
+            case QUERY_OR: {
+                // An AND is decided by a false operand, an OR by a true one
+                int decided_by_true = node->kind == QUERY_OR;
+                size_t *operands = order + node->first;
+                for (size_t j = 0; j < node->len; j++) {
+                    size_t operand = operands[j];
+                    double decides = decided_by_true ? chance[operand] : 1 - chance[operand];
+                    rank[operand] = decides > 0 ? cost[operand] / decides : HUGE_VAL;
+                }
+                for (size_t j = 1; j < node->len; j++) {
+                    size_t operand = operands[j];
+                    size_t k = j;
+                    while (k > 0 && (rank[operands[k - 1]] > rank[operand] ||
+                                     (rank[operands[k - 1]] == rank[operand] &&
+                                      operands[k - 1] > operand))) {
+                        operands[k] = operands[k - 1];
+                        k--;
+                    }
+                    operands[k] = operand;
+                }
+                // Each operand only runs while the ones before it left the result open
+                double open = 1;
+                cost[i] = 0;
+                for (size_t j = 0; j < node->len; j++) {
+                    size_t operand = operands[j];
+                    cost[i] += open * cost[operand];
+                    open *= decided_by_true ? 1 - chance[operand] : chance[operand];
+                }
+                chance[i] = decided_by_true ? 1 - open : open;
+                break;
+            }
+        }
+    }
+    free(cost);
+}
+
+static int eval_node(const struct scan_query *query, const size_t *order, size_t index,
+                     scan_query_leaf leaf, void *arg) {
+    const struct query_node *node = &query->nodes[index];
+    switch (node->kind) {
+        case QUERY_LEAF:
+            return leaf(node->target, arg);
+        case QUERY_NOT: {
+            int result = eval_node(query, order, node->target, leaf, arg);
+            return result == -1 ? -1 : !result;
+        }
+        case QUERY_AND:
+        case QUERY_OR: {
+            int decisive = node->kind == QUERY_OR;
+            for (size_t j = 0; j < node->len; j++) {
+                int result = eval_node(query, order, order[node->first + j], leaf, arg);
+                if (result == -1 || result == decisive) {
+                    return result;
+                }
+            }
+            return !decisive;
+        }
+    }
+    return -1;
+}
+
+int scan_query_eval(const struct scan_query *query, const size_t *order, scan_query_leaf leaf,
+                    void *arg) {
+    return eval_node(query, order, query->root, leaf, arg);
+}
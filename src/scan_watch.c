@@ -0,0 +1,493 @@
+#include "scan_watch.h"
+#include "logger.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <unistd.h>
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+// Size of the buffer one batch of events is read into
+#define WATCH_EVENTS_SIZE (64 * 1024)
+
+#define INOTIFY_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_ONLYDIR | \
+                      IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+#define FANOTIFY_MASK (FAN_CLOSE_WRITE | FAN_MOVED_TO | FAN_CREATE | FAN_ONDIR)
+
+enum watch_backend {
+    WATCH_INOTIFY,
+    WATCH_FANOTIFY,
+};
+
+// Filesystem marked through fanotify, the file handles of its events are opened relative to 'fd'
+struct watched_fs {
+    fsid_t fsid;
+    int fd;
+};
+
+struct scan_watch {
+    enum watch_backend backend;
+    int fd;
+    /* Root as given, without trailing slashes ("/" becomes "") */
+    char *root;
+    /* inotify: path of every watch descriptor, NULL for unused ones */
+    char **paths;
+    size_t paths_capacity;
+    /* fanotify: canonical root (same trimming) and the marked filesystems */
+    char *real_root;
+    size_t real_root_len;
+    struct watched_fs *filesystems;
+    size_t filesystems_len;
+    char *events;
+};
+
+// Path to pass to the kernel for a trimmed path
+static const char *fs_path(const char *path) {
+    return *path ? path : "/";
+}
+
+static char *trimmed_copy(const char *path) {
+    char *copy = strdup(path);
+    if (copy) {
+        size_t len = strlen(copy);
+        while (len > 0 && copy[len - 1] == '/') {
+            copy[--len] = '\0';
+        }
+    }
+    return copy;
+}
+
+static char *join_path(const char *dir, size_t dir_len, const char *name) {
+    size_t name_len = strlen(name);
+    char *path = (char *)malloc(dir_len + name_len + 2);
+    if (path) {
+        memcpy(path, dir, dir_len);
+        path[dir_len] = '/';
+        memcpy(path + dir_len + 1, name, name_len + 1);
+    }
+    return path;
+}
+
+// Whether 'path' is 'dir' or lies below it
+static int is_under(const char *path, const char *dir, size_t dir_len) {
+    return strncmp(path, dir, dir_len) == 0 && (path[dir_len] == '\0' || path[dir_len] == '/');
+}
+
+static void set_watch_path(struct scan_watch *watch, int wd, char *path) {
+    if ((size_t)wd >= watch->paths_capacity) {
+        size_t capacity = watch->paths_capacity ? watch->paths_capacity : 1024;
+        while ((size_t)wd >= capacity) {
+            capacity *= 2;
+        }
+        char **paths = (char **)realloc(watch->paths, capacity * sizeof(char *));
+        if (!paths) {
+            LOG_FATAL("set_watch_path: Out of memory");
+            exit(EXIT_FAILURE);
+        }
+        memset(paths + watch->paths_capacity, 0,
+               (capacity - watch->paths_capacity) * sizeof(char *));
+        watch->paths = paths;
+        watch->paths_capacity = capacity;
+    }
+    free(watch->paths[wd]);
+    watch->paths[wd] = path;
+}
+
+// Add an inotify watch to 'path' and every directory below it
+static void add_tree(struct scan_watch *watch, const char *path) {
+    int wd = inotify_add_watch(watch->fd, fs_path(path), INOTIFY_MASK);
+    if (wd == -1) {
+        if (errno == ENOSPC) {
+            LOG_WARN("add_tree: Out of inotify watches (fs.inotify.max_user_watches), not watching %s",
+                     fs_path(path));
+        } else if (errno != ENOENT && errno != ENOTDIR) {
+            LOG_WARN("add_tree: Cannot watch %s", fs_path(path));
+        }
+        return;
+    }
+    char *copy = strdup(path);
+    if (!copy) {
+        LOG_FATAL("add_tree: Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    set_watch_path(watch, wd, copy);
+
+    DIR *dir = opendir(fs_path(path));
+    if (!dir) {
+        return;
+    }
+    size_t path_len = strlen(path);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+                !S_ISDIR(st.st_mode)) {
+                continue;
+            }
+        } else if (entry->d_type != DT_DIR) {
+            continue;
+        }
+        char *child = join_path(path, path_len, entry->d_name);
+        if (!child) {
+            LOG_FATAL("add_tree: Out of memory");
+            exit(EXIT_FAILURE);
+        }
+        add_tree(watch, child);
+        free(child);
+    }
+    closedir(dir);
+}
+
+// Drop the watches of a directory that left the tree
+static void remove_tree(struct scan_watch *watch, const char *path) {
+    size_t path_len = strlen(path);
+    for (size_t wd = 0; wd < watch->paths_capacity; wd++) {
+        if (watch->paths[wd] && is_under(watch->paths[wd], path, path_len)) {
+            inotify_rm_watch(watch->fd, (int)wd);
+            free(watch->paths[wd]);
+            watch->paths[wd] = NULL;
+        }
+    }
+}
+
+static void process_inotify(struct scan_watch *watch, const char *events, size_t len,
+                            scan_watch_handler handler, void *arg) {
+    for (size_t offset = 0; offset < len;) {
+        const struct inotify_event *event = (const struct inotify_event *)(events + offset);
+        offset += sizeof(struct inotify_event) + event->len;
+
+        if (event->mask & IN_Q_OVERFLOW) {
+            LOG_WARN("process_inotify: Events were lost, scanning the whole tree again");
+            handler(SCAN_WATCH_TREE, fs_path(watch->root), arg);
+            continue;
+        }
+        if (event->wd < 0 || (size_t)event->wd >= watch->paths_capacity ||
+            !watch->paths[event->wd]) {
+            continue;
+        }
+        if (event->mask & IN_IGNORED) {
+            set_watch_path(watch, event->wd, NULL);
+            continue;
+        }
+        if (event->len == 0) {
+            continue;
+        }
+
+        const char *dir = watch->paths[event->wd];
+        char *path = join_path(dir, strlen(dir), event->name);
+        if (!path) {
+            LOG_FATAL("process_inotify: Out of memory");
+            exit(EXIT_FAILURE);
+        }
+        if (event->mask & IN_ISDIR) {
+            if (event->mask & IN_MOVED_FROM) {
+                remove_tree(watch, path);
+            } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                add_tree(watch, path);
+                handler(SCAN_WATCH_TREE, path, arg);
+            }
+        } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+            handler(SCAN_WATCH_FILE, path, arg);
+        }
+        free(path);
+    }
+}
+
+// Mark the filesystem holding 'path' unless it is marked already
+static int mark_filesystem(struct scan_watch *watch, const char *path) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        // A mount point we cannot enter, nothing below it can be scanned either
+        return 0;
+    }
+    struct statfs st;
+    if (fstatfs(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    for (size_t i = 0; i < watch->filesystems_len; i++) {
+        if (memcmp(&watch->filesystems[i].fsid, &st.f_fsid, sizeof(fsid_t)) == 0) {
+            close(fd);
+            return 0;
+        }
+    }
+    struct watched_fs *filesystems = (struct watched_fs *)realloc(
+        watch->filesystems, (watch->filesystems_len + 1) * sizeof(struct watched_fs));
+    if (!filesystems ||
+        fanotify_mark(watch->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_MASK, fd, NULL) == -1) {
+        if (filesystems) {
+            watch->filesystems = filesystems;
+        }
+        close(fd);
+        return -1;
+    }
+    watch->filesystems = filesystems;
+    watch->filesystems[watch->filesystems_len].fsid = st.f_fsid;
+    watch->filesystems[watch->filesystems_len].fd = fd;
+    watch->filesystems_len++;
+    return 0;
+}
+
+// Undo the octal escapes of /proc/self/mountinfo in place
+static void unescape_mount_point(char *path) {
+    char *out = path;
+    for (char *in = path; *in; out++) {
+        if (in[0] == '\\' && in[1] >= '0' && in[1] <= '3' && in[2] >= '0' && in[2] <= '7' &&
+            in[3] >= '0' && in[3] <= '7') {
+            *out = (char)((in[1] - '0') * 64 + (in[2] - '0') * 8 + (in[3] - '0'));
+            in += 4;
+        } else {
+            *out = *in++;
+        }
+    }
+    *out = '\0';
+}
+
+// Mark the filesystem of the root and of every mount point below it
+static int mark_tree(struct scan_watch *watch) {
+    if (mark_filesystem(watch, fs_path(watch->real_root)) == -1) {
+        return -1;
+    }
+    FILE *mounts = fopen("/proc/self/mountinfo", "r");
+    if (!mounts) {
+        return -1;
+    }
+    int status = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    while (status == 0 && getline(&line, &line_capacity, mounts) != -1) {
+        // "<id> <parent id> <major:minor> <root> <mount point> ..."
+        char *field = line;
+        for (int i = 0; i < 4 && field; i++) {
+            field = strchr(field, ' ');
+            field = field ? field + 1 : NULL;
+        }
+        char *end = field ? strchr(field, ' ') : NULL;
+        if (!end) {
+            continue;
+        }
+        *end = '\0';
+        unescape_mount_point(field);
+        if (is_under(field, watch->real_root, watch->real_root_len)) {
+            status = mark_filesystem(watch, field);
+        }
+    }
+    free(line);
+    fclose(mounts);
+    return status;
+}
+
+static const struct watched_fs *find_filesystem(const struct scan_watch *watch, const void *fsid) {
+    for (size_t i = 0; i < watch->filesystems_len; i++) {
+        if (memcmp(&watch->filesystems[i].fsid, fsid, sizeof(fsid_t)) == 0) {
+            return &watch->filesystems[i];
+        }
+    }
+    return NULL;
+}
+
+// Path (as seen from the root given by the user) of the entry an event refers to, NULL if
+// it cannot be resolved or lies outside the tree
+static char *resolve_event_path(const struct scan_watch *watch,
+                                const struct fanotify_event_info_fid *fid) {
+    struct file_handle *handle = (struct file_handle *)fid->handle;
+    const char *name = (const char *)handle->f_handle + handle->handle_bytes;
+    const struct watched_fs *fs = find_filesystem(watch, &fid->fsid);
+    if (!fs || strcmp(name, ".") == 0) {
+        return NULL;
+    }
+    int fd = open_by_handle_at(fs->fd, handle, O_PATH | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    char link[64];
+    char dir[PATH_MAX];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t dir_len = readlink(link, dir, sizeof(dir) - 1);
+    close(fd);
+    if (dir_len == -1) {
+        return NULL;
+    }
+    dir[dir_len] = '\0';
+    // The filesystem root resolves to "/", trim it like the root path
+    if (dir_len == 1) {
+        dir[--dir_len] = '\0';
+    }
+    if (!is_under(dir, watch->real_root, watch->real_root_len)) {
+        return NULL;
+    }
+
+    // Swap the canonical root for the one given by the user
+    size_t root_len = strlen(watch->root);
+    size_t rest_len = (size_t)dir_len - watch->real_root_len;
+    char *prefix = (char *)malloc(root_len + rest_len + 1);
+    if (!prefix) {
+        return NULL;
+    }
+    memcpy(prefix, watch->root, root_len);
+    memcpy(prefix + root_len, dir + watch->real_root_len, rest_len + 1);
+    char *path = join_path(prefix, root_len + rest_len, name);
+    free(prefix);
+    return path;
+}
+
+static int process_fanotify(struct scan_watch *watch, const char *events, size_t len,
+                            scan_watch_handler handler, void *arg) {
+    const struct fanotify_event_metadata *event = (const struct fanotify_event_metadata *)events;
+    ssize_t remaining = (ssize_t)len;
+    for (; FAN_EVENT_OK(event, remaining); event = FAN_EVENT_NEXT(event, remaining)) {
+        if (event->vers != FANOTIFY_METADATA_VERSION) {
+            LOG_ERROR("process_fanotify: Unexpected fanotify metadata version %d", event->vers);
+            return -1;
+        }
+        if (event->mask & FAN_Q_OVERFLOW) {
+            LOG_WARN("process_fanotify: Events were lost, scanning the whole tree again");
+            handler(SCAN_WATCH_TREE, fs_path(watch->root), arg);
+            continue;
+        }
+
+        const char *info = (const char *)event + event->metadata_len;
+        const char *info_end = (const char *)event + event->event_len;
+        while (info < info_end) {
+            const struct fanotify_event_info_fid *fid = (const struct fanotify_event_info_fid *)info;
+            info += fid->hdr.len;
+            if (fid->hdr.len == 0) {
+                break;
+            }
+            if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) {
+                continue;
+            }
+            char *path = resolve_event_path(watch, fid);
+            if (!path) {
+                continue;
+            }
+            if (event->mask & FAN_ONDIR) {
+                if (event->mask & (FAN_CREATE | FAN_MOVED_TO)) {
+                    handler(SCAN_WATCH_TREE, path, arg);
+                }
+            } else if (event->mask & (FAN_CLOSE_WRITE | FAN_MOVED_TO)) {
+                handler(SCAN_WATCH_FILE, path, arg);
+            }
+            free(path);
+        }
+    }
+    return 0;
+}
+
+static void release_fanotify(struct scan_watch *watch) {
+    for (size_t i = 0; i < watch->filesystems_len; i++) {
+        close(watch->filesystems[i].fd);
+    }
+    free(watch->filesystems);
+    watch->filesystems = NULL;
+    watch->filesystems_len = 0;
+    free(watch->real_root);
+    watch->real_root = NULL;
+    close(watch->fd);
+    watch->fd = -1;
+}
+
+// Set up fanotify, -1 if the process is not allowed to or the filesystems do not support it
+static int open_fanotify(struct scan_watch *watch) {
+    watch->fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_REPORT_DFID_NAME, O_RDONLY | O_CLOEXEC);
+    if (watch->fd == -1) {
+        return -1;
+    }
+    char *real_root = realpath(fs_path(watch->root), NULL);
+    watch->real_root = real_root ? trimmed_copy(real_root) : NULL;
+    free(real_root);
+    if (!watch->real_root) {
+        release_fanotify(watch);
+        return -1;
+    }
+    watch->real_root_len = strlen(watch->real_root);
+    if (mark_tree(watch) == -1) {
+        release_fanotify(watch);
+        return -1;
+    }
+    watch->backend = WATCH_FANOTIFY;
+    return 0;
+}
+
+static int open_inotify(struct scan_watch *watch) {
+    watch->fd = inotify_init1(IN_CLOEXEC);
+    if (watch->fd == -1) {
+        return -1;
+    }
+    add_tree(watch, watch->root);
+    if (!watch->paths) {
+        close(watch->fd);
+        watch->fd = -1;
+        return -1;
+    }
+    watch->backend = WATCH_INOTIFY;
+    return 0;
+}
+
+struct scan_watch *scan_watch_open(const char *root) {
+    struct scan_watch *watch = (struct scan_watch *)calloc(1, sizeof(struct scan_watch));
+    if (!watch) {
+        return NULL;
+    }
+    watch->fd = -1;
+    watch->root = trimmed_copy(root);
+    watch->events = (char *)malloc(WATCH_EVENTS_SIZE);
+    if (!watch->root || !watch->events) {
+        scan_watch_close(watch);
+        return NULL;
+    }
+    if (open_fanotify(watch) == 0) {
+        LOG_DEBUG("scan_watch_open: Watching %s through fanotify", root);
+        return watch;
+    }
+    if (open_inotify(watch) == 0) {
+        LOG_DEBUG("scan_watch_open: Watching %s through inotify", root);
+        return watch;
+    }
+    scan_watch_close(watch);
+    return NULL;
+}
+
+int scan_watch_wait(struct scan_watch *watch, scan_watch_handler handler, void *arg) {
+    ssize_t len = read(watch->fd, watch->events, WATCH_EVENTS_SIZE);
+    if (len <= 0) {
+        return -1;
+    }
+    if (watch->backend == WATCH_FANOTIFY) {
+        return process_fanotify(watch, watch->events, (size_t)len, handler, arg);
+    }
+    process_inotify(watch, watch->events, (size_t)len, handler, arg);
+    return 0;
+}
+
+void scan_watch_close(struct scan_watch *watch) {
+    if (!watch) {
+        return;
+    }
+    if (watch->backend == WATCH_FANOTIFY) {
+        release_fanotify(watch);
+    } else if (watch->fd != -1) {
+        close(watch->fd);
+    }
+    for (size_t i = 0; i < watch->paths_capacity; i++) {
+        free(watch->paths[i]);
+    }
+    free(watch->paths);
+    free(watch->root);
+    free(watch->events);
+    free(watch);
+}
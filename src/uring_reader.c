@@ -0,0 +1,339 @@
+#include "uring_reader.h"
+#include "logger.h"
+#include "scan_dir.h"
+#include <stdlib.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct uring_ring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+    /* SQEs filled but not submitted yet */
+    unsigned to_submit;
+};
+
+enum request_stage {
+    REQUEST_FREE,
+    REQUEST_OPEN,
+    REQUEST_READ,
+};
+
+struct uring_request {
+    enum request_stage stage;
+    size_t index;
+    int fd;
+    unsigned char *data;
+    size_t len;
+    size_t done;
+};
+
+static int ring_setup(struct uring_ring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size) {
+            ring->sq_size = ring->cq_size;
+        }
+        ring->cq_size = ring->sq_size;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            munmap(ring->sq_ptr, ring->sq_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_ptr != ring->sq_ptr) {
+            munmap(ring->cq_ptr, ring->cq_size);
+        }
+        munmap(ring->sq_ptr, ring->sq_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    unsigned char *sq = (unsigned char *)ring->sq_ptr;
+    unsigned char *cq = (unsigned char *)ring->cq_ptr;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->to_submit = 0;
+    return 0;
+}
+
+static void ring_teardown(struct uring_ring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->fd);
+}
+
+// The ring has as many SQEs as requests can be in flight, so this never runs out
+static struct io_uring_sqe *ring_get_sqe(struct uring_ring *ring) {
+    unsigned tail = *ring->sq_tail + ring->to_submit;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->to_submit++;
+    return sqe;
+}
+
+static int ring_submit_and_wait(struct uring_ring *ring, unsigned wait_nr) {
+    unsigned submit = ring->to_submit;
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + submit, __ATOMIC_RELEASE);
+    ring->to_submit = 0;
+    for (;;) {
+        long ret = syscall(__NR_io_uring_enter, ring->fd, submit, wait_nr,
+                           wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0) {
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+        // Interrupted after the kernel consumed the SQEs, only wait now
+        submit = 0;
+    }
+}
+
+static struct io_uring_cqe *ring_peek_cqe(struct uring_ring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+static void ring_cqe_seen(struct uring_ring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_reader_init(struct uring_reader *reader) {
+    reader->ring = (struct uring_ring *)malloc(sizeof(struct uring_ring));
+    if (!reader->ring) {
+        return -1;
+    }
+    if (ring_setup(reader->ring, URING_READER_DEPTH) == -1) {
+        LOG_DEBUG("uring_reader_init: io_uring_setup failed: %s", strerror(errno));
+        free(reader->ring);
+        reader->ring = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void uring_reader_exit(struct uring_reader *reader) {
+    if (reader->ring) {
+        ring_teardown(reader->ring);
+        free(reader->ring);
+        reader->ring = NULL;
+    }
+}
+
+static void queue_open(struct uring_ring *ring, struct uring_request *request, int dirfd,
+                       const struct scan_entry *entry) {
+    struct io_uring_sqe *sqe = ring_get_sqe(ring);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = dirfd;
+    sqe->addr = (unsigned long)entry->name;
+    sqe->open_flags = O_RDONLY | O_NOFOLLOW | O_CLOEXEC;
+    sqe->user_data = (unsigned long)request;
+    request->stage = REQUEST_OPEN;
+}
+
+static void queue_read(struct uring_ring *ring, struct uring_request *request) {
+    struct io_uring_sqe *sqe = ring_get_sqe(ring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = request->fd;
+    sqe->addr = (unsigned long)(request->data + request->done);
+    sqe->len = (unsigned)(request->len - request->done);
+    sqe->off = request->done;
+    sqe->user_data = (unsigned long)request;
+    request->stage = REQUEST_READ;
+}
+
+static void finish_request(struct uring_request *request) {
+    if (request->fd != -1) {
+        close(request->fd);
+        request->fd = -1;
+    }
+    free(request->data);
+    request->data = NULL;
+    request->stage = REQUEST_FREE;
+}
+
+int uring_reader_run(struct uring_reader *reader, int dirfd, struct scan_entry *const *entries,
+                     size_t len, uring_read_handler handler, void *arg) {
+    struct uring_ring *ring = reader->ring;
+    struct uring_request requests[URING_READER_DEPTH];
+    size_t next = 0, in_flight = 0;
+    int status = 0;
+
+    for (size_t i = 0; i < URING_READER_DEPTH; i++) {
+        requests[i].stage = REQUEST_FREE;
+        requests[i].fd = -1;
+        requests[i].data = NULL;
+    }
+
+    while (status == 0 && (next < len || in_flight > 0)) {
+        // Top up the queue with new files
+        for (size_t slot = 0; slot < URING_READER_DEPTH && next < len && status == 0; slot++) {
+            struct uring_request *request = &requests[slot];
+            if (request->stage != REQUEST_FREE) {
+                continue;
+            }
+            const struct scan_entry *entry = entries[next];
+            if (entry->size > URING_READER_MAX_FILE_SIZE ||
+                !(request->data = (unsigned char *)malloc((size_t)entry->size))) {
+                status = handler(next++, NULL, 0, arg);
+                continue;
+            }
+            request->index = next++;
+            request->len = (size_t)entry->size;
+            request->done = 0;
+            queue_open(ring, request, dirfd, entry);
+            in_flight++;
+        }
+        if (in_flight == 0) {
+            continue;
+        }
+
+        if (ring_submit_and_wait(ring, 1) == -1) {
+            LOG_ERROR("uring_reader_run: io_uring_enter failed: %s", strerror(errno));
+            status = -1;
+            break;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = ring_peek_cqe(ring)) != NULL) {
+            struct uring_request *request = (struct uring_request *)(unsigned long)cqe->user_data;
+            int res = cqe->res;
+            ring_cqe_seen(ring);
+
+            if (res < 0) {
+                // Let the synchronous path deal with (and report) the error
+                finish_request(request);
+                in_flight--;
+                if (status == 0) {
+                    status = handler(request->index, NULL, 0, arg);
+                }
+                continue;
+            }
+            if (request->stage == REQUEST_OPEN) {
+                request->fd = res;
+            } else {
+                request->done += (size_t)res;
+            }
+            if (status == 0 && (request->stage == REQUEST_OPEN ||
+                                (res > 0 && request->done < request->len))) {
+                queue_read(ring, request);
+                continue;
+            }
+            // Complete, or the file shrank since it was listed
+            in_flight--;
+            if (status == 0) {
+                status = handler(request->index, request->data, request->done, arg);
+            }
+            finish_request(request);
+        }
+        if (ring->to_submit && ring_submit_and_wait(ring, 0) == -1) {
+            status = -1;
+        }
+    }
+
+    // Reap whatever is still in flight after an early stop
+    while (in_flight > 0 && ring_submit_and_wait(ring, 1) == 0) {
+        struct io_uring_cqe *cqe;
+        while ((cqe = ring_peek_cqe(ring)) != NULL) {
+            struct uring_request *request = (struct uring_request *)(unsigned long)cqe->user_data;
+            if (request->stage == REQUEST_OPEN && cqe->res >= 0) {
+                request->fd = cqe->res;
+            }
+            ring_cqe_seen(ring);
+            finish_request(request);
+            in_flight--;
+        }
+    }
+    return status;
+}
+
+#else /* HAVE_IO_URING */
+
+int uring_reader_init(struct uring_reader *reader) {
+    reader->ring = NULL;
+    return -1;
+}
+
+void uring_reader_exit(struct uring_reader *reader) {
+    (void)reader;
+}
+
+int uring_reader_run(struct uring_reader *reader, int dirfd, struct scan_entry *const *entries,
+                     size_t len, uring_read_handler handler, void *arg) {
+    (void)reader;
+    (void)dirfd;
+    (void)entries;
+    for (size_t i = 0; i < len; i++) {
+        if (handler(i, NULL, 0, arg) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#endif /* HAVE_IO_URING */